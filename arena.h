@@ -0,0 +1,156 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <alsa/asoundlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#define ARENA_ALIGN 64				/* cache line */
+#define ARENA_HUGE_PAGE (2 * 1024 * 1024)
+#define ARENA_DEFAULT_SIZE (4 * 1024 * 1024)
+
+#define ARENA_HUGE 1		/* try to back the arena with huge pages */
+
+/**
+ * Bump allocator over one anonymous mapping made up front.
+ * Allocations are never freed one by one: take a mark before setting
+ * up a stream and reset to it on teardown, so streams can come and go
+ * without touching the heap. Not thread safe; allocate during setup.
+ */
+struct arena
+{
+    char *base;
+    size_t size;
+    size_t used;
+    int huge;			/* backed by huge pages */
+};
+
+
+/**
+ * Map and prefault the arena memory
+ * @param *arena arena to initialise
+ * @param size bytes to reserve
+ * @param flags ARENA_HUGE or 0
+ * @return 0 on success or -errno
+ */
+int arena_init(struct arena *arena,
+	       size_t size,
+	       int flags)
+{
+    void *p = MAP_FAILED;
+
+    arena->used = 0;
+    arena->huge = 0;
+#ifdef MAP_HUGETLB
+    if (flags & ARENA_HUGE)
+    {
+	size_t huge = (size + ARENA_HUGE_PAGE - 1) & ~(size_t) (ARENA_HUGE_PAGE - 1);
+	p = mmap(NULL, huge, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE,
+		 -1, 0);
+	if (p != MAP_FAILED)
+	{
+	    size = huge;
+	    arena->huge = 1;
+	}
+    }
+#endif
+    /* no huge pages reserved (vm.nr_hugepages) or not asked for */
+    if (p == MAP_FAILED)
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (p == MAP_FAILED)
+	return -errno;
+    arena->base = p;
+    arena->size = size;
+    return 0;
+}
+
+
+/**
+ * Carve an aligned block out of the arena
+ * @param *arena arena
+ * @param size bytes wanted
+ * @param align alignment, a power of two; 0 for ARENA_ALIGN
+ * @return the block, zeroed, or NULL if the arena is full
+ */
+void *arena_alloc(struct arena *arena,
+		  size_t size,
+		  size_t align)
+{
+    uintptr_t start;
+    char *p;
+
+    if (align < ARENA_ALIGN)
+	align = ARENA_ALIGN;
+    start = ((uintptr_t) arena->base + arena->used + align - 1) & ~(uintptr_t) (align - 1);
+    if (start + size > (uintptr_t) arena->base + arena->size)
+	return NULL;
+    p = (char *) start;
+    arena->used = p + size - arena->base;
+    /* blocks may be reused after a reset */
+    memset(p, 0, size);
+    return p;
+}
+
+
+/**
+ * Current fill of the arena, to reset to later
+ * @param *arena arena
+ * @return mark for arena_reset()
+ */
+size_t arena_mark(struct arena *arena)
+{
+    return arena->used;
+}
+
+
+/**
+ * Release every block allocated since a mark
+ * @param *arena arena
+ * @param mark value from arena_mark()
+ */
+void arena_reset(struct arena *arena,
+		 size_t mark)
+{
+    arena->used = mark;
+}
+
+
+/**
+ * Hardware parameters container in the arena, as snd_pcm_hw_params_malloc()
+ * @param *arena arena
+ * @return container, or NULL if the arena is full
+ */
+snd_pcm_hw_params_t *arena_hw_params(struct arena *arena)
+{
+    return arena_alloc(arena, snd_pcm_hw_params_sizeof(), 0);
+}
+
+
+/**
+ * Software parameters container in the arena, as snd_pcm_sw_params_malloc()
+ * @param *arena arena
+ * @return container, or NULL if the arena is full
+ */
+snd_pcm_sw_params_t *arena_sw_params(struct arena *arena)
+{
+    return arena_alloc(arena, snd_pcm_sw_params_sizeof(), 0);
+}
+
+
+/**
+ * Unmap the arena
+ * @param *arena arena
+ */
+void arena_destroy(struct arena *arena)
+{
+    munmap(arena->base, arena->size);
+    arena->base = NULL;
+    arena->size = 0;
+    arena->used = 0;
+}
+
+#endif
@@ -0,0 +1,278 @@
+/*
+ *  Offline benchmark of the rate converter of resample.h against the
+ *  rate conversion of the alsa-lib plug layer. No sound card is needed:
+ *  our converter runs into memory, the plug layer into a "null" slave.
+ *
+ *  Compile:
+ *  gcc -O2 bench_resample.c -o bench_resample -lasound -lm
+ *
+ *  Usage:
+ *  ./bench_resample [-t seconds_per_case] [-p period_frames] [-c channels]
+ *                   [-i in_rate -o out_rate] [--check]
+ *
+ *  The cost is CPU time per channel per second of audio converted, in
+ *  microseconds: 10000 us is 1% of a core for each channel. Both sides
+ *  take and give S16_LE. The plug rows include the plug's own copy into
+ *  its slave, which the "copy" row, with no conversion at all, measures.
+ *  Converters from alsa-plugins (speexrate, samplerate) are only there
+ *  when installed. --check only runs the format conversion self-check
+ *  and exits with its result.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <alsa/asoundlib.h>
+#include "resample.h"
+#include "fmtconv.h"
+static const char *converters[] = {
+  "copy", "linear", "speexrate", "speexrate_medium", "speexrate_best",
+  "samplerate_linear", "samplerate", "samplerate_best",
+};
+static unsigned int rate_pairs[][2] = {
+  { 44100, 48000 },
+  { 48000, 44100 },
+  { 96000, 48000 },
+};
+static double min_time = 0.5;                   /* CPU seconds per measurement */
+static snd_pcm_uframes_t period = 1024;         /* input frames per call */
+static unsigned int channels = 2;
+static struct arena periods;                    /* the input period of the plug rows */
+static double cpu_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+/*
+ *   A period of test signal: two tones, one of them different on each
+ *   channel, so no converter can take a shortcut on silence
+ */
+static void fill_input(int16_t *in, unsigned int rate)
+{
+  snd_pcm_uframes_t i;
+  unsigned int chn;
+  for (i = 0; i < period; i++)
+    for (chn = 0; chn < channels; chn++)
+      in[i * channels + chn] = 12000 * sin(2 * M_PI * (440 + 110 * chn) * i / rate) +
+	4000 * sin(2 * M_PI * 9000 * i / rate);
+}
+static void print_cost(const char *name, double cpu, unsigned long long frames,
+		       unsigned int in_rate)
+{
+  double us = cpu * 1e6 / ((double) frames / in_rate * channels);
+  printf("%-20s %12.1f %8.3f\n", name, us, us / 1e4);
+}
+static void bench_ours(enum resample_quality quality, unsigned int in_rate,
+		       unsigned int out_rate)
+{
+  struct arena arena;
+  struct resampler r;
+  struct fmtconv s16;
+  unsigned long long frames = 0;
+  size_t out_max;
+  double t0, t1;
+  int16_t *in, *out;
+  float *fin, *fout;
+  char name[32];
+  long got;
+  if (arena_init(&arena, resample_arena_size(channels, in_rate, out_rate,
+					     quality, period) +
+		 8 * (period + 2) * channels * sizeof(float) * 4 + 65536, 0) < 0 ||
+      resample_init(&r, &arena, channels, in_rate, out_rate, quality, period) < 0) {
+    printf("Can't convert %u Hz to %u Hz\n", in_rate, out_rate);
+    exit(EXIT_FAILURE);
+  }
+  out_max = resample_max_out(&r, period);
+  in = arena_alloc(&arena, period * channels * sizeof(*in), 0);
+  fin = arena_alloc(&arena, period * channels * sizeof(*fin), 0);
+  fout = arena_alloc(&arena, out_max * channels * sizeof(*fout), 0);
+  out = arena_alloc(&arena, out_max * channels * sizeof(*out), 0);
+  if (in == NULL || fin == NULL || fout == NULL || out == NULL) {
+    printf("No enough memory\n");
+    exit(EXIT_FAILURE);
+  }
+  fill_input(in, in_rate);
+  fmtconv_init(&s16, SND_PCM_FORMAT_S16_LE);
+  t0 = cpu_now();
+  do {
+    fmtconv_decode(&s16, fin, in, period * channels);
+    got = resample_process(&r, fin, period, fout, out_max);
+    fmtconv_encode(&s16, out, fout, got * channels);
+    frames += period;
+    t1 = cpu_now();
+  } while (t1 - t0 < min_time);
+  snprintf(name, sizeof(name), "resample %s", resample_tiers[quality].name);
+  print_cost(name, t1 - t0, frames, in_rate);
+  arena_destroy(&arena);
+}
+/*
+ *   A plug PCM over a null slave at out_rate, built from a configuration
+ *   of our own so the global one (and its defaults) stays out of it
+ */
+static int open_plug(snd_pcm_t **pcm, snd_config_t **config,
+		     const char *converter, unsigned int out_rate)
+{
+  snd_input_t *input;
+  char text[512];
+  int err;
+  snprintf(text, sizeof(text),
+	   "pcm.bench {\n"
+	   "  type plug\n"
+	   "  slave { pcm { type null } rate %u format S16_LE }\n"
+	   "  rate_converter \"%s\"\n"
+	   "}\n", out_rate, strcmp(converter, "copy") ? converter : "linear");
+  if ((err = snd_config_top(config)) < 0)
+    return err;
+  if ((err = snd_input_buffer_open(&input, text, -1)) < 0) {
+    snd_config_delete(*config);
+    return err;
+  }
+  err = snd_config_load(*config, input);
+  snd_input_close(input);
+  if (err >= 0)
+    err = snd_pcm_open_lconf(pcm, "bench", SND_PCM_STREAM_PLAYBACK, 0, *config);
+  if (err < 0)
+    snd_config_delete(*config);
+  return err;
+}
+static void bench_plug(const char *converter, unsigned int in_rate,
+		       unsigned int out_rate)
+{
+  snd_pcm_t *pcm;
+  snd_config_t *config;
+  unsigned long long frames = 0;
+  snd_pcm_sframes_t n = 0;
+  double t0, t1;
+  int16_t *in;
+  char name[32];
+  size_t mark;
+  int err;
+  snprintf(name, sizeof(name), "plug %s", converter);
+  /* the copy row runs the plug at one rate on both sides */
+  if (!strcmp(converter, "copy"))
+    out_rate = in_rate;
+  if (open_plug(&pcm, &config, converter, out_rate) < 0) {
+    printf("%-20s %12s\n", name, "unavailable");
+    return;
+  }
+  /* an unknown rate_converter only shows up when the plug is set up */
+  if ((err = snd_pcm_set_params(pcm, SND_PCM_FORMAT_S16_LE,
+				SND_PCM_ACCESS_RW_INTERLEAVED, channels,
+				in_rate, 1, 500000)) < 0) {
+    printf("%-20s %12s\n", name, "unavailable");
+    snd_pcm_close(pcm);
+    snd_config_delete(config);
+    return;
+  }
+  mark = arena_mark(&periods);
+  in = arena_alloc(&periods, period * channels * sizeof(*in), 0);
+  if (in == NULL) {
+    printf("No enough memory\n");
+    exit(EXIT_FAILURE);
+  }
+  fill_input(in, in_rate);
+  t0 = cpu_now();
+  do {
+    n = snd_pcm_writei(pcm, in, period);
+    if (n < 0 && (n = snd_pcm_recover(pcm, n, 1)) < 0) {
+      printf("%-20s write failed: %s\n", name, snd_strerror(n));
+      break;
+    }
+    frames += n;
+    t1 = cpu_now();
+  } while (t1 - t0 < min_time);
+  if (n >= 0)
+    print_cost(name, t1 - t0, frames, in_rate);
+  snd_pcm_close(pcm);
+  snd_config_delete(config);
+  arena_reset(&periods, mark);
+}
+static void help(void)
+{
+  printf(
+"Usage: bench_resample [OPTION]...\n"
+"-h,--help      help\n"
+"-t,--time      CPU seconds to measure each case\n"
+"-p,--period    input frames converted per call\n"
+"-c,--channels  channel count\n"
+"-i,--in        only this input rate (with -o)\n"
+"-o,--out       only this output rate (with -i)\n"
+"-C,--check     check the format conversion rounding and exit\n"
+"\n");
+}
+int main(int argc, char *argv[])
+{
+  struct option long_option[] =
+    {
+      {"help", 0, NULL, 'h'},
+      {"time", 1, NULL, 't'},
+      {"period", 1, NULL, 'p'},
+      {"channels", 1, NULL, 'c'},
+      {"in", 1, NULL, 'i'},
+      {"out", 1, NULL, 'o'},
+      {"check", 0, NULL, 'C'},
+      {NULL, 0, NULL, 0},
+    };
+  unsigned int in_rate = 0, out_rate = 0, k, q, conv;
+  unsigned int pairs = sizeof(rate_pairs) / sizeof(rate_pairs[0]);
+  while (1) {
+    int c;
+    if ((c = getopt_long(argc, argv, "ht:p:c:i:o:C", long_option, NULL)) < 0)
+      break;
+    switch (c) {
+    case 'h':
+      help();
+      return 0;
+    case 't':
+      min_time = atof(optarg);
+      min_time = min_time < 0.01 ? 0.01 : min_time;
+      break;
+    case 'p':
+      period = atoi(optarg);
+      period = period < 16 ? 16 : period;
+      period = period > 65536 ? 65536 : period;
+      break;
+    case 'c':
+      channels = atoi(optarg);
+      channels = channels < 1 ? 1 : channels;
+      channels = channels > 64 ? 64 : channels;
+      break;
+    case 'i':
+      in_rate = atoi(optarg);
+      break;
+    case 'o':
+      out_rate = atoi(optarg);
+      break;
+    case 'C':
+      if (fmtconv_check() < 0) {
+	printf("Format conversion rounding FAILED\n");
+	return 1;
+      }
+      printf("Format conversion rounding ok\n");
+      return 0;
+    }
+  }
+  if (arena_init(&periods, period * channels * sizeof(int16_t) + 65536, 0) < 0) {
+    printf("No enough memory\n");
+    return 1;
+  }
+  if (in_rate && out_rate) {
+    rate_pairs[0][0] = in_rate;
+    rate_pairs[0][1] = out_rate;
+    pairs = 1;
+  }
+  for (k = 0; k < pairs; k++) {
+    printf("%u Hz -> %u Hz, %u channels, %lu frame periods\n",
+	   rate_pairs[k][0], rate_pairs[k][1], channels, period);
+    printf("%-20s %12s %8s\n", "converter", "us/ch/s", "% core");
+    for (q = RESAMPLE_FAST; q <= RESAMPLE_BEST; q++)
+      bench_ours(q, rate_pairs[k][0], rate_pairs[k][1]);
+    for (conv = 0; conv < sizeof(converters) / sizeof(converters[0]); conv++)
+      bench_plug(converters[conv], rate_pairs[k][0], rate_pairs[k][1]);
+    printf("\n");
+  }
+  arena_destroy(&periods);
+  return 0;
+}
@@ -0,0 +1,214 @@
+/*
+ *  Offline benchmark of the sine generator and its sample format writers.
+ *  No sound card is needed: samples are generated into memory.
+ *
+ *  Compile:
+ *  gcc -O2 bench_sine.c -o bench_sine -lasound -lm
+ *
+ *  Usage:
+ *  ./bench_sine [-t seconds_per_case] [-p period_frames] [-o format] [-c channels]
+ *               [--kernel=NAME]
+ *
+ *  The "osc" rows run the sample kernels picked for this CPU, or the ones
+ *  named with --kernel, to compare instruction set levels.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <alsa/asoundlib.h>
+#include "osc.h"
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+typedef void (*generator_t)(const snd_pcm_channel_area_t *areas,
+			    snd_pcm_uframes_t offset,
+			    int count,
+			    unsigned int channels,
+			    snd_pcm_format_t format,
+			    double freq,
+			    unsigned int rate,
+			    double *_phase);
+static struct {
+  const char *name;
+  generator_t generate;
+} generators[] = {
+  { "ref", osc_generate_ref },
+  { "osc", osc_generate },
+};
+static unsigned int channel_counts[] = { 1, 2, 8, 64, 1024 };
+static double min_time = 0.2;                   /* seconds per measurement */
+static snd_pcm_uframes_t period = 1024;         /* frames per generator call */
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+static unsigned long long cycles(void)
+{
+#if HAVE_TSC
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+/*
+ *   Lay out the channel areas the way sine_new.c does for interleaved
+ *   access, or one block per channel for non-interleaved access
+ */
+static void setup_areas(snd_pcm_channel_area_t *areas, void *samples,
+			unsigned int channels, int width, int interleaved)
+{
+  unsigned int chn;
+  for (chn = 0; chn < channels; chn++) {
+    areas[chn].addr = samples;
+    if (interleaved) {
+      areas[chn].first = chn * width;
+      areas[chn].step = channels * width;
+    } else {
+      areas[chn].first = chn * period * width;
+      areas[chn].step = width;
+    }
+  }
+}
+static int usable(const snd_pcm_channel_area_t *areas, unsigned int channels)
+{
+  unsigned int chn;
+  /* the generator only handles byte aligned, 16 bit multiple steps */
+  for (chn = 0; chn < channels; chn++)
+    if (areas[chn].first % 8 || areas[chn].step % 16)
+      return 0;
+  return 1;
+}
+static void bench_case(generator_t generate, const char *name,
+		       snd_pcm_format_t format, unsigned int channels,
+		       int interleaved)
+{
+  int width = snd_pcm_format_physical_width(format);
+  snd_pcm_channel_area_t areas[channels];
+  unsigned long long frames = 0, c0, c1;
+  double phase = 0, t0, t1;
+  void *samples;
+  samples = calloc(period * channels, width / 8);
+  if (samples == NULL) {
+    printf("No enough memory\n");
+    exit(EXIT_FAILURE);
+  }
+  setup_areas(areas, samples, channels, width, interleaved);
+  printf("%-4s %-12s %5u %-15s ", name, snd_pcm_format_name(format),
+	 channels, interleaved ? "interleaved" : "noninterleaved");
+  if (!usable(areas, channels)) {
+    printf("%14s\n", "unsupported");
+    free(samples);
+    return;
+  }
+  /* warm up caches and page in the buffer */
+  generate(areas, 0, period, channels, format, 440, 48000, &phase);
+  t0 = now();
+  c0 = cycles();
+  do {
+    generate(areas, 0, period, channels, format, 440, 48000, &phase);
+    frames += period;
+    t1 = now();
+  } while (t1 - t0 < min_time);
+  c1 = cycles();
+  printf("%14.0f %10.2f", frames / (t1 - t0), (t1 - t0) * 1e9 / frames);
+  if (HAVE_TSC)
+    printf(" %13.3f\n", (double) (c1 - c0) / (frames * channels));
+  else
+    printf(" %13s\n", "n/a");
+  free(samples);
+}
+static int benchable_format(snd_pcm_format_t format)
+{
+  /* the same formats sine_new.c accepts for -o */
+  return snd_pcm_format_name(format) &&
+    (snd_pcm_format_linear(format) ||
+     format == SND_PCM_FORMAT_FLOAT_LE ||
+     format == SND_PCM_FORMAT_FLOAT_BE);
+}
+static void help(void)
+{
+  printf(
+"Usage: bench_sine [OPTION]...\n"
+"-h,--help      help\n"
+"-t,--time      seconds to measure each case\n"
+"-p,--period    frames generated per call\n"
+"-o,--format    only this sample format\n"
+"-c,--channels  only this channel count\n"
+"\n");
+  kernel_usage(stdout);
+}
+int main(int argc, char *argv[])
+{
+  struct option long_option[] =
+    {
+      {"help", 0, NULL, 'h'},
+      {"time", 1, NULL, 't'},
+      {"period", 1, NULL, 'p'},
+      {"format", 1, NULL, 'o'},
+      {"channels", 1, NULL, 'c'},
+      {NULL, 0, NULL, 0},
+    };
+  snd_pcm_format_t format, only_format = SND_PCM_FORMAT_UNKNOWN;
+  unsigned int only_channels = 0, g, k;
+  struct kernel_config kernel;
+  int interleaved;
+  kernel_parse_args(&argc, argv, &kernel);
+  while (1) {
+    int c;
+    if ((c = getopt_long(argc, argv, "ht:p:o:c:", long_option, NULL)) < 0)
+      break;
+    switch (c) {
+    case 'h':
+      help();
+      return 0;
+    case 't':
+      min_time = atof(optarg);
+      min_time = min_time < 0.01 ? 0.01 : min_time;
+      break;
+    case 'p':
+      period = atoi(optarg);
+      period = period < 16 ? 16 : period;
+      period = period > 65536 ? 65536 : period;
+      break;
+    case 'o':
+      only_format = snd_pcm_format_value(optarg);
+      if (!benchable_format(only_format)) {
+	printf("Invalid (non-linear/float) format %s\n", optarg);
+	return 1;
+      }
+      break;
+    case 'c':
+      only_channels = atoi(optarg);
+      only_channels = only_channels > 1024 ? 1024 : only_channels;
+      break;
+    }
+  }
+  if (kernel.check)
+    return osc_kernel_report(stdout) ? 1 : 0;
+  printf("Sample kernels: %s\n", kernel_isa_names[osc_kernel_select(kernel.isa)]);
+  printf("%-4s %-12s %5s %-15s %14s %10s %13s\n", "gen", "format",
+	 "chans", "layout", "frames/s", "ns/frame", "cycles/sample");
+  for (format = 0; format < SND_PCM_FORMAT_LAST; format++) {
+    if (!benchable_format(format))
+      continue;
+    if (only_format != SND_PCM_FORMAT_UNKNOWN && format != only_format)
+      continue;
+    for (k = 0; k < sizeof(channel_counts) / sizeof(channel_counts[0]); k++) {
+      unsigned int channels = only_channels ? only_channels : channel_counts[k];
+      for (interleaved = 1; interleaved >= 0; interleaved--)
+	for (g = 0; g < sizeof(generators) / sizeof(generators[0]); g++)
+	  bench_case(generators[g].generate, generators[g].name,
+		     format, channels, interleaved);
+      if (only_channels)
+	break;
+    }
+  }
+  return 0;
+}
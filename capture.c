@@ -2,35 +2,418 @@
  * Simple sound capture using ALSA API and libasound.
  *
  * Compile:
- * gcc  capture.c -o capture -lasound
- * 
+ * gcc -O2 capture.c -o capture -lasound -lpthread
+ *
+ * Usage:
+ * $ ./capture [--rt-priority N] [--rt-cpu N] [--rt-mlock]
+ * $ ./capture [-D device] [-r rate] [-c channels] [-d seconds] [-O]
+ *             [rt flags] file.wav
+ *
+ * Examples:
+ * $ ./capture
+ * $ ./capture -d 3600 -O --rt-priority 70 --rt-mlock long.wav
+ *
+ * Without a file a few periods are captured and thrown away.
+ * With one, audio is recorded to a WAV file until the duration runs
+ * out or SIGINT/SIGTERM, in S16_LE or, if the device doesn't take
+ * that, the best of the formats WAV holds that it does take. The capture loop only fills blocks of a ring
+ * of RING_SECONDS in memory; a writer thread flushes finished blocks
+ * to disk in batches, so a stalling file system costs ring space, not
+ * an overrun. If the ring does fill up, audio is dropped and reported
+ * rather than stalling the device. -O writes with O_DIRECT, past the
+ * page cache. The RIFF header is fixed up at the end.
  */
- 
+
+#include "rt.h"
 #include "mypcm.h"
+#include "wav.h"
+#include "arena.h"
+#include <getopt.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
 #define SIZE 128
 #define CHANNELS 2
 #define RATE 44100
 #define LOOPS 10
 
+#define RING_SECONDS 8			/* audio held while the disk stalls */
+#define BLOCK_ALIGN 4096		/* block and file alignment for O_DIRECT */
+#define BLOCK_BYTES (256 * 1024)	/* about the size of one block */
+
+/**
+ * Ring of capture blocks shared with the writer thread. Blocks are
+ * contiguous, so a run of finished blocks goes out in one write
+ */
+struct block_ring
+{
+    char *base;
+    size_t block_bytes;		/* whole frames, multiple of BLOCK_ALIGN */
+    unsigned long blocks;
+    _Atomic unsigned long filled;	/* blocks finished by the capture loop */
+    _Atomic unsigned long flushed;	/* blocks written by the writer */
+    _Atomic int done;		/* capture is over, tail_bytes is valid */
+    size_t tail_bytes;		/* bytes of the last, partial block */
+    sem_t ready;		/* posted per finished block and at the end */
+    int fd;
+    uint64_t written;		/* data bytes in the file */
+    int error;			/* errno of a failed write */
+};
+
+/* formats WAV files hold, to record in when S16_LE isn't native */
+static const snd_pcm_format_t wav_formats[] = {
+    SND_PCM_FORMAT_FLOAT_LE, SND_PCM_FORMAT_S32_LE, SND_PCM_FORMAT_S24_3LE,
+    SND_PCM_FORMAT_UNKNOWN
+};
+
+static struct arena arena;
+static volatile sig_atomic_t stop = 0;
+
+
+static void on_stop(int sig ATTRIBUTE_UNUSED)
+{
+    stop = 1;
+}
+
+
+/**
+ * Write a whole buffer at an offset, retrying short writes
+ * @param fd file descriptor
+ * @param *buf data
+ * @param len bytes to write
+ * @param offset file offset
+ * @return 0 on success or a positive error number
+ */
+static int write_full(int fd,
+		      const char *buf,
+		      size_t len,
+		      off_t offset)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+	n = pwrite(fd, buf, len, offset);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return n < 0 ? errno : EIO;
+	buf += n;
+	len -= n;
+	offset += n;
+    }
+    return 0;
+}
+
+
+/**
+ * Writer thread: flush every finished block, each contiguous run of
+ * blocks in a single write, then the partial last block
+ * @param *arg the block_ring
+ */
+static void *writer_thread(void *arg)
+{
+    struct block_ring *ring = arg;
+    unsigned long flushed = 0, filled, index, run;
+    off_t offset = lseek(ring->fd, 0, SEEK_CUR);
+    int done;
+
+    while (!ring->error)
+    {
+	sem_wait(&ring->ready);
+	/* done first: every block finished before it is in filled */
+	done = atomic_load(&ring->done);
+	filled = atomic_load(&ring->filled);
+	while (flushed < filled && !ring->error)
+	{
+	    index = flushed % ring->blocks;
+	    run = filled - flushed;
+	    if (run > ring->blocks - index)
+		run = ring->blocks - index;
+	    ring->error = write_full(ring->fd,
+				     ring->base + index * ring->block_bytes,
+				     run * ring->block_bytes, offset);
+	    offset += run * ring->block_bytes;
+	    ring->written += run * ring->block_bytes;
+	    flushed += run;
+	    atomic_store(&ring->flushed, flushed);
+	}
+	if (done)
+	    break;
+    }
+    if (!ring->error && ring->tail_bytes)
+    {
+	/* O_DIRECT wants whole blocks, the tail goes through the cache */
+	fcntl(ring->fd, F_SETFL, fcntl(ring->fd, F_GETFL) & ~O_DIRECT);
+	index = flushed % ring->blocks;
+	ring->error = write_full(ring->fd, ring->base + index * ring->block_bytes,
+				 ring->tail_bytes, offset);
+	if (!ring->error)
+	    ring->written += ring->tail_bytes;
+    }
+    return NULL;
+}
+
+
+/**
+ * Capture into the ring until the duration is reached or a signal
+ * stops us. Never waits on the writer: with the ring full, periods
+ * are read into a scratch buffer and counted as dropped
+ * @param *capture_handle handle to capture, prepared
+ * @param *ring block ring with the writer running
+ * @param *info stream parameters
+ * @param period period size in frames
+ * @param total frames to capture
+ * @return frames dropped because the ring was full
+ */
+static snd_pcm_uframes_t capture_loop(snd_pcm_t *capture_handle,
+				      struct block_ring *ring,
+				      const struct wav_info *info,
+				      snd_pcm_uframes_t period,
+				      snd_pcm_uframes_t total)
+{
+    snd_pcm_uframes_t block_frames = ring->block_bytes / info->block_align;
+    snd_pcm_uframes_t pos = 0, done = 0, frames, dropped = 0;
+    unsigned long filled = 0;
+    char *scratch, *block = ring->base;
+    int full = 0;
+
+    scratch = arena_alloc(&arena, period * info->block_align, 0);
+    if (scratch == NULL)
+    {
+	printf("ERROR: No enough memory\n");
+	exit(1);
+    }
+    while (!stop && done < total)
+    {
+	frames = total - done < period ? total - done : period;
+	if (pos == 0 && filled - atomic_load(&ring->flushed) >= ring->blocks)
+	{
+	    if (!full)
+		fprintf(stderr, "WARNING: disk is behind, dropping audio\n");
+	    full = 1;
+	    if (record(capture_handle, scratch, frames) < 0)
+		break;
+	    dropped += frames;
+	    done += frames;
+	    continue;
+	}
+	full = 0;
+	if (frames > block_frames - pos)
+	    frames = block_frames - pos;
+	if (record(capture_handle, block + pos * info->block_align, frames) < 0)
+	    break;	/* keep what we have, the file is still finished */
+	pos += frames;
+	done += frames;
+	if (pos == block_frames)
+	{
+	    atomic_store(&ring->filled, ++filled);
+	    sem_post(&ring->ready);
+	    block = ring->base + (filled % ring->blocks) * ring->block_bytes;
+	    pos = 0;
+	}
+    }
+    ring->tail_bytes = pos * info->block_align;
+    atomic_store(&ring->done, 1);
+    sem_post(&ring->ready);
+    return dropped;
+}
+
+
+/**
+ * Record to a WAV file through the block ring and the writer thread
+ * @param *capture_handle handle to capture, prepared
+ * @param *path file to create
+ * @param *info stream parameters
+ * @param period period size in frames
+ * @param seconds duration, 0 until stopped
+ * @param direct write with O_DIRECT
+ */
+static void record_wav(snd_pcm_t *capture_handle,
+		       const char *path,
+		       struct wav_info *info,
+		       snd_pcm_uframes_t period,
+		       int seconds,
+		       int direct)
+{
+    struct block_ring ring;
+    struct sigaction sa;
+    pthread_t writer;
+    snd_pcm_uframes_t total, dropped;
+    size_t unit;
+    int err;
+
+    /* whole frames, and whole O_DIRECT blocks */
+    unit = info->block_align;
+    while (unit % BLOCK_ALIGN)
+	unit += info->block_align;
+    ring.block_bytes = (BLOCK_BYTES + unit - 1) / unit * unit;
+    ring.blocks = ((size_t) RING_SECONDS * info->rate * info->block_align +
+		   ring.block_bytes - 1) / ring.block_bytes;
+    ring.base = arena_alloc(&arena, ring.blocks * ring.block_bytes, BLOCK_ALIGN);
+    if (ring.base == NULL)
+    {
+	printf("ERROR: No enough memory\n");
+	exit(1);
+    }
+    atomic_init(&ring.filled, 0);
+    atomic_init(&ring.flushed, 0);
+    atomic_init(&ring.done, 0);
+    ring.tail_bytes = 0;
+    ring.written = 0;
+    ring.error = 0;
+    sem_init(&ring.ready, 0, 0);
+
+    ring.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (ring.fd < 0)
+    {
+	printf("ERROR: Can't create \"%s\". %s\n", path, strerror(errno));
+	exit(1);
+    }
+    info->data_offset = direct ? BLOCK_ALIGN : WAV_HEADER_SIZE;
+    info->data_size = WAV_DATA_UNKNOWN;
+    err = wav_write_header(ring.fd, info);
+    if (err < 0)
+    {
+	printf("ERROR: Can't write \"%s\". %s\n", path, strerror(-err));
+	exit(1);
+    }
+    lseek(ring.fd, info->data_offset, SEEK_SET);
+    if (direct && fcntl(ring.fd, F_SETFL,
+			fcntl(ring.fd, F_GETFL) | O_DIRECT) < 0)
+	fprintf(stderr, "WARNING: No O_DIRECT on \"%s\", writing through "
+		"the page cache\n", path);
+
+    err = pthread_create(&writer, NULL, writer_thread, &ring);
+    if (err)
+    {
+	printf("ERROR: Can't start writer thread. %s\n", strerror(err));
+	exit(1);
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    total = seconds > 0 ? (snd_pcm_uframes_t) seconds * info->rate :
+	(snd_pcm_uframes_t) -1;
+    dropped = capture_loop(capture_handle, &ring, info, period, total);
+    snd_pcm_drop(capture_handle);
+    pthread_join(writer, NULL);
+    sem_destroy(&ring.ready);
+
+    if (ring.error)
+    {
+	printf("ERROR: Can't write \"%s\". %s\n", path, strerror(ring.error));
+	exit(1);
+    }
+    info->data_size = ring.written;
+    /* the header is small and unaligned: never through O_DIRECT, even
+       when the recording ended on a block and the writer left it set */
+    fcntl(ring.fd, F_SETFL, fcntl(ring.fd, F_GETFL) & ~O_DIRECT);
+    err = wav_write_header(ring.fd, info);
+    if (err < 0 || fsync(ring.fd) < 0 || close(ring.fd) < 0)
+    {
+	printf("ERROR: Can't finish \"%s\". %s\n", path,
+	       strerror(err < 0 ? -err : errno));
+	exit(1);
+    }
+    fprintf(stderr, "%s: %.1f s recorded", path,
+	    (double) ring.written / info->block_align / info->rate);
+    if (dropped)
+	fprintf(stderr, ", %lu frames dropped while the disk was behind",
+		dropped);
+    if (atomic_load(&pcm_stats_capture.gaps))
+	fprintf(stderr, ", %lu frames lost in %lu overruns or suspends",
+		atomic_load(&pcm_stats_capture.lost_frames),
+		atomic_load(&pcm_stats_capture.gaps));
+    fprintf(stderr, "\n");
+}
+
+
 int main (int argc, char *argv[])
 {
     int i;
-    char buf[SIZE];
+    char *device = PCM_DEVICE;
     snd_pcm_t *capture_handle;
     snd_pcm_hw_params_t *params;
-  
-  
-    open_pcm(&capture_handle,PCM_DEVICE,SND_PCM_STREAM_CAPTURE,0); 
-    snd_pcm_hw_params_malloc (&params);
+    snd_pcm_uframes_t frames;
+    struct rt_config rt;
+    struct wav_info info;
+    int seconds = 0, direct = 0, c;
+
+    rt_parse_args(&argc, argv, &rt);
+    info.format = SND_PCM_FORMAT_S16_LE;
+    info.rate = RATE;
+    info.channels = CHANNELS;
+    while ((c = getopt(argc, argv, "D:r:c:d:O")) != -1)
+    {
+	switch (c)
+	{
+	case 'D':
+	    device = optarg;
+	    break;
+	case 'r':
+	    info.rate = atoi(optarg);
+	    break;
+	case 'c':
+	    info.channels = atoi(optarg);
+	    info.channels = info.channels < 1 ? 1 : info.channels;
+	    break;
+	case 'd':
+	    seconds = atoi(optarg);
+	    break;
+	case 'O':
+	    direct = 1;
+	    break;
+	default:
+	    printf("Usage: %s [-D device] [-r rate] [-c channels] "
+		   "[-d seconds] [-O] [file.wav]\n", argv[0]);
+	    rt_usage(stdout);
+	    exit(1);
+	}
+    }
+    rt_apply(&rt);
+
+    open_pcm(&capture_handle,device,SND_PCM_STREAM_CAPTURE,0);
+    snd_pcm_hw_params_alloca (&params);
     snd_pcm_hw_params_any (capture_handle, params);
-    set_params(capture_handle,params,CHANNELS,RATE);
-    write_params(capture_handle,params);
+    set_access(capture_handle,params,SND_PCM_ACCESS_RW_INTERLEAVED);
+    info.format = set_native_format(capture_handle,params,info.format,
+				    wav_formats);
+    info.block_align = info.channels *
+	snd_pcm_format_physical_width(info.format) / 8;
+    set_channels(capture_handle,params,info.channels);
+    /* record at the rate the device runs, the WAV header follows it */
+    info.rate = set_native_rate(capture_handle,params,info.rate);
+    set_profile(capture_handle,params,PCM_PROFILE_BALANCED);
+    snd_pcm_hw_params_get_period_size(params, &frames, 0);
     prepair_interface(capture_handle);
-    snd_pcm_hw_params_free (params);
-    
+    pcm_stats_attach(&pcm_stats_capture, capture_handle);
+
+    if (optind < argc)
+    {
+	/* ring plus a scratch period, with slack */
+	if (arena_init(&arena, ((size_t) RING_SECONDS + 1) * info.rate *
+		       info.block_align + 2 * BLOCK_BYTES + 65536, 0) < 0)
+	{
+	    printf("ERROR: No enough memory\n");
+	    exit(1);
+	}
+	record_wav(capture_handle, argv[optind], &info, frames, seconds, direct);
+	snd_pcm_close(capture_handle);
+	arena_destroy(&arena);
+	return 0;
+    }
+
+    char buf[SIZE * info.block_align];	/* SIZE frames */
     for (i = 0; i < LOOPS; i++)
     {
-	record(capture_handle,buf,SIZE);	
+	if (record(capture_handle,buf,SIZE) < 0)
+	    exit(1);
     }
     snd_pcm_drain(capture_handle);
     snd_pcm_close (capture_handle);
@@ -1,59 +1,237 @@
 /**
- * Simple sound capture using ALSA API and libasound.
+ * Simple sound loopback (capture -> playback) using ALSA API and libasound.
  *
  * Compile:
- * gcc  capture.c -o capture -lasound
- * 
+ * gcc -O2 capture_playback.c -o capture_playback -lasound -lpthread
+ *
+ * Usage:
+ * $ ./capture_playback [-m lockstep|duplex] [-t target_fill_frames]
+ *                      [-p prime_frames] [-P profile] [rt flags]
+ *
+ * Both streams are linked and started together after prime_frames of
+ * silence have been queued for playback, so the loop latency is fixed.
+ * Each device runs in a format it takes natively; the loop itself is
+ * S16_LE and converted to and from it.
+ * An xrun or a suspend of either stream restarts both the same way.
+ * lockstep reads one period and plays it back on a single thread.
+ * duplex runs capture and playback on two real-time threads joined
+ * by a lock-free ring buffer kept at the target fill level.
+ * The profile (low-latency, the default, balanced or power-save)
+ * picks the device buffer and period sizes. See rt.h for the
+ * real-time flags (--rt-priority, --rt-cpu, --rt-mlock); the duplex
+ * threads run SCHED_FIFO at RT_PRIORITY unless --rt-priority is given.
  */
- 
+
+#include "rt.h"
 #include "mypcm.h"
+#include "ringbuf.h"
+#include <getopt.h>
+#include <signal.h>
 #define SIZE 128
 #define CHANNELS 2
 #define RATE 44100
 #define LOOPS 10000000000
+#define FORMAT SND_PCM_FORMAT_S16_LE	/* of the loop, the devices may differ */
+#define FRAME_BYTES (CHANNELS * 2)
+#define RT_PRIORITY 80
+
+static volatile sig_atomic_t stop = 0;
+static struct rt_config rt;
+
+struct duplex_data
+{
+    struct duplex_session *session;
+    struct ringbuf ring;
+    size_t target;		/* wanted ring fill in frames */
+    unsigned long trimmed;	/* frames dropped to get back to target */
+};
+
+
+static void on_signal(int sig ATTRIBUTE_UNUSED)
+{
+    stop = 1;
+}
+
+
+/**
+ * Capture thread: read periods from the card into the ring
+ * @param *arg duplex state
+ */
+static void *capture_thread(void *arg)
+{
+    struct duplex_data *d = arg;
+    char buf[SIZE * FRAME_BYTES];
+
+    while (!stop)
+    {
+	if (duplex_read(d->session, buf, SIZE) < 0)
+	    exit(1);
+	ringbuf_write(&d->ring, buf, SIZE);
+    }
+    return NULL;
+}
+
+
+/**
+ * Playback thread: play from the ring, holding it at the target fill.
+ * Silence is played while the ring fills up, and again after every
+ * underflow, so the playback clock never stops.
+ * @param *arg duplex state
+ */
+static void *playback_thread(void *arg)
+{
+    struct duplex_data *d = arg;
+    char buf[SIZE * FRAME_BYTES];
+    size_t fill, got;
+    int primed = 0;
+
+    while (!stop)
+    {
+	fill = ringbuf_fill(&d->ring);
+	if (!primed && fill >= d->target)
+	    primed = 1;
+	if (!primed)
+	{
+	    memset(buf, 0, sizeof(buf));
+	    if (duplex_write(d->session, buf, SIZE) < 0)
+		exit(1);
+	    continue;
+	}
+	/* capture clock running ahead: drop the excess latency */
+	if (fill > d->target + 2 * SIZE)
+	    d->trimmed += ringbuf_skip(&d->ring, fill - d->target);
+	got = ringbuf_read(&d->ring, buf, SIZE);
+	if (got < SIZE)
+	{
+	    memset(buf + got * FRAME_BYTES, 0, (SIZE - got) * FRAME_BYTES);
+	    primed = 0;
+	}
+	if (duplex_write(d->session, buf, SIZE) < 0)
+	    exit(1);
+	duplex_measure(d->session, ringbuf_fill(&d->ring));
+    }
+    return NULL;
+}
+
+
+/**
+ * Start a duplex thread with the real-time setup from the command line
+ * @param *thread thread id
+ * @param *fn thread function
+ * @param *arg thread argument
+ */
+static void start_thread(pthread_t *thread,
+			 void *(*fn)(void *),
+			 void *arg)
+{
+    int err;
+
+    err = rt_thread_create(thread, rt.priority ? rt.priority : RT_PRIORITY,
+			   rt.cpu, fn, arg);
+    if (err)
+    {
+	fprintf(stderr, "ERROR: Can't create thread (%s)\n", strerror(err));
+	exit(1);
+    }
+}
+
+
+static void lockstep_loop(struct duplex_session *session)
+{
+    long long i;
+    char buf[SIZE * FRAME_BYTES];
+
+    for (i = 0; i < LOOPS && !stop; i++)
+    {
+	if (duplex_read(session, buf, SIZE) < 0 ||
+	    duplex_write(session, buf, SIZE) < 0)
+	    exit(1);
+	duplex_measure(session, 0);
+    }
+}
+
+
+static void duplex_loop(struct duplex_session *session,
+			size_t target)
+{
+    struct duplex_data d;
+    pthread_t capture_tid, playback_tid;
+
+    d.session = session;
+    d.target = target;
+    d.trimmed = 0;
+    if (ringbuf_init(&d.ring, 4 * target + 4 * SIZE, FRAME_BYTES) < 0)
+    {
+	fprintf(stderr, "ERROR: Can't allocate ring buffer\n");
+	exit(1);
+    }
+    rt_prefault(d.ring.data, d.ring.size * FRAME_BYTES);
+
+    start_thread(&playback_tid, playback_thread, &d);
+    start_thread(&capture_tid, capture_thread, &d);
+    pthread_join(capture_tid, NULL);
+    pthread_join(playback_tid, NULL);
+
+    printf("ring overflows: %lu, underflows: %lu, trimmed frames: %lu\n",
+	   atomic_load(&d.ring.overflows),
+	   atomic_load(&d.ring.underflows),
+	   d.trimmed);
+    ringbuf_free(&d.ring);
+}
 
 
 int main (int argc, char *argv[])
 {
+    int c;
+    int duplex = 0;
+    size_t target = 2 * SIZE;
+    snd_pcm_uframes_t prime = 2 * SIZE;
+    enum pcm_profile profile = PCM_PROFILE_LOW_LATENCY;
+    struct duplex_session session;
 
-    int i;
-    char buf[SIZE];
-    snd_pcm_t *capture_handle;
-    snd_pcm_t *playback_handle;
-    snd_pcm_hw_params_t *capture_params;
-    snd_pcm_hw_params_t *playback_params;
-
-
-    open_pcm(&capture_handle,PCM_DEVICE,SND_PCM_STREAM_CAPTURE,0); 
-    open_pcm(&playback_handle,PCM_DEVICE,SND_PCM_STREAM_PLAYBACK,0);
-    //-----------------------------------------------------
-    snd_pcm_hw_params_malloc (&playback_params);
-    snd_pcm_hw_params_malloc (&capture_params);
-    //----------------------------------------------------
-    snd_pcm_hw_params_any (playback_handle, playback_params);
-    snd_pcm_hw_params_any (capture_handle, capture_params);
-    //----------------------------------------------------
-    set_params(playback_handle,playback_params,CHANNELS,RATE);
-    set_params(capture_handle,capture_params,CHANNELS,RATE);
-    //----------------------------------------------------
-    write_params(playback_handle,playback_params);    
-    write_params(capture_handle,capture_params);
-    //----------------------------------------------------
-    prepair_interface(capture_handle);
-    prepair_interface(playback_handle);
-    //----------------------------------------------------
-    snd_pcm_hw_params_free (playback_params);
-    snd_pcm_hw_params_free (capture_params);
-
-   for(i=0; i < LOOPS; i++)
+    rt_parse_args(&argc, argv, &rt);
+    while ((c = getopt(argc, argv, "m:t:p:P:")) != -1)
     {
-	record(capture_handle,buf,SIZE);
-	play(playback_handle,buf,SIZE);	
+	switch (c)
+	{
+	case 'm':
+	    duplex = !strcasecmp(optarg, "duplex");
+	    break;
+	case 't':
+	    target = atoi(optarg);
+	    target = target < SIZE ? SIZE : target;
+	    break;
+	case 'p':
+	    prime = atoi(optarg);
+	    prime = prime < SIZE ? SIZE : prime;
+	    break;
+	case 'P':
+	    profile = profile_from_name(optarg);
+	    break;
+	default:
+	    printf("Usage: %s [-m lockstep|duplex] [-t target_fill_frames]"
+		   " [-p prime_frames] [-P profile]\n", argv[0]);
+	    rt_usage(stdout);
+	    exit(1);
+	}
     }
+    rt_apply(&rt);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    duplex_open(&session, PCM_DEVICE, FORMAT, CHANNELS, RATE, profile);
+    printf("%s: playback buffer %lu frames (%.1f ms)\n",
+	   pcm_profiles[profile].name, session.buffer_size,
+	   session.buffer_size * 1000.0 / session.rate);
+    duplex_start(&session, prime);
+
+    if (duplex)
+	duplex_loop(&session, target);
+    else
+	lockstep_loop(&session);
 
-    snd_pcm_drain(playback_handle);
-    snd_pcm_drain(capture_handle);
-    snd_pcm_close(playback_handle);
-    snd_pcm_close (capture_handle);
+    printf("round-trip latency: %ld frames (min %ld, max %ld)\n",
+	   session.latency, session.latency_min, session.latency_max);
+    duplex_close(&session);
     return 0;
 }
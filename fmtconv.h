@@ -0,0 +1,605 @@
+#ifndef FMTCONV_H
+#define FMTCONV_H
+
+#include <alsa/asoundlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define FMTCONV_BLOCK 256	/* samples per pass through the pivot */
+
+/*
+ * Sample format conversion. Every format is read into and written from
+ * a pivot: int32 holding the value at the format's own width (for
+ * conversions between integer formats, which stay exact) or float in
+ * [-1, 1] (for DSP and float formats). The kernels are generated per
+ * layout, with byte order and sign flip fixed at compile time, so the
+ * loops carry no per-sample format branches; a stream picks its kernels
+ * once, in fmtconv_init(). Where SSE2 is there the kernels do blocks of
+ * samples with it by hand, whatever the optimization level, and leave
+ * the rest to the scalar loop.
+ */
+struct fmtconv;
+
+/* format -> int32 at the format width, sign extended */
+typedef void (*fmtconv_load_t)(int32_t *out,
+			       const void *in,
+			       size_t n);
+/* int32 at the format width -> format */
+typedef void (*fmtconv_store_t)(void *out,
+				const int32_t *in,
+				size_t n);
+typedef void (*fmtconv_decode_t)(const struct fmtconv *fc,
+				 float *out,
+				 const void *in,
+				 size_t n);
+typedef void (*fmtconv_encode_t)(const struct fmtconv *fc,
+				 void *out,
+				 const float *in,
+				 size_t n);
+
+/**
+ * Conversion kernels of one sample format
+ */
+struct fmtconv
+{
+    snd_pcm_format_t format;
+    unsigned int bits;		/* significant bits */
+    unsigned int bytes;		/* physical bytes per sample */
+    fmtconv_load_t load;	/* NULL for float formats */
+    fmtconv_store_t store;
+    fmtconv_decode_t decode;	/* format -> float */
+    fmtconv_encode_t encode;	/* float -> format, saturated */
+};
+
+
+static inline uint16_t fmtconv_get16(const unsigned char *p)
+{
+    uint16_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+
+static inline uint32_t fmtconv_get32(const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+
+static inline void fmtconv_put16(unsigned char *p,
+				 uint16_t v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+
+static inline void fmtconv_put32(unsigned char *p,
+				 uint32_t v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define FMTCONV_LE16(v) (v)
+#define FMTCONV_BE16(v) __builtin_bswap16(v)
+#define FMTCONV_LE32(v) (v)
+#define FMTCONV_BE32(v) __builtin_bswap32(v)
+#else
+#define FMTCONV_LE16(v) __builtin_bswap16(v)
+#define FMTCONV_BE16(v) (v)
+#define FMTCONV_LE32(v) __builtin_bswap32(v)
+#define FMTCONV_BE32(v) (v)
+#endif
+
+#ifdef __SSE2__
+/* vector byte order, for the SSE2 blocks: x86 is little endian */
+#define FMTCONV_VLE(v) (v)
+
+static inline __m128i fmtconv_swap16x8(__m128i v)
+{
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+
+static inline __m128i fmtconv_swap32x4(__m128i v)
+{
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    return fmtconv_swap16x8(v);
+}
+
+/* 8 samples: 16 bit containers <-> int32, sign extended */
+#define FMTCONV_SSE2_16_LOAD(vorder, flip)				\
+    for (; i + 8 <= n; i += 8)						\
+    {									\
+	__m128i v = vorder(_mm_loadu_si128((const __m128i *) (p + 2 * i))); \
+	v = _mm_xor_si128(v, _mm_set1_epi16((short) (flip)));		\
+	_mm_storeu_si128((__m128i *) (out + i),				\
+			 _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));	\
+	_mm_storeu_si128((__m128i *) (out + i + 4),			\
+			 _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16));	\
+    }
+/* the low halves, sign extended first so packs never saturates */
+#define FMTCONV_SSE2_16_STORE(vorder, flip)				\
+    for (; i + 8 <= n; i += 8)						\
+    {									\
+	__m128i a = _mm_loadu_si128((const __m128i *) (in + i));	\
+	__m128i b = _mm_loadu_si128((const __m128i *) (in + i + 4));	\
+	a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);			\
+	b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);			\
+	a = _mm_xor_si128(_mm_packs_epi32(a, b),			\
+			  _mm_set1_epi16((short) (flip)));		\
+	_mm_storeu_si128((__m128i *) (p + 2 * i), vorder(a));		\
+    }
+/* 4 samples: 32 bit containers <-> int32 */
+#define FMTCONV_SSE2_32_LOAD(vorder, flip, shift)			\
+    for (; i + 4 <= n; i += 4)						\
+    {									\
+	__m128i v = vorder(_mm_loadu_si128((const __m128i *) (p + 4 * i))); \
+	v = _mm_xor_si128(v, _mm_set1_epi32((int) (flip)));		\
+	_mm_storeu_si128((__m128i *) (out + i),				\
+			 _mm_srai_epi32(_mm_slli_epi32(v, shift), shift)); \
+    }
+#define FMTCONV_SSE2_32_STORE(vorder, flip, mask)			\
+    for (; i + 4 <= n; i += 4)						\
+    {									\
+	__m128i v = _mm_loadu_si128((const __m128i *) (in + i));	\
+	v = _mm_and_si128(_mm_xor_si128(v, _mm_set1_epi32((int) (flip))), \
+			  _mm_set1_epi32((int) (mask)));		\
+	_mm_storeu_si128((__m128i *) (p + 4 * i), vorder(v));		\
+    }
+/*
+ * 4 packed samples per 12 bytes. A load reads 16 bytes, hence the two
+ * samples of margin; big endian ones are byte swapped as 32 bits with
+ * the sample in the top three bytes
+ */
+#define FMTCONV_SSE2_24_3_LOAD(be, flip)				\
+    for (; i + 6 <= n; i += 4, p += 12)				\
+    {									\
+	__m128i x = _mm_loadu_si128((const __m128i *) p);		\
+	__m128i v = _mm_unpacklo_epi64(					\
+	    _mm_unpacklo_epi32(x, _mm_srli_si128(x, 3)),		\
+	    _mm_unpacklo_epi32(_mm_srli_si128(x, 6), _mm_srli_si128(x, 9))); \
+	v = (be) ? _mm_srli_epi32(fmtconv_swap32x4(v), 8) :		\
+	    _mm_and_si128(v, _mm_set1_epi32(0xFFFFFF));			\
+	v = _mm_xor_si128(v, _mm_set1_epi32((int) (flip)));		\
+	_mm_storeu_si128((__m128i *) (out + i),				\
+			 _mm_srai_epi32(_mm_slli_epi32(v, 8), 8));	\
+    }
+#define FMTCONV_SSE2_24_3_STORE(be, flip)				\
+    for (; i + 4 <= n; i += 4, p += 12)				\
+    {									\
+	__m128i v = _mm_loadu_si128((const __m128i *) (in + i));	\
+	v = _mm_xor_si128(v, _mm_set1_epi32((int) (flip)));		\
+	v = (be) ? fmtconv_swap32x4(_mm_slli_epi32(v, 8)) :		\
+	    _mm_and_si128(v, _mm_set1_epi32(0xFFFFFF));			\
+	/* two samples per quadword, then both quadwords into 12 bytes */ \
+	v = _mm_or_si128(_mm_and_si128(v, _mm_set_epi32(0, -1, 0, -1)), \
+			 _mm_slli_epi64(_mm_srli_epi64(v, 32), 24));	\
+	v = _mm_or_si128(_mm_move_epi64(v),				\
+			 _mm_slli_si128(_mm_srli_si128(v, 8), 6));	\
+	_mm_storel_epi64((__m128i *) p, v);				\
+	fmtconv_put32(p + 8, _mm_cvtsi128_si32(_mm_srli_si128(v, 8)));	\
+    }
+#else
+#define FMTCONV_SSE2_16_LOAD(vorder, flip)
+#define FMTCONV_SSE2_16_STORE(vorder, flip)
+#define FMTCONV_SSE2_32_LOAD(vorder, flip, shift)
+#define FMTCONV_SSE2_32_STORE(vorder, flip, mask)
+#define FMTCONV_SSE2_24_3_LOAD(be, flip)
+#define FMTCONV_SSE2_24_3_STORE(be, flip)
+#endif
+
+/*
+ * Load and store kernels, one per layout: a 16 or 32 bit container in
+ * either byte order, the sign bit flipped for unsigned formats, and
+ * 24 bit samples in the low bytes of 32 or packed in 3 bytes.
+ */
+#define FMTCONV_16(name, order, vorder, flip)				\
+static void name##_load(int32_t *out, const void *in, size_t n)	\
+{									\
+    const unsigned char *p = in;					\
+    size_t i = 0;							\
+    FMTCONV_SSE2_16_LOAD(vorder, flip)					\
+    for (; i < n; i++)							\
+	out[i] = (int16_t) (order(fmtconv_get16(p + 2 * i)) ^ (flip));	\
+}									\
+static void name##_store(void *out, const int32_t *in, size_t n)	\
+{									\
+    unsigned char *p = out;						\
+    size_t i = 0;							\
+    FMTCONV_SSE2_16_STORE(vorder, flip)					\
+    for (; i < n; i++)							\
+	fmtconv_put16(p + 2 * i, order((uint16_t) (in[i] ^ (flip))));	\
+}
+
+#define FMTCONV_32(name, order, vorder, flip, shift, mask)		\
+static void name##_load(int32_t *out, const void *in, size_t n)	\
+{									\
+    const unsigned char *p = in;					\
+    size_t i = 0;							\
+    FMTCONV_SSE2_32_LOAD(vorder, flip, shift)				\
+    for (; i < n; i++)							\
+	out[i] = (int32_t) ((order(fmtconv_get32(p + 4 * i)) ^ (flip))	\
+			    << (shift)) >> (shift);			\
+}									\
+static void name##_store(void *out, const int32_t *in, size_t n)	\
+{									\
+    unsigned char *p = out;						\
+    size_t i = 0;							\
+    FMTCONV_SSE2_32_STORE(vorder, flip, mask)				\
+    for (; i < n; i++)							\
+	fmtconv_put32(p + 4 * i, order(((uint32_t) in[i] ^ (flip)) & (mask))); \
+}
+
+#define FMTCONV_24_3(name, b0, b2, flip)				\
+static void name##_load(int32_t *out, const void *in, size_t n)	\
+{									\
+    const unsigned char *p = in;					\
+    size_t i = 0;							\
+    FMTCONV_SSE2_24_3_LOAD(b0 == 2, flip)				\
+    for (; i < n; i++, p += 3)						\
+	out[i] = (int32_t) (((p[b0] | p[1] << 8 | (uint32_t) p[b2] << 16) \
+			     ^ (flip)) << 8) >> 8;			\
+}									\
+static void name##_store(void *out, const int32_t *in, size_t n)	\
+{									\
+    unsigned char *p = out;						\
+    uint32_t v;								\
+    size_t i = 0;							\
+    FMTCONV_SSE2_24_3_STORE(b0 == 2, flip)				\
+    for (; i < n; i++, p += 3)						\
+    {									\
+	v = (uint32_t) in[i] ^ (flip);					\
+	p[b0] = v;							\
+	p[1] = v >> 8;							\
+	p[b2] = v >> 16;						\
+    }									\
+}
+
+FMTCONV_16(fmtconv_s16_le, FMTCONV_LE16, FMTCONV_VLE, 0)
+FMTCONV_16(fmtconv_s16_be, FMTCONV_BE16, fmtconv_swap16x8, 0)
+FMTCONV_16(fmtconv_u16_le, FMTCONV_LE16, FMTCONV_VLE, 0x8000)
+FMTCONV_16(fmtconv_u16_be, FMTCONV_BE16, fmtconv_swap16x8, 0x8000)
+/* signed 24 in 32 is stored sign extended, unsigned with a clear top byte */
+FMTCONV_32(fmtconv_s24_le, FMTCONV_LE32, FMTCONV_VLE, 0, 8, 0xFFFFFFFFu)
+FMTCONV_32(fmtconv_s24_be, FMTCONV_BE32, fmtconv_swap32x4, 0, 8, 0xFFFFFFFFu)
+FMTCONV_32(fmtconv_u24_le, FMTCONV_LE32, FMTCONV_VLE, 0x800000, 8, 0xFFFFFFu)
+FMTCONV_32(fmtconv_u24_be, FMTCONV_BE32, fmtconv_swap32x4, 0x800000, 8, 0xFFFFFFu)
+FMTCONV_32(fmtconv_s32_le, FMTCONV_LE32, FMTCONV_VLE, 0, 0, 0xFFFFFFFFu)
+FMTCONV_32(fmtconv_s32_be, FMTCONV_BE32, fmtconv_swap32x4, 0, 0, 0xFFFFFFFFu)
+FMTCONV_32(fmtconv_u32_le, FMTCONV_LE32, FMTCONV_VLE, 0x80000000u, 0, 0xFFFFFFFFu)
+FMTCONV_32(fmtconv_u32_be, FMTCONV_BE32, fmtconv_swap32x4, 0x80000000u, 0, 0xFFFFFFFFu)
+FMTCONV_24_3(fmtconv_s24_3le, 0, 2, 0)
+FMTCONV_24_3(fmtconv_s24_3be, 2, 0, 0)
+FMTCONV_24_3(fmtconv_u24_3le, 0, 2, 0x800000)
+FMTCONV_24_3(fmtconv_u24_3be, 2, 0, 0x800000)
+
+
+/*
+ * Float pivot of the integer formats: the loaded block is scaled to
+ * [-1, 1), and on the way back quantized with rounding and saturation
+ * to the format width, both with SSE2 where it is there. Both paths
+ * round half away from zero: the SSE2 one adds a signed half and
+ * truncates, as the scalar one does, so a sample quantizes the same
+ * wherever it sits in a block.
+ */
+static void fmtconv_quantize(int32_t *out,
+			     const float *in,
+			     size_t n,
+			     unsigned int bits)
+{
+    const float scale = (float) (1u << (bits - 1));
+    /* the largest float below 2^31 is 2^31 - 128 */
+    const float top = bits == 32 ? 2147483520.0f : scale - 1;
+    size_t i = 0;
+    float v;
+
+#ifdef __SSE2__
+    const __m128 s = _mm_set1_ps(scale), hi = _mm_set1_ps(top);
+    const __m128 lo = _mm_set1_ps(-scale), half = _mm_set1_ps(0.5f);
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    for (; i + 4 <= n; i += 4)
+    {
+	__m128 x = _mm_mul_ps(_mm_loadu_ps(in + i), s);
+	x = _mm_max_ps(_mm_min_ps(x, hi), lo);
+	x = _mm_add_ps(x, _mm_or_ps(_mm_and_ps(x, sign), half));
+	_mm_storeu_si128((__m128i *) (out + i), _mm_cvttps_epi32(x));
+    }
+#endif
+    for (; i < n; i++)
+    {
+	v = in[i] * scale;
+	v = v > top ? top : v < -scale ? -scale : v;
+	/* no lrintf(): keep the tools free of libm */
+	out[i] = (int32_t) (v < 0 ? v - 0.5f : v + 0.5f);
+    }
+}
+
+
+static void fmtconv_decode_int(const struct fmtconv *fc,
+			       float *out,
+			       const void *in,
+			       size_t n)
+{
+    const float scale = 1.0f / (1u << (fc->bits - 1));
+    int32_t tmp[FMTCONV_BLOCK];
+    const char *p = in;
+    size_t i, m;
+
+    for (; n; n -= m, out += m, p += m * fc->bytes)
+    {
+	m = n < FMTCONV_BLOCK ? n : FMTCONV_BLOCK;
+	fc->load(tmp, p, m);
+	i = 0;
+#ifdef __SSE2__
+	for (; i + 4 <= m; i += 4)
+	    _mm_storeu_ps(out + i,
+			  _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *) (tmp + i))),
+				     _mm_set1_ps(scale)));
+#endif
+	for (; i < m; i++)
+	    out[i] = tmp[i] * scale;
+    }
+}
+
+
+static void fmtconv_encode_int(const struct fmtconv *fc,
+			       void *out,
+			       const float *in,
+			       size_t n)
+{
+    int32_t tmp[FMTCONV_BLOCK];
+    char *p = out;
+    size_t m;
+
+    for (; n; n -= m, in += m, p += m * fc->bytes)
+    {
+	m = n < FMTCONV_BLOCK ? n : FMTCONV_BLOCK;
+	fmtconv_quantize(tmp, in, m, fc->bits);
+	fc->store(p, tmp, m);
+    }
+}
+
+
+#ifdef __SSE2__
+#define FMTCONV_SSE2_FLOAT_DECODE(vorder)				\
+    for (; i + 4 <= n; i += 4)						\
+	_mm_storeu_si128((__m128i *) (out + i),				\
+			 vorder(_mm_loadu_si128((const __m128i *) (p + 4 * i))));
+/* min and max in this order keep a NaN, as the scalar clamp does */
+#define FMTCONV_SSE2_FLOAT_ENCODE(vorder)				\
+    for (; i + 4 <= n; i += 4)						\
+    {									\
+	__m128 x = _mm_max_ps(_mm_set1_ps(-1.0f),			\
+			      _mm_min_ps(_mm_set1_ps(1.0f),		\
+					 _mm_loadu_ps(in + i)));	\
+	_mm_storeu_si128((__m128i *) (p + 4 * i),			\
+			 vorder(_mm_castps_si128(x)));			\
+    }
+#else
+#define FMTCONV_SSE2_FLOAT_DECODE(vorder)
+#define FMTCONV_SSE2_FLOAT_ENCODE(vorder)
+#endif
+
+/* float formats: a copy or a byte swap, clamped on the way out */
+#define FMTCONV_FLOAT(name, order, vorder)				\
+static void name##_decode(const struct fmtconv *fc ATTRIBUTE_UNUSED,	\
+			  float *out, const void *in, size_t n)		\
+{									\
+    const unsigned char *p = in;					\
+    uint32_t v;								\
+    size_t i = 0;							\
+    FMTCONV_SSE2_FLOAT_DECODE(vorder)					\
+    for (; i < n; i++)							\
+    {									\
+	v = order(fmtconv_get32(p + 4 * i));				\
+	memcpy(out + i, &v, sizeof(v));					\
+    }									\
+}									\
+static void name##_encode(const struct fmtconv *fc ATTRIBUTE_UNUSED,	\
+			  void *out, const float *in, size_t n)		\
+{									\
+    unsigned char *p = out;						\
+    uint32_t v;								\
+    size_t i = 0;							\
+    float f;								\
+    FMTCONV_SSE2_FLOAT_ENCODE(vorder)					\
+    for (; i < n; i++)							\
+    {									\
+	f = in[i] > 1.0f ? 1.0f : in[i] < -1.0f ? -1.0f : in[i];	\
+	memcpy(&v, &f, sizeof(v));					\
+	fmtconv_put32(p + 4 * i, order(v));				\
+    }									\
+}
+
+FMTCONV_FLOAT(fmtconv_float_le, FMTCONV_LE32, FMTCONV_VLE)
+FMTCONV_FLOAT(fmtconv_float_be, FMTCONV_BE32, fmtconv_swap32x4)
+
+#define FMTCONV_INT_ENTRY(fmt, name, bits, bytes)			\
+    { SND_PCM_FORMAT_##fmt, bits, bytes, name##_load, name##_store,	\
+      fmtconv_decode_int, fmtconv_encode_int }
+#define FMTCONV_FLOAT_ENTRY(fmt, name)					\
+    { SND_PCM_FORMAT_##fmt, 32, 4, NULL, NULL, name##_decode, name##_encode }
+
+static const struct fmtconv fmtconv_table[] = {
+    FMTCONV_INT_ENTRY(S16_LE, fmtconv_s16_le, 16, 2),
+    FMTCONV_INT_ENTRY(S16_BE, fmtconv_s16_be, 16, 2),
+    FMTCONV_INT_ENTRY(U16_LE, fmtconv_u16_le, 16, 2),
+    FMTCONV_INT_ENTRY(U16_BE, fmtconv_u16_be, 16, 2),
+    FMTCONV_INT_ENTRY(S24_LE, fmtconv_s24_le, 24, 4),
+    FMTCONV_INT_ENTRY(S24_BE, fmtconv_s24_be, 24, 4),
+    FMTCONV_INT_ENTRY(U24_LE, fmtconv_u24_le, 24, 4),
+    FMTCONV_INT_ENTRY(U24_BE, fmtconv_u24_be, 24, 4),
+    FMTCONV_INT_ENTRY(S32_LE, fmtconv_s32_le, 32, 4),
+    FMTCONV_INT_ENTRY(S32_BE, fmtconv_s32_be, 32, 4),
+    FMTCONV_INT_ENTRY(U32_LE, fmtconv_u32_le, 32, 4),
+    FMTCONV_INT_ENTRY(U32_BE, fmtconv_u32_be, 32, 4),
+    FMTCONV_INT_ENTRY(S24_3LE, fmtconv_s24_3le, 24, 3),
+    FMTCONV_INT_ENTRY(S24_3BE, fmtconv_s24_3be, 24, 3),
+    FMTCONV_INT_ENTRY(U24_3LE, fmtconv_u24_3le, 24, 3),
+    FMTCONV_INT_ENTRY(U24_3BE, fmtconv_u24_3be, 24, 3),
+    FMTCONV_FLOAT_ENTRY(FLOAT_LE, fmtconv_float_le),
+    FMTCONV_FLOAT_ENTRY(FLOAT_BE, fmtconv_float_be),
+};
+
+#define FMTCONV_FORMATS (sizeof(fmtconv_table) / sizeof(fmtconv_table[0]))
+
+/* device formats to fall back to, best first, SND_PCM_FORMAT_UNKNOWN ends */
+static const snd_pcm_format_t fmtconv_preferred[] = {
+    SND_PCM_FORMAT_FLOAT_LE, SND_PCM_FORMAT_S32_LE, SND_PCM_FORMAT_S24_LE,
+    SND_PCM_FORMAT_S24_3LE, SND_PCM_FORMAT_S16_LE,
+    SND_PCM_FORMAT_FLOAT_BE, SND_PCM_FORMAT_S32_BE, SND_PCM_FORMAT_S24_BE,
+    SND_PCM_FORMAT_S24_3BE, SND_PCM_FORMAT_S16_BE,
+    SND_PCM_FORMAT_U32_LE, SND_PCM_FORMAT_U24_LE, SND_PCM_FORMAT_U24_3LE,
+    SND_PCM_FORMAT_U16_LE, SND_PCM_FORMAT_U32_BE, SND_PCM_FORMAT_U24_BE,
+    SND_PCM_FORMAT_U24_3BE, SND_PCM_FORMAT_U16_BE,
+    SND_PCM_FORMAT_UNKNOWN
+};
+
+
+/**
+ * Pick the kernels of a sample format, once per stream
+ * @param *fc conversion to set up
+ * @param format sample format
+ * @return 0 on success, -EINVAL if the format isn't converted
+ */
+int fmtconv_init(struct fmtconv *fc,
+		 snd_pcm_format_t format)
+{
+    size_t i;
+
+    for (i = 0; i < FMTCONV_FORMATS; i++)
+	if (fmtconv_table[i].format == format)
+	{
+	    *fc = fmtconv_table[i];
+	    return 0;
+	}
+    return -EINVAL;
+}
+
+
+/**
+ * Samples of a format to float in [-1, 1)
+ * @param *fc conversion of the input format
+ * @param *out float samples
+ * @param *in samples in the format
+ * @param n samples
+ */
+void fmtconv_decode(const struct fmtconv *fc,
+		    float *out,
+		    const void *in,
+		    size_t n)
+{
+    fc->decode(fc, out, in, n);
+}
+
+
+/**
+ * Float samples to a format, rounded and saturated
+ * @param *fc conversion of the output format
+ * @param *out samples in the format
+ * @param *in float samples
+ * @param n samples
+ */
+void fmtconv_encode(const struct fmtconv *fc,
+		    void *out,
+		    const float *in,
+		    size_t n)
+{
+    fc->encode(fc, out, in, n);
+}
+
+
+/**
+ * Convert samples between two formats. Integer to integer goes through
+ * the int32 pivot and is exact when widening; narrowing truncates
+ * @param *from conversion of the input format
+ * @param *to conversion of the output format
+ * @param *out samples in the output format
+ * @param *in samples in the input format
+ * @param n samples
+ */
+void fmtconv_convert(const struct fmtconv *from,
+		     const struct fmtconv *to,
+		     void *out,
+		     const void *in,
+		     size_t n)
+{
+    union
+    {
+	int32_t i[FMTCONV_BLOCK];
+	float f[FMTCONV_BLOCK];
+    } tmp;
+    const char *p = in;
+    char *q = out;
+    int up, down;
+    size_t i, m;
+
+    if (from->format == to->format)
+    {
+	memcpy(out, in, n * from->bytes);
+	return;
+    }
+    up = 32 - from->bits;
+    down = 32 - to->bits;
+    for (; n; n -= m, p += m * from->bytes, q += m * to->bytes)
+    {
+	m = n < FMTCONV_BLOCK ? n : FMTCONV_BLOCK;
+	if (from->load && to->store)
+	{
+	    from->load(tmp.i, p, m);
+	    for (i = 0; i < m; i++)
+		tmp.i[i] = (int32_t) ((uint32_t) tmp.i[i] << up) >> down;
+	    to->store(q, tmp.i, m);
+	}
+	else
+	{
+	    from->decode(from, tmp.f, p, m);
+	    to->encode(to, q, tmp.f, m);
+	}
+    }
+}
+
+
+/**
+ * Check that ties quantize the same in the SSE2 blocks and in the scalar
+ * tail: runs of k + 1/2 steps, for every run length up to a few blocks
+ * of four, must all round half away from zero
+ * @return 0 on success, -1 if a sample rounded otherwise
+ */
+int fmtconv_check(void)
+{
+    static const unsigned int widths[] = { 16, 24, 32 };
+    int32_t out[16];
+    float in[16];
+    float scale;
+    size_t n, i, w;
+    int k;
+
+    for (w = 0; w < sizeof(widths) / sizeof(widths[0]); w++)
+    {
+	scale = (float) (1u << (widths[w] - 1));
+	for (k = -4; k < 4; k++)
+	    for (n = 1; n <= 16; n++)
+	    {
+		for (i = 0; i < n; i++)
+		    in[i] = (k + 0.5f) / scale;
+		fmtconv_quantize(out, in, n, widths[w]);
+		for (i = 0; i < n; i++)
+		    if (out[i] != (k < 0 ? k : k + 1))
+			return -1;
+	    }
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef KERNEL_H
+#define KERNEL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERNEL_X86 1
+#else
+#define KERNEL_X86 0
+#endif
+#if defined(__GNUC__) && defined(__aarch64__)
+#define KERNEL_ARM64 1
+#else
+#define KERNEL_ARM64 0
+#endif
+
+/**
+ * Instruction set levels the sample kernels are built for. Each kernel
+ * is compiled once per level from one macro body, under the level's
+ * target attribute, and the best level the CPU runs is picked at
+ * startup: one binary makes use of whatever the machine has.
+ * KERNEL_GENERIC is the scalar reference, built without vectorization.
+ */
+enum kernel_isa
+{
+    KERNEL_GENERIC,
+    KERNEL_SSE2,
+    KERNEL_AVX2,
+    KERNEL_AVX512,
+    KERNEL_NEON,
+    KERNEL_ISAS
+};
+
+static const char *const kernel_isa_names[KERNEL_ISAS] = {
+    "generic", "sse2", "avx2", "avx512", "neon"
+};
+
+/* function attributes of each level, for the kernel variants */
+#define KERNEL_ATTR_GENERIC __attribute__((optimize("no-tree-vectorize")))
+#define KERNEL_ATTR_SSE2 __attribute__((target("sse2")))
+#define KERNEL_ATTR_AVX2 __attribute__((target("avx2,fma")))
+#define KERNEL_ATTR_AVX512						\
+    __attribute__((target("avx512f,avx512vl,avx512bw,prefer-vector-width=512")))
+#define KERNEL_ATTR_NEON	/* Advanced SIMD is the aarch64 baseline */
+
+/**
+ * Kernel choice from the command line, see kernel_parse_args()
+ */
+struct kernel_config
+{
+    int isa;			/* enum kernel_isa, -1 for the best one */
+    int check;			/* self-check every level and exit */
+};
+
+
+/**
+ * Print the flags understood by kernel_parse_args()
+ * @param *out where to print
+ */
+void kernel_usage(FILE *out)
+{
+    int i;
+
+    fprintf(out,
+	    "--kernel NAME    sample kernels to run: auto (the best this CPU has)");
+    for (i = 0; i < KERNEL_ISAS; i++)
+	fprintf(out, ", %s", kernel_isa_names[i]);
+    fprintf(out, "\n"
+	    "--kernel-check   check every kernel against the scalar reference\n");
+}
+
+
+/**
+ * Tell whether this CPU (and OS) runs code built for a level
+ * @param isa level
+ * @return 1 if it does, 0 if not or if this build has no such level
+ */
+int kernel_isa_supported(enum kernel_isa isa)
+{
+#if KERNEL_X86
+    __builtin_cpu_init();
+#endif
+    switch (isa)
+    {
+    case KERNEL_GENERIC:
+	return 1;
+#if KERNEL_X86
+    case KERNEL_SSE2:
+	return __builtin_cpu_supports("sse2") != 0;
+    case KERNEL_AVX2:
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    case KERNEL_AVX512:
+	return __builtin_cpu_supports("avx512f") &&
+	    __builtin_cpu_supports("avx512vl") &&
+	    __builtin_cpu_supports("avx512bw");
+#endif
+#if KERNEL_ARM64
+    case KERNEL_NEON:
+#ifdef HWCAP_ASIMD
+	return (getauxval(AT_HWCAP) & HWCAP_ASIMD) != 0;
+#else
+	return 1;
+#endif
+#endif
+    default:
+	return 0;
+    }
+}
+
+
+/**
+ * Take the kernel flags out of the command line, leaving the rest in
+ * order for the tool's own parsing. Flags are --kernel NAME (also as
+ * --kernel=NAME) and --kernel-check
+ * @param *argc argument count, updated
+ * @param **argv arguments, updated
+ * @param *cfg configuration, set to defaults and then from the flags
+ */
+void kernel_parse_args(int *argc,
+		       char **argv,
+		       struct kernel_config *cfg)
+{
+    int i, out = 1;
+    const char *arg, *name;
+
+    cfg->isa = -1;
+    cfg->check = 0;
+    for (i = 1; i < *argc; i++)
+    {
+	arg = argv[i];
+	if (!strcmp(arg, "--kernel-check"))
+	{
+	    cfg->check = 1;
+	    continue;
+	}
+	if (!strncmp(arg, "--kernel=", 9))
+	    name = arg + 9;
+	else if (!strcmp(arg, "--kernel"))
+	{
+	    if (i + 1 == *argc)
+	    {
+		printf("ERROR: %s needs a value\n", arg);
+		exit(1);
+	    }
+	    name = argv[++i];
+	}
+	else
+	{
+	    argv[out++] = argv[i];
+	    continue;
+	}
+	if (!strcasecmp(name, "auto"))
+	{
+	    cfg->isa = -1;
+	    continue;
+	}
+	for (cfg->isa = 0; cfg->isa < KERNEL_ISAS; cfg->isa++)
+	    if (!strcasecmp(name, kernel_isa_names[cfg->isa]))
+		break;
+	if (cfg->isa == KERNEL_ISAS)
+	{
+	    printf("ERROR: unknown kernel %s\n", name);
+	    exit(1);
+	}
+    }
+    argv[out] = NULL;
+    *argc = out;
+}
+
+#endif
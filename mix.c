@@ -0,0 +1,647 @@
+/**
+ * Software mixer: plays any number of sources at once through one
+ * PCM, each with its own gain, instead of one process per source
+ * fighting over dmix.
+ *
+ * Compile:
+ * gcc -O2 mix.c -o mix -lasound -lm -lpthread
+ *
+ * Usage:
+ * $ ./mix [-D device] [-r rate] [-c channels] [-f format] [-d seconds]
+ *         [rt flags] input...
+ *
+ * Inputs, each optionally followed by @gain, linear or in dB:
+ *   sine:FREQ        sine generator
+ *   file:PATH        WAV file, mono or the output channels count
+ *   capture:DEVICE   capture stream at the device's own rate and format
+ *
+ * Examples:
+ * $ ./mix sine:440@0.3 sine:660@-12dB
+ * $ ./mix -f FLOAT_LE file:440Hz_44100Hz_16bit_05sec.wav@0.5 sine:220@0.2
+ * $ ./mix -d 60 capture:hw:1,0 file:backing.wav@-6dB
+ *
+ * The output format is S16_LE (default), S32_LE or FLOAT_LE. S16
+ * sources are summed in an int32 accumulator and float ones in a
+ * float accumulator (mixer.h), and the sum is saturated on the way out.
+ * A device that takes none of these gets the mix as float, converted
+ * to its native format (fmtconv.h). Files and captures that aren't
+ * S16_LE at the mix rate are decoded to float and resampled to it
+ * (resample.h), the quality tier taken from PCM_RESAMPLE.
+ * Mixing stops when every finite input has ended, or after -d seconds.
+ */
+
+#include "rt.h"
+#include "mypcm.h"
+#include "wav.h"
+#include "osc.h"
+#include "arena.h"
+#include "mixer.h"
+#include "resample.h"
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define RESAMPLE_ENV "PCM_RESAMPLE"	/* quality tier of the rate conversion */
+
+static struct arena arena;
+static enum resample_quality quality = RESAMPLE_MEDIUM;
+static struct input_converter *converters[MIXER_MAX_INPUTS];
+static int nconverters;
+
+/**
+ * Sine generator input
+ */
+struct sine_source
+{
+    double phase;
+    double step;		/* radians per frame */
+    double *mono;		/* one period of rendered samples */
+};
+
+/**
+ * Conversion of an input that isn't S16_LE at the mix rate: decoded to
+ * float, resampled to the mix rate and queued until a period is there.
+ * The buffers live in an arena of their own, sized once the input's
+ * format and rate are known
+ */
+struct input_converter
+{
+    struct arena arena;
+    struct fmtconv from;
+    struct resampler rs;
+    int resample;		/* the rates differ */
+    unsigned int channels;	/* of the input */
+    snd_pcm_uframes_t chunk;	/* input frames per pull */
+    void *raw;			/* a chunk in the input format */
+    float *in;			/* a chunk as float */
+    float *queue;		/* converted frames not mixed yet */
+    size_t queued;
+    size_t queue_max;
+    int flushed;		/* the filter tail is out */
+};
+
+/**
+ * WAV file input, mapped
+ */
+struct file_source
+{
+    const char *data;
+    snd_pcm_uframes_t frames;
+    snd_pcm_uframes_t pos;
+    unsigned int channels;	/* 1 or the mixer channels */
+    unsigned int block_align;
+    struct input_converter *conv;	/* NULL for S16_LE at the mix rate */
+};
+
+/**
+ * Capture input
+ */
+struct capture_source
+{
+    snd_pcm_t *handle;
+    struct input_converter *conv;	/* NULL for S16_LE at the mix rate */
+};
+
+
+/**
+ * Set up the conversion of an input to float at the mix rate
+ * @param *conv converter to set up
+ * @param format input format
+ * @param channels input channels count
+ * @param in_rate input rate
+ * @param out_rate mix rate
+ * @param period mixer period
+ */
+static void converter_init(struct input_converter *conv,
+			   snd_pcm_format_t format,
+			   unsigned int channels,
+			   unsigned int in_rate,
+			   unsigned int out_rate,
+			   snd_pcm_uframes_t period)
+{
+    size_t bytes, filter = 0;
+
+    if (fmtconv_init(&conv->from, format) < 0)
+    {
+	printf("ERROR: Can't mix %s\n", snd_pcm_format_name(format));
+	exit(1);
+    }
+    conv->channels = channels;
+    conv->resample = in_rate != out_rate;
+    /* pull about a period's worth of output at a time */
+    conv->chunk = ((size_t) period * in_rate + out_rate - 1) / out_rate;
+    conv->queue_max = period +
+	((size_t) conv->chunk * out_rate + in_rate - 1) / in_rate + 1;
+    conv->queued = 0;
+    conv->flushed = 0;
+    if (conv->resample &&
+	(filter = resample_arena_size(channels, in_rate, out_rate, quality,
+				      conv->chunk)) == 0)
+    {
+	printf("ERROR: Can't convert %u Hz to %u Hz\n", in_rate, out_rate);
+	exit(1);
+    }
+    bytes = filter + conv->chunk * channels * (conv->from.bytes + sizeof(float)) +
+	conv->queue_max * channels * sizeof(float) + 4 * ARENA_ALIGN;
+    if (nconverters == MIXER_MAX_INPUTS || arena_init(&conv->arena, bytes, 0) < 0 ||
+	(conv->raw = arena_alloc(&conv->arena, conv->chunk * channels *
+				 conv->from.bytes, 0)) == NULL ||
+	(conv->in = arena_alloc(&conv->arena, conv->chunk * channels *
+				sizeof(float), 0)) == NULL ||
+	(conv->queue = arena_alloc(&conv->arena, conv->queue_max * channels *
+				   sizeof(float), 0)) == NULL)
+    {
+	printf("ERROR: No enough memory\n");
+	exit(1);
+    }
+    converters[nconverters++] = conv;
+    if (conv->resample &&
+	resample_init(&conv->rs, &conv->arena, channels, in_rate, out_rate,
+		      quality, conv->chunk) < 0)
+    {
+	printf("ERROR: Can't convert %u Hz to %u Hz\n", in_rate, out_rate);
+	exit(1);
+    }
+}
+
+
+/**
+ * Queue converted frames of input. With no frames, push the tail out
+ * of the filter instead, once
+ * @param *conv converter
+ * @param *raw input frames in the input format
+ * @param frames frames in raw, at most a chunk
+ */
+static void converter_push(struct input_converter *conv,
+			   const void *raw,
+			   snd_pcm_uframes_t frames)
+{
+    float *queue = conv->queue + conv->queued * conv->channels;
+    long got;
+
+    if (frames == 0)
+    {
+	conv->flushed = 1;
+	if (!conv->resample)
+	    return;
+	frames = resample_latency(&conv->rs);
+	frames = frames < conv->chunk ? frames : conv->chunk;
+	memset(conv->in, 0, frames * conv->channels * sizeof(float));
+    }
+    else
+	fmtconv_decode(&conv->from, conv->in, raw, frames * conv->channels);
+    if (!conv->resample)
+    {
+	memcpy(queue, conv->in, frames * conv->channels * sizeof(float));
+	conv->queued += frames;
+	return;
+    }
+    got = resample_process(&conv->rs, conv->in, frames, queue,
+			   conv->queue_max - conv->queued);
+    if (got > 0)
+	conv->queued += got;
+}
+
+
+/**
+ * Hand queued frames to the mixer, spread to its channels
+ * @param *conv converter
+ * @param *in mixer input, a float one
+ * @param frames frames wanted
+ * @return frames delivered
+ */
+static snd_pcm_sframes_t converter_take(struct input_converter *conv,
+					struct mixer_input *in,
+					snd_pcm_uframes_t frames)
+{
+    const float *p = conv->queue;
+    float *out = in->buf;
+    snd_pcm_uframes_t i;
+    unsigned int chn;
+
+    if (frames > conv->queued)
+	frames = conv->queued;
+    if (conv->channels == in->channels)
+	memcpy(out, p, frames * conv->channels * sizeof(*out));
+    else
+	for (i = 0; i < frames; i++)
+	    for (chn = 0; chn < in->channels; chn++)
+		*out++ = p[i];
+    conv->queued -= frames;
+    memmove(conv->queue, conv->queue + frames * conv->channels,
+	    conv->queued * conv->channels * sizeof(float));
+    return frames;
+}
+
+
+static snd_pcm_sframes_t read_sine(struct mixer_input *in,
+				   snd_pcm_uframes_t frames)
+{
+    struct sine_source *src = in->data;
+    float *out = in->buf;
+    snd_pcm_uframes_t i;
+    unsigned int chn;
+
+    osc_render(src->mono, frames, src->phase, src->step);
+    src->phase = fmod(src->phase + frames * src->step, 2 * M_PI);
+    for (i = 0; i < frames; i++)
+	for (chn = 0; chn < in->channels; chn++)
+	    *out++ = src->mono[i];
+    return frames;
+}
+
+
+static snd_pcm_sframes_t read_file(struct mixer_input *in,
+				   snd_pcm_uframes_t frames)
+{
+    struct file_source *src = in->data;
+    const int16_t *p = (const int16_t *) src->data + src->pos * src->channels;
+    int16_t *out = in->buf;
+    snd_pcm_uframes_t i;
+    unsigned int chn;
+
+    if (frames > src->frames - src->pos)
+	frames = src->frames - src->pos;
+    if (src->channels == in->channels)
+	memcpy(out, p, frames * src->channels * sizeof(*out));
+    else
+	for (i = 0; i < frames; i++)
+	    for (chn = 0; chn < in->channels; chn++)
+		*out++ = p[i];
+    src->pos += frames;
+    return frames;
+}
+
+
+static snd_pcm_sframes_t read_file_converted(struct mixer_input *in,
+					     snd_pcm_uframes_t frames)
+{
+    struct file_source *src = in->data;
+    struct input_converter *conv = src->conv;
+    snd_pcm_uframes_t n;
+
+    while (conv->queued < frames && !conv->flushed)
+    {
+	n = src->frames - src->pos;
+	n = n < conv->chunk ? n : conv->chunk;
+	converter_push(conv, src->data + src->pos * src->block_align, n);
+	src->pos += n;
+    }
+    return converter_take(conv, in, frames);
+}
+
+
+static snd_pcm_sframes_t read_capture(struct mixer_input *in,
+				      snd_pcm_uframes_t frames)
+{
+    struct capture_source *src = in->data;
+    struct input_converter *conv = src->conv;
+    snd_pcm_sframes_t got;
+
+    if (conv == NULL)
+	return record(src->handle, in->buf, frames);
+    while (conv->queued < frames)
+    {
+	got = record(src->handle, conv->raw, conv->chunk);
+	if (got < 0)
+	    return got;
+	converter_push(conv, conv->raw, got);
+    }
+    return converter_take(conv, in, frames);
+}
+
+
+/**
+ * Split "kind:arg@gain" into its parts. The gain is linear, or in
+ * decibels with a dB suffix; the spec is modified in place
+ * @param *spec input spec
+ * @param **arg returns the part after the colon
+ * @param *gain returns the gain, 1 if none is given
+ * @return the kind, or NULL if there is no colon
+ */
+static char *parse_input(char *spec,
+			 char **arg,
+			 float *gain)
+{
+    char *colon = strchr(spec, ':');
+    char *at = strrchr(spec, '@');
+    char *end;
+    double g;
+
+    *gain = 1;
+    if (colon == NULL)
+	return NULL;
+    *colon = '\0';
+    *arg = colon + 1;
+    if (at && at > colon)
+    {
+	*at = '\0';
+	g = strtod(at + 1, &end);
+	if (!strcasecmp(end, "dB"))
+	    g = pow(10, g / 20);
+	else if (*end)
+	{
+	    printf("ERROR: Bad gain \"%s\"\n", at + 1);
+	    exit(1);
+	}
+	*gain = g;
+    }
+    return spec;
+}
+
+
+/**
+ * Map a WAV file as a mixer input, converted unless it is S16_LE
+ * at the mix rate
+ * @param *mixer mixer
+ * @param *path file to play
+ * @param gain input gain
+ * @param rate mix rate
+ * @return the input
+ */
+static struct mixer_input *add_file(struct mixer *mixer,
+				    const char *path,
+				    float gain,
+				    unsigned int rate)
+{
+    struct file_source *src = arena_alloc(&arena, sizeof(*src), 0);
+    struct mixer_input *in;
+    struct wav_info info;
+    struct stat st;
+    char *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+	printf("ERROR: Can't open \"%s\". %s\n", path, strerror(errno));
+	exit(1);
+    }
+    if (wav_read_header(fd, &info) < 0 ||
+	(info.channels != 1 && info.channels != mixer->channels))
+    {
+	printf("ERROR: \"%s\" is not a WAV file with 1 or %u channels\n",
+	       path, mixer->channels);
+	exit(1);
+    }
+    if (info.data_size == WAV_DATA_UNKNOWN ||
+	info.data_offset + info.data_size > (uint64_t) st.st_size)
+	info.data_size = st.st_size - info.data_offset;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED || src == NULL)
+    {
+	printf("ERROR: Can't map \"%s\". %s\n", path, strerror(errno));
+	exit(1);
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    src->data = map + info.data_offset;
+    src->channels = info.channels;
+    src->block_align = info.block_align;
+    src->frames = info.data_size / info.block_align;
+    src->pos = 0;
+    src->conv = NULL;
+    if (info.format == SND_PCM_FORMAT_S16_LE && info.rate == rate)
+	in = mixer_add(mixer, path, MIXER_S16, gain, read_file, src);
+    else
+    {
+	if ((src->conv = arena_alloc(&arena, sizeof(*src->conv), 0)) == NULL)
+	{
+	    printf("ERROR: No enough memory\n");
+	    exit(1);
+	}
+	converter_init(src->conv, info.format, info.channels, info.rate, rate,
+		       mixer->period);
+	in = mixer_add(mixer, path, MIXER_FLOAT, gain, read_file_converted, src);
+    }
+    if (in == NULL)
+    {
+	printf("ERROR: Too many inputs\n");
+	exit(1);
+    }
+    return in;
+}
+
+
+/**
+ * Open a capture stream as a mixer input. The device runs at its own
+ * rate and format; anything but S16_LE at the mix rate is converted
+ * @param *mixer mixer
+ * @param *device capture device
+ * @param gain input gain
+ * @param rate mix rate
+ * @return handle to capture, to start with the mix
+ */
+static snd_pcm_t *add_capture(struct mixer *mixer,
+			      char *device,
+			      float gain,
+			      unsigned int rate)
+{
+    struct capture_source *src = arena_alloc(&arena, sizeof(*src), 0);
+    snd_pcm_t *capture_handle;
+    snd_pcm_hw_params_t *params;
+    snd_pcm_format_t format;
+    unsigned int native;
+    struct mixer_input *in;
+
+    if (src == NULL)
+    {
+	printf("ERROR: No enough memory\n");
+	exit(1);
+    }
+    open_pcm(&capture_handle, device, SND_PCM_STREAM_CAPTURE, 0);
+    snd_pcm_hw_params_alloca(&params);
+    snd_pcm_hw_params_any(capture_handle, params);
+    set_access(capture_handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
+    format = set_native_format(capture_handle, params, SND_PCM_FORMAT_S16_LE,
+			       NULL);
+    set_channels(capture_handle, params, mixer->channels);
+    native = set_native_rate(capture_handle, params, rate);
+    set_profile(capture_handle, params, PCM_PROFILE_BALANCED);
+    pcm_stats_attach(&pcm_stats_capture, capture_handle);
+    src->handle = capture_handle;
+    src->conv = NULL;
+    if (format == SND_PCM_FORMAT_S16_LE && native == rate)
+	in = mixer_add(mixer, device, MIXER_S16, gain, read_capture, src);
+    else
+    {
+	if ((src->conv = arena_alloc(&arena, sizeof(*src->conv), 0)) == NULL)
+	{
+	    printf("ERROR: No enough memory\n");
+	    exit(1);
+	}
+	converter_init(src->conv, format, mixer->channels, native, rate,
+		       mixer->period);
+	in = mixer_add(mixer, device, MIXER_FLOAT, gain, read_capture, src);
+    }
+    if (in == NULL)
+    {
+	printf("ERROR: Too many inputs\n");
+	exit(1);
+    }
+    return capture_handle;
+}
+
+
+int main(int argc, char *argv[])
+{
+    char *device = PCM_DEVICE;
+    char *kind, *arg;
+    unsigned int rate = 44100, channels = 2;
+    snd_pcm_format_t format = SND_PCM_FORMAT_S16_LE, mix_format;
+    struct fmtconv device_format;
+    snd_pcm_t *playback_handle;
+    snd_pcm_t *captures[MIXER_MAX_INPUTS];
+    struct mixer_input *files[MIXER_MAX_INPUTS];
+    snd_pcm_hw_params_t *params;
+    snd_pcm_uframes_t period, done = 0, total = (snd_pcm_uframes_t) -1;
+    struct sine_source *sine;
+    struct mixer mixer;
+    struct rt_config rt;
+    int seconds = 0, ncapture = 0, nfile = 0, running, i, c;
+    float gain;
+    void *out, *dev = NULL;
+
+    rt_parse_args(&argc, argv, &rt);
+    while ((c = getopt(argc, argv, "D:r:c:f:d:")) != -1)
+    {
+	switch (c)
+	{
+	case 'D':
+	    device = optarg;
+	    break;
+	case 'r':
+	    rate = atoi(optarg);
+	    break;
+	case 'c':
+	    channels = atoi(optarg);
+	    channels = channels < 1 ? 1 : channels;
+	    break;
+	case 'f':
+	    format = snd_pcm_format_value(optarg);
+	    break;
+	case 'd':
+	    seconds = atoi(optarg);
+	    break;
+	default:
+	    optind = argc;
+	    break;
+	}
+    }
+    if (optind >= argc)
+    {
+	printf("Usage: %s [-D device] [-r rate] [-c channels] [-f format] "
+	       "[-d seconds] input...\n"
+	       "inputs: sine:FREQ file:PATH capture:DEVICE, each with an "
+	       "optional @gain or @gaindB\n", argv[0]);
+	rt_usage(stdout);
+	exit(1);
+    }
+    if (getenv(RESAMPLE_ENV) &&
+	(quality = resample_quality_from_name(getenv(RESAMPLE_ENV))) < 0)
+    {
+	printf("ERROR: %s must be fast, medium or best\n", RESAMPLE_ENV);
+	exit(1);
+    }
+    rt_apply(&rt);
+
+    open_pcm(&playback_handle, device, SND_PCM_STREAM_PLAYBACK, 0);
+    snd_pcm_hw_params_alloca(&params);
+    snd_pcm_hw_params_any(playback_handle, params);
+    set_access(playback_handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
+    format = set_native_format(playback_handle, params, format, NULL);
+    set_channels(playback_handle, params, channels);
+    /* mix at the rate the device runs: sines follow it, the rest is resampled */
+    rate = set_native_rate(playback_handle, params, rate);
+    set_profile(playback_handle, params, PCM_PROFILE_BALANCED);
+    snd_pcm_hw_params_get_period_size(params, &period, 0);
+    pcm_stats_attach(&pcm_stats_playback, playback_handle);
+
+    /* formats the mixer doesn't store are mixed as float and converted */
+    mix_format = format;
+    if (format != SND_PCM_FORMAT_S16_LE && format != SND_PCM_FORMAT_S32_LE &&
+	format != SND_PCM_FORMAT_FLOAT_LE)
+	mix_format = SND_PCM_FORMAT_FLOAT_LE;
+
+    /* per input a period of floats, the accumulators and the output */
+    if (arena_init(&arena, (MIXER_MAX_INPUTS + 5) * period * channels *
+		   sizeof(double) + 65536, 0) < 0 ||
+	mixer_init(&mixer, &arena, channels, period, mix_format) < 0 ||
+	(out = arena_alloc(&arena, period * channels * sizeof(float), 0)) == NULL ||
+	(mix_format != format &&
+	 (fmtconv_init(&device_format, format) < 0 ||
+	  (dev = arena_alloc(&arena, period * channels * sizeof(float), 0)) == NULL)))
+    {
+	printf("ERROR: Can't mix to %s\n", snd_pcm_format_name(format));
+	exit(1);
+    }
+
+    for (i = optind; i < argc; i++)
+    {
+	kind = parse_input(argv[i], &arg, &gain);
+	if (kind && !strcmp(kind, "sine"))
+	{
+	    sine = arena_alloc(&arena, sizeof(*sine), 0);
+	    if (sine == NULL ||
+		(sine->mono = arena_alloc(&arena, period * sizeof(double), 0)) == NULL ||
+		mixer_add(&mixer, argv[i], MIXER_FLOAT, gain, read_sine, sine) == NULL)
+	    {
+		printf("ERROR: Too many inputs\n");
+		exit(1);
+	    }
+	    sine->phase = 0;
+	    sine->step = 2 * M_PI * atof(arg) / rate;
+	}
+	else if (kind && !strcmp(kind, "file"))
+	    files[nfile++] = add_file(&mixer, arg, gain, rate);
+	else if (kind && !strcmp(kind, "capture"))
+	    captures[ncapture++] = add_capture(&mixer, arg, gain, rate);
+	else
+	{
+	    printf("ERROR: Unknown input \"%s\"\n", argv[i]);
+	    exit(1);
+	}
+    }
+    if (seconds > 0)
+	total = (snd_pcm_uframes_t) seconds * rate;
+    else if (nfile == 0)
+    {
+	printf("ERROR: Endless inputs need a duration (-d)\n");
+	exit(1);
+    }
+
+    for (i = 0; i < ncapture; i++)
+	snd_pcm_start(captures[i]);
+    while (done < total)
+    {
+	running = mixer_run(&mixer, out);
+	if (running < 0)
+	{
+	    printf("ERROR: Input failed. %s\n", snd_strerror(running));
+	    exit(1);
+	}
+	if (dev)
+	{
+	    fmtconv_encode(&device_format, dev, out, period * channels);
+	    play(playback_handle, dev, period);
+	}
+	else
+	    play(playback_handle, out, period);
+	done += period;
+	/* without a duration, the files decide when the mix is over */
+	for (i = 0; i < nfile && files[i]->done; i++)
+	    ;
+	if (running == 0 || (seconds <= 0 && i == nfile))
+	    break;
+    }
+
+    snd_pcm_drain(playback_handle);
+    snd_pcm_close(playback_handle);
+    for (i = 0; i < ncapture; i++)
+	snd_pcm_close(captures[i]);
+    for (i = 0; i < nconverters; i++)
+	arena_destroy(&converters[i]->arena);
+    arena_destroy(&arena);
+    return 0;
+}
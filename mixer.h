@@ -0,0 +1,387 @@
+#ifndef MIXER_H
+#define MIXER_H
+
+#include <alsa/asoundlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "arena.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define MIXER_MAX_INPUTS 16
+#define MIXER_GAIN_BITS 15	/* S16 input gains are Q15 fixed point */
+#define MIXER_ACC_SHIFT 7	/* S16 accumulator: sample * gain >> 7, i.e. Q8 */
+#define MIXER_ACC_BITS (MIXER_GAIN_BITS - MIXER_ACC_SHIFT)
+
+/**
+ * Sample type an input delivers: S16 inputs (files, capture) are summed
+ * in an int32 accumulator, float inputs (generators) in a float one.
+ * The S16 accumulator keeps 8 fraction bits; S16 gains are capped just
+ * under 2 (+6 dB) so a product fits, which leaves headroom for
+ * MIXER_MAX_INPUTS inputs many times over: the sum never wraps.
+ */
+enum mixer_sample
+{
+    MIXER_S16,
+    MIXER_FLOAT
+};
+
+struct mixer_input;
+
+/**
+ * Fill the input's buffer with interleaved frames of the mixer's
+ * channels count, in the input's sample type
+ * @param *in input, in->buf is the destination
+ * @param frames frames wanted, at most the mixer period
+ * @return frames delivered (fewer at the end of the input), or a
+ *         negative error code
+ */
+typedef snd_pcm_sframes_t (*mixer_read_t)(struct mixer_input *in,
+					  snd_pcm_uframes_t frames);
+
+/**
+ * One source of the mix
+ */
+struct mixer_input
+{
+    const char *name;
+    enum mixer_sample type;
+    mixer_read_t read;
+    void *data;			/* for read() */
+    void *buf;			/* one period, cache line aligned */
+    unsigned int channels;	/* of the mixer, per frame in buf */
+    float gain;			/* linear */
+    int32_t gain_q;		/* gain in Q15, S16 inputs */
+    int done;			/* delivered its last frame */
+};
+
+/**
+ * Sums up to MIXER_MAX_INPUTS inputs into periods of the device format.
+ * Every buffer is a separate cache line aligned block, and each input
+ * is summed in one sequential pass over its period, so the mix streams
+ * through memory. The sum is converted back with saturation.
+ */
+struct mixer
+{
+    unsigned int channels;
+    snd_pcm_uframes_t period;	/* frames per mixer_run() */
+    snd_pcm_format_t format;	/* output: S16_LE, S32_LE or FLOAT_LE */
+    int count;
+    struct mixer_input inputs[MIXER_MAX_INPUTS];
+    int32_t *iacc;		/* S16 inputs, Q8 */
+    float *facc;		/* float inputs, [-1, 1] full scale */
+    struct arena *arena;
+};
+
+
+/**
+ * Set up a mixer, its accumulators taken from an arena
+ * @param *mixer mixer to initialise
+ * @param *arena arena for the accumulators and the input buffers
+ * @param channels channels count of every input and of the output
+ * @param period frames mixed per call
+ * @param format output format: S16_LE, S32_LE or FLOAT_LE
+ * @return 0 on success, -EINVAL for another format, -ENOMEM if the
+ *         arena is full
+ */
+int mixer_init(struct mixer *mixer,
+	       struct arena *arena,
+	       unsigned int channels,
+	       snd_pcm_uframes_t period,
+	       snd_pcm_format_t format)
+{
+    size_t samples = period * channels;
+
+    if (format != SND_PCM_FORMAT_S16_LE && format != SND_PCM_FORMAT_S32_LE &&
+	format != SND_PCM_FORMAT_FLOAT_LE)
+	return -EINVAL;
+    mixer->channels = channels;
+    mixer->period = period;
+    mixer->format = format;
+    mixer->count = 0;
+    mixer->arena = arena;
+    mixer->iacc = arena_alloc(arena, samples * sizeof(int32_t), 0);
+    mixer->facc = arena_alloc(arena, samples * sizeof(float), 0);
+    if (mixer->iacc == NULL || mixer->facc == NULL)
+	return -ENOMEM;
+    return 0;
+}
+
+
+/**
+ * Add an input to the mix
+ * @param *mixer mixer
+ * @param *name shown in messages
+ * @param type sample type read() delivers
+ * @param gain linear gain
+ * @param read fills a period of the input
+ * @param *data passed along in in->data
+ * @return the input, or NULL if the mixer or the arena is full
+ */
+struct mixer_input *mixer_add(struct mixer *mixer,
+			      const char *name,
+			      enum mixer_sample type,
+			      float gain,
+			      mixer_read_t read,
+			      void *data)
+{
+    struct mixer_input *in;
+    size_t bytes = mixer->period * mixer->channels *
+	(type == MIXER_S16 ? sizeof(int16_t) : sizeof(float));
+
+    if (mixer->count == MIXER_MAX_INPUTS)
+	return NULL;
+    in = &mixer->inputs[mixer->count];
+    in->buf = arena_alloc(mixer->arena, bytes, 0);
+    if (in->buf == NULL)
+	return NULL;
+    in->name = name;
+    in->type = type;
+    in->read = read;
+    in->data = data;
+    in->channels = mixer->channels;
+    /* Q15 in [-65536, 65534]: the SSE2 kernel splits it in two int16 */
+    if (type == MIXER_S16 && fabsf(gain) >= 1.99994f)
+	gain = gain < 0 ? -1.99994f : 1.99994f;
+    in->gain = gain;
+    in->gain_q = lrintf(gain * (1 << MIXER_GAIN_BITS));
+    in->done = 0;
+    mixer->count++;
+    return in;
+}
+
+
+/*
+ * Accumulate and convert kernels, with SSE2 by hand where available
+ * so the mix is vectorized at any optimization level; the scalar loops
+ * finish the remainder and are the whole kernel elsewhere.
+ */
+static void mixer_acc_s16(int32_t *acc,
+			  const int16_t *in,
+			  int32_t gain,
+			  size_t n)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    /* no pmulld in SSE2: pmaddwd sums in * lo + in * hi, lo + hi = gain */
+    const int16_t lo = gain >> 1, hi = gain - lo;
+    const __m128i g = _mm_set_epi16(hi, lo, hi, lo, hi, lo, hi, lo);
+    for (; i + 8 <= n; i += 8)
+    {
+	__m128i x = _mm_loadu_si128((const __m128i *) (in + i));
+	__m128i a = _mm_loadu_si128((const __m128i *) (acc + i));
+	__m128i b = _mm_loadu_si128((const __m128i *) (acc + i + 4));
+	a = _mm_add_epi32(a, _mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(x, x), g),
+					    MIXER_ACC_SHIFT));
+	b = _mm_add_epi32(b, _mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(x, x), g),
+					    MIXER_ACC_SHIFT));
+	_mm_storeu_si128((__m128i *) (acc + i), a);
+	_mm_storeu_si128((__m128i *) (acc + i + 4), b);
+    }
+#endif
+    for (; i < n; i++)
+	acc[i] += (in[i] * gain) >> MIXER_ACC_SHIFT;
+}
+
+
+static void mixer_acc_float(float *acc,
+			    const float *in,
+			    float gain,
+			    size_t n)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128 g = _mm_set1_ps(gain);
+    for (; i + 8 <= n; i += 8)
+    {
+	_mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i),
+					  _mm_mul_ps(_mm_loadu_ps(in + i), g)));
+	_mm_storeu_ps(acc + i + 4, _mm_add_ps(_mm_loadu_ps(acc + i + 4),
+					      _mm_mul_ps(_mm_loadu_ps(in + i + 4), g)));
+    }
+#endif
+    for (; i < n; i++)
+	acc[i] += in[i] * gain;
+}
+
+
+/* fold the S16 sum into the float one, for float inputs or outputs */
+static void mixer_fold(float *facc,
+		       const int32_t *iacc,
+		       size_t n)
+{
+    const float scale = 1.0f / (32768 << MIXER_ACC_BITS);
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128 s = _mm_set1_ps(scale);
+    for (; i + 4 <= n; i += 4)
+    {
+	__m128 x = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *) (iacc + i)));
+	_mm_storeu_ps(facc + i, _mm_add_ps(_mm_loadu_ps(facc + i),
+					   _mm_mul_ps(x, s)));
+    }
+#endif
+    for (; i < n; i++)
+	facc[i] += iacc[i] * scale;
+}
+
+
+static void mixer_store_s16_from_int(int16_t *out,
+				     const int32_t *acc,
+				     size_t n)
+{
+    size_t i = 0;
+    int32_t v;
+
+#ifdef __SSE2__
+    for (; i + 8 <= n; i += 8)
+    {
+	__m128i a = _mm_srai_epi32(_mm_loadu_si128((const __m128i *) (acc + i)),
+				   MIXER_ACC_BITS);
+	__m128i b = _mm_srai_epi32(_mm_loadu_si128((const __m128i *) (acc + i + 4)),
+				   MIXER_ACC_BITS);
+	_mm_storeu_si128((__m128i *) (out + i), _mm_packs_epi32(a, b));
+    }
+#endif
+    for (; i < n; i++)
+    {
+	v = acc[i] >> MIXER_ACC_BITS;
+	out[i] = v > 32767 ? 32767 : v < -32768 ? -32768 : v;
+    }
+}
+
+
+static void mixer_store_s16_from_float(int16_t *out,
+				       const float *acc,
+				       size_t n)
+{
+    size_t i = 0;
+    float v;
+
+#ifdef __SSE2__
+    const __m128 scale = _mm_set1_ps(32768.0f);
+    for (; i + 8 <= n; i += 8)
+    {
+	/* cvtps rounds and turns overflow into INT_MIN, so clamp first */
+	__m128 x = _mm_min_ps(_mm_mul_ps(_mm_loadu_ps(acc + i), scale),
+			      _mm_set1_ps(65536.0f));
+	__m128 y = _mm_min_ps(_mm_mul_ps(_mm_loadu_ps(acc + i + 4), scale),
+			      _mm_set1_ps(65536.0f));
+	_mm_storeu_si128((__m128i *) (out + i),
+			 _mm_packs_epi32(_mm_cvtps_epi32(x), _mm_cvtps_epi32(y)));
+    }
+#endif
+    for (; i < n; i++)
+    {
+	v = acc[i] * 32768.0f;
+	out[i] = v >= 32767.0f ? 32767 : v <= -32768.0f ? -32768 : lrintf(v);
+    }
+}
+
+
+static void mixer_store_s32(int32_t *out,
+			    const float *acc,
+			    size_t n)
+{
+    size_t i;
+    float v;
+
+    for (i = 0; i < n; i++)
+    {
+	v = acc[i];
+	/* 2^31 isn't representable in int32, clamp just below full scale */
+	out[i] = v >= 1.0f ? INT32_MAX : v <= -1.0f ? INT32_MIN :
+	    (int32_t) lrint(v * 2147483648.0);
+    }
+}
+
+
+static void mixer_store_float(float *out,
+			      const float *acc,
+			      size_t n)
+{
+    size_t i;
+    float v;
+
+    for (i = 0; i < n; i++)
+    {
+	v = acc[i];
+	out[i] = v > 1.0f ? 1.0f : v < -1.0f ? -1.0f : v;
+    }
+}
+
+
+/**
+ * Mix one period of every input that isn't done into out.
+ * Inputs that come up short are padded with silence and marked done
+ * @param *mixer mixer
+ * @param *out one period in the mixer format
+ * @return inputs still running after this period, or the first
+ *         negative error code a read() returned
+ */
+int mixer_run(struct mixer *mixer,
+	      void *out)
+{
+    size_t n = mixer->period * mixer->channels;
+    struct mixer_input *in;
+    snd_pcm_sframes_t got;
+    int i, have_int = 0, have_float = 0, running = 0;
+
+    for (i = 0; i < mixer->count; i++)
+    {
+	in = &mixer->inputs[i];
+	if (in->done)
+	    continue;
+	got = in->read(in, mixer->period);
+	if (got < 0)
+	    return got;
+	if ((snd_pcm_uframes_t) got < mixer->period)
+	    in->done = 1;
+	else
+	    running++;
+	if (got == 0)
+	    continue;
+	/* the first input of each type sets the accumulator, the rest add */
+	if (in->type == MIXER_S16)
+	{
+	    if (!have_int)
+		memset(mixer->iacc, 0, n * sizeof(int32_t));
+	    have_int = 1;
+	    mixer_acc_s16(mixer->iacc, in->buf, in->gain_q, got * mixer->channels);
+	}
+	else
+	{
+	    if (!have_float)
+		memset(mixer->facc, 0, n * sizeof(float));
+	    have_float = 1;
+	    mixer_acc_float(mixer->facc, in->buf, in->gain, got * mixer->channels);
+	}
+    }
+
+    if (mixer->format == SND_PCM_FORMAT_S16_LE && !have_float)
+    {
+	/* integer only: no float round trip at all */
+	if (!have_int)
+	    memset(mixer->iacc, 0, n * sizeof(int32_t));
+	mixer_store_s16_from_int(out, mixer->iacc, n);
+	return running;
+    }
+    if (!have_float)
+	memset(mixer->facc, 0, n * sizeof(float));
+    if (have_int)
+	mixer_fold(mixer->facc, mixer->iacc, n);
+    if (mixer->format == SND_PCM_FORMAT_S16_LE)
+	mixer_store_s16_from_float(out, mixer->facc, n);
+    else if (mixer->format == SND_PCM_FORMAT_S32_LE)
+	mixer_store_s32(out, mixer->facc, n);
+    else
+	mixer_store_float(out, mixer->facc, n);
+    return running;
+}
+
+#endif
@@ -1,6 +1,11 @@
 #include <alsa/asoundlib.h>
+#include <pthread.h>
+#include <time.h>
+#include "pcmstats.h"
+#include "fmtconv.h"
 
-#define PCM_DEVICE "plughw:0,0"
+#define PCM_DEVICE "hw:0,0"		/* native rates only, see resample.h */
+#define PCM_TUNED_FILE "pcm_tuned.conf"	/* written by tune_period */
  
  
 /**
@@ -31,20 +36,21 @@ void open_pcm (snd_pcm_t **pcm_handle,
 /**
  * Restrict a configuration space to contain only
  * one access type 
- * and writes an error if interleaved mode can't be set
+ * and writes an error if the access type can't be set
  * @param **pcm_handle handle to pcm
  * @param *params configuration space
+ * @param access access type
  */
 void set_access (snd_pcm_t *pcm_handle, 
-		    snd_pcm_hw_params_t *params)
+		    snd_pcm_hw_params_t *params,
+		    snd_pcm_access_t access)
 {
-    unsigned int pcm;
-    pcm = snd_pcm_hw_params_set_access(pcm_handle, params,
-				       SND_PCM_ACCESS_RW_INTERLEAVED);
+    int pcm;
+    pcm = snd_pcm_hw_params_set_access(pcm_handle, params, access);
     if (pcm < 0)
     { 
-	printf("ERROR: Can't set interleaved mode. %s\n", 
-	       snd_strerror(pcm));
+	printf("ERROR: Can't set %s mode. %s\n", 
+	       snd_pcm_access_name(access), snd_strerror(pcm));
 	exit(1);
     }
 }
@@ -54,22 +60,63 @@ void set_access (snd_pcm_t *pcm_handle,
  * and writes an error if format can't be set
  * @param **pcm_handle handle to pcm
  * @param *params configuration space
+ * @param format sample format
  */
 void set_format (snd_pcm_t *pcm_handle,
-		    snd_pcm_hw_params_t *params)
+		    snd_pcm_hw_params_t *params,
+		    snd_pcm_format_t format)
 {
-    unsigned int pcm;
-    pcm = snd_pcm_hw_params_set_format(pcm_handle, params,
-				       SND_PCM_FORMAT_S16_LE);
+    int pcm;
+    pcm = snd_pcm_hw_params_set_format(pcm_handle, params, format);
     if (pcm < 0)
     { 
-	printf("ERROR: Can't set format. %s\n",
-	       snd_strerror(pcm));
+	printf("ERROR: Can't set format %s. %s\n",
+	       snd_pcm_format_name(format), snd_strerror(pcm));
 	exit(1);
     }
 }
 
 
+/**
+ * Restrict a configuration space to the wanted format if the device
+ * takes it natively, otherwise to the first candidate it does take,
+ * for the caller to convert to (fmtconv.h) rather than the plug layer
+ * and writes an error if none can be set
+ * @param **pcm_handle handle to pcm
+ * @param *params configuration space
+ * @param wanted format of the stream
+ * @param *formats candidates in order of preference, ending with
+ *        SND_PCM_FORMAT_UNKNOWN, or NULL for fmtconv_preferred
+ * @return the format set
+ */
+snd_pcm_format_t set_native_format(snd_pcm_t *pcm_handle,
+				   snd_pcm_hw_params_t *params,
+				   snd_pcm_format_t wanted,
+				   const snd_pcm_format_t *formats)
+{
+    snd_pcm_format_t format = wanted;
+    int i;
+
+    if (formats == NULL)
+	formats = fmtconv_preferred;
+    for (i = 0; snd_pcm_hw_params_test_format(pcm_handle, params, format) < 0; i++)
+    {
+	format = formats[i];
+	if (format == SND_PCM_FORMAT_UNKNOWN)
+	{
+	    printf("ERROR: Can't set format %s or one to convert to\n",
+		   snd_pcm_format_name(wanted));
+	    exit(1);
+	}
+    }
+    set_format(pcm_handle, params, format);
+    if (format != wanted)
+	fprintf(stderr, "%s is not native, using %s\n",
+		snd_pcm_format_name(wanted), snd_pcm_format_name(format));
+    return format;
+}
+
+
 /**
  * Restrict a configuration space to one channels count 
  * and writes an error if channels number can't be set
@@ -114,6 +161,62 @@ void set_rate(snd_pcm_t *pcm_handle,
 }
 
 
+/**
+ * Restrict a configuration space to the rate nearest the wanted one
+ * that the device runs natively: alsa-lib resampling is turned off, so
+ * a plug device doesn't convert behind our back either. Callers either
+ * run at the rate set or convert to it themselves (resample.h)
+ * and writes an error if no rate can be set
+ * @param **pcm_handle handle to pcm
+ * @param *params configuration space
+ * @param rate wanted rate
+ * @return the rate set
+ */
+unsigned int set_native_rate(snd_pcm_t *pcm_handle,
+			     snd_pcm_hw_params_t *params,
+			     unsigned int rate)
+{
+    unsigned int native = rate;
+    int pcm;
+
+    snd_pcm_hw_params_set_rate_resample(pcm_handle, params, 0);
+    pcm = snd_pcm_hw_params_set_rate_near(pcm_handle, params, &native, 0);
+    if (pcm < 0)
+    {
+	printf("ERROR: Can't set rate. %s\n", snd_strerror(pcm));
+	exit(1);
+    }
+    if (native != rate)
+	fprintf(stderr, "%u Hz is not native, running at %u Hz\n",
+		rate, native);
+    return native;
+}
+
+
+/**
+ * Set hardware parameters for any access type and sample format
+ * and writes an errors if parameters can't be set
+ * @param **pcm_handle handle to pcm
+ * @param *params configuration space
+ * @param access access type
+ * @param format sample format
+ * @param channels channels count
+ * @param rate approximate rate
+ */
+void set_stream_params(snd_pcm_t *pcm_handle,
+		       snd_pcm_hw_params_t *params,
+		       snd_pcm_access_t access,
+		       snd_pcm_format_t format,
+		       int channels,
+		       int rate)
+{
+    set_access(pcm_handle,params,access);
+    set_format(pcm_handle,params,format);
+    set_channels(pcm_handle,params,channels);
+    set_rate(pcm_handle,params,rate);
+}
+
+
 /**
  * Set hardware parameters
  * and writes an errors if parameters can't be set
@@ -127,10 +230,8 @@ void set_params(snd_pcm_t *pcm_handle,
 		   int channels,
 		   int rate)
 {
-    set_access(pcm_handle,params);
-    set_format(pcm_handle,params);
-    set_channels(pcm_handle,params,channels);
-    set_rate(pcm_handle,params,rate);
+    set_stream_params(pcm_handle,params,SND_PCM_ACCESS_RW_INTERLEAVED,
+		      SND_PCM_FORMAT_S16_LE,channels,rate);
 }
 
 
@@ -152,6 +253,219 @@ void write_params(snd_pcm_t *pcm_handle,
 	exit(1);
     }
 }
+/**
+ * Latency profiles for set_profile()
+ */
+enum pcm_profile
+{
+    PCM_PROFILE_LOW_LATENCY,
+    PCM_PROFILE_BALANCED,
+    PCM_PROFILE_POWER_SAVE,
+    PCM_PROFILE_TUNED		/* sizes found by tune_period */
+};
+
+/**
+ * Period size and count of a profile, and the software thresholds
+ * in periods: start when start_periods are queued, wake up when
+ * wake_periods can be transferred
+ */
+struct pcm_profile_spec
+{
+    const char *name;
+    unsigned int period_time;	/* us */
+    unsigned int periods;
+    unsigned int start_periods;	/* 0: the whole buffer */
+    unsigned int wake_periods;
+};
+
+static const struct pcm_profile_spec pcm_profiles[] =
+{
+    { "low-latency", 3000, 3, 1, 1 },
+    { "balanced", 10000, 4, 0, 1 },
+    { "power-save", 250000, 4, 0, 2 },
+    { "tuned", 0, 0, 0, 1 },
+};
+
+
+/**
+ * Smallest stable configuration found by tune_period
+ */
+struct pcm_tuned
+{
+    char device[192];			/* tuned on, "" if not recorded */
+    unsigned int channels;		/* tuned with, 0 if not recorded */
+    unsigned int rate;
+    snd_pcm_uframes_t period_size;
+    snd_pcm_uframes_t buffer_size;
+};
+
+
+/**
+ * Load a configuration written by tune_period: key=value lines,
+ * # comments, unknown keys ignored. The device and channels it was
+ * tuned with are kept for set_profile() to check
+ * @param *path file to read
+ * @param *tuned configuration to fill in
+ * @return 0 on success, -errno if the file can't be read
+ * or -EINVAL if it lacks the sizes
+ */
+int load_tuned(const char *path,
+	       struct pcm_tuned *tuned)
+{
+    char line[256], key[64], text[192];
+    unsigned long value;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (f == NULL)
+	return -errno;
+    tuned->device[0] = '\0';
+    tuned->channels = 0;
+    tuned->rate = 0;
+    tuned->period_size = 0;
+    tuned->buffer_size = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+	if (line[0] == '#' || sscanf(line, " %63[^=]=%191[^\n]", key, text) != 2)
+	    continue;
+	value = strtoul(text, NULL, 10);
+	if (!strcmp(key, "device"))
+	    snprintf(tuned->device, sizeof(tuned->device), "%s", text);
+	else if (!strcmp(key, "channels"))
+	    tuned->channels = value;
+	else if (!strcmp(key, "rate"))
+	    tuned->rate = value;
+	else if (!strcmp(key, "period_size"))
+	    tuned->period_size = value;
+	else if (!strcmp(key, "buffer_size"))
+	    tuned->buffer_size = value;
+    }
+    fclose(f);
+    if (tuned->rate == 0 || tuned->period_size == 0 ||
+	tuned->buffer_size < tuned->period_size)
+	return -EINVAL;
+    return 0;
+}
+
+
+/**
+ * Look up a profile by name
+ * and writes an error if there's no such profile
+ * @param *name profile name
+ * @return profile
+ */
+enum pcm_profile profile_from_name(const char *name)
+{
+    unsigned int i;
+    for (i = 0; i < sizeof(pcm_profiles) / sizeof(pcm_profiles[0]); i++)
+	if (!strcasecmp(name, pcm_profiles[i].name))
+	    return i;
+    printf("ERROR: Unknown profile \"%s\", use one of:", name);
+    for (i = 0; i < sizeof(pcm_profiles) / sizeof(pcm_profiles[0]); i++)
+	printf(" %s", pcm_profiles[i].name);
+    printf("\n");
+    exit(1);
+}
+
+
+/**
+ * Negotiate period and buffer sizes for a latency profile, write the
+ * hardware parameters and set start threshold and avail_min
+ * and writes an error if parameters can't be set.
+ * Replaces write_params() after set_params() or set_stream_params().
+ * PCM_PROFILE_TUNED reads the sizes from the file named by the
+ * PCM_TUNED environment variable, or PCM_TUNED_FILE, scaled to the rate,
+ * and writes an error if they were tuned on another device or with
+ * another channels count
+ * @param *pcm_handle handle to the pcm
+ * @param *params configuration space with rate and channels already set
+ * @param profile wanted profile
+ * @return achieved latency, the buffer size in frames
+ */
+snd_pcm_uframes_t set_profile(snd_pcm_t *pcm_handle,
+			      snd_pcm_hw_params_t *params,
+			      enum pcm_profile profile)
+{
+    const struct pcm_profile_spec *spec = &pcm_profiles[profile];
+    snd_pcm_sw_params_t *swparams;
+    snd_pcm_uframes_t period, buffer, start;
+    struct pcm_tuned tuned;
+    const char *path;
+    unsigned int rate, channels;
+    int pcm, dir = 0;
+
+    snd_pcm_hw_params_get_rate(params, &rate, &dir);
+    if (profile == PCM_PROFILE_TUNED)
+    {
+	path = getenv("PCM_TUNED") ? getenv("PCM_TUNED") : PCM_TUNED_FILE;
+	pcm = load_tuned(path, &tuned);
+	if (pcm < 0)
+	{
+	    printf("ERROR: Can't load \"%s\", run tune_period first. %s\n",
+		   path, snd_strerror(pcm));
+	    exit(1);
+	}
+	/* sizes that ran clean on one card say nothing about another */
+	if (tuned.device[0] && strcmp(tuned.device, snd_pcm_name(pcm_handle)))
+	{
+	    printf("ERROR: \"%s\" was tuned on %s, not %s, run tune_period -D %s\n",
+		   path, tuned.device, snd_pcm_name(pcm_handle),
+		   snd_pcm_name(pcm_handle));
+	    exit(1);
+	}
+	if (tuned.channels &&
+	    snd_pcm_hw_params_get_channels(params, &channels) == 0 &&
+	    channels != tuned.channels)
+	{
+	    printf("ERROR: \"%s\" was tuned with %u channels, not %u, run tune_period -c %u\n",
+		   path, tuned.channels, channels, channels);
+	    exit(1);
+	}
+	period = (unsigned long long) tuned.period_size * rate / tuned.rate;
+	buffer = (unsigned long long) tuned.buffer_size * rate / tuned.rate;
+    }
+    else
+    {
+	period = (snd_pcm_uframes_t) rate * spec->period_time / 1000000;
+	buffer = period * spec->periods;
+    }
+    pcm = snd_pcm_hw_params_set_buffer_size_near(pcm_handle, params, &buffer);
+    if (pcm == 0)
+	pcm = snd_pcm_hw_params_set_period_size_near(pcm_handle, params,
+						     &period, &dir);
+    if (pcm < 0)
+    {
+	printf("ERROR: Can't set %s buffer. %s\n", spec->name,
+	       snd_strerror(pcm));
+	exit(1);
+    }
+    write_params(pcm_handle, params);
+    snd_pcm_hw_params_get_buffer_size(params, &buffer);
+    snd_pcm_hw_params_get_period_size(params, &period, &dir);
+
+    /* start as soon as the profile allows, but never past the buffer */
+    start = spec->start_periods ? spec->start_periods * period :
+	(buffer / period) * period;
+    if (start > buffer)
+	start = buffer;
+    snd_pcm_sw_params_alloca(&swparams);
+    snd_pcm_sw_params_current(pcm_handle, swparams);
+    pcm = snd_pcm_sw_params_set_start_threshold(pcm_handle, swparams, start);
+    if (pcm == 0)
+	pcm = snd_pcm_sw_params_set_avail_min(pcm_handle, swparams,
+					      spec->wake_periods * period);
+    if (pcm == 0)
+	pcm = snd_pcm_sw_params(pcm_handle, swparams);
+    if (pcm < 0)
+    {
+	printf("ERROR: Can't set software parameters. %s\n",
+	       snd_strerror(pcm));
+	exit(1);
+    }
+    return buffer;
+}
+
+
 /**
  * Prepair audio interface for use
  * and writes an error if it can't be prepaired
@@ -159,7 +473,7 @@ void write_params(snd_pcm_t *pcm_handle,
  */
 void prepair_interface(snd_pcm_t *pcm_handle)
 {
-    unsigned int pcm;
+    int pcm;
     pcm = snd_pcm_prepare (pcm_handle);
     if (pcm < 0)
     {
@@ -189,6 +503,62 @@ unsigned int get_period_time(snd_pcm_hw_params_t *params)
     return tmp;
 }
 
+#define RECOVER_BACKOFF_MIN 1		/* ms */
+#define RECOVER_BACKOFF_MAX 64		/* ms, the worst extra delay after a resume */
+#define RECOVER_FDS 16			/* poll descriptors waited on */
+
+/**
+ * Wait up to ms for a suspended device, on its poll descriptors rather
+ * than with sleep(), between two snd_pcm_resume() calls that gave
+ * -EAGAIN; the caller doubles ms from RECOVER_BACKOFF_MIN up to
+ * RECOVER_BACKOFF_MAX. A suspended PCM keeps reporting POLLERR, so a
+ * wakeup that leaves it suspended sits out the rest of the wait
+ * instead of spinning
+ * @param *pcm_handle handle to the suspended pcm
+ * @param ms longest wait
+ */
+void recovery_wait(snd_pcm_t *pcm_handle,
+		   int ms)
+{
+    struct pollfd ufds[RECOVER_FDS];
+    struct timespec start, end;
+    int count;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    count = snd_pcm_poll_descriptors(pcm_handle, ufds, RECOVER_FDS);
+    if (count > 0 && poll(ufds, count, ms) > 0 &&
+	snd_pcm_state(pcm_handle) != SND_PCM_STATE_SUSPENDED)
+	return;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ms -= (end.tv_sec - start.tv_sec) * 1000 +
+	(end.tv_nsec - start.tv_nsec) / 1000000;
+    if (ms > 0)
+	poll(NULL, 0, ms);
+}
+
+
+/**
+ * Resume a suspended stream, waiting with recovery_wait() while the
+ * driver isn't ready to
+ * @param *pcm_handle handle to the suspended pcm
+ * @return 0 once resumed, or the error of snd_pcm_resume() when the
+ *         stream can't be resumed and must be prepared instead
+ */
+int resume_pcm(snd_pcm_t *pcm_handle)
+{
+    int backoff = RECOVER_BACKOFF_MIN;
+    int pcm;
+
+    while ((pcm = snd_pcm_resume(pcm_handle)) == -EAGAIN)
+    {
+	recovery_wait(pcm_handle, backoff);
+	if (backoff < RECOVER_BACKOFF_MAX)
+	    backoff *= 2;
+    }
+    return pcm;
+}
+
+
 /**
  * Write contents of a buffer to the PCM
  * write error when unable to write to PCM device 
@@ -201,14 +571,25 @@ void play(snd_pcm_t *pcm_handle,
 	     char *buff,
 	     int buffer_size)		  
 {
-    unsigned int pcm;
+    snd_pcm_sframes_t pcm;
+    pcm_stats_wakeup(&pcm_stats_playback, pcm_handle);
     pcm = snd_pcm_writei(pcm_handle, buff, buffer_size);
     if (pcm == -EPIPE)
     {
+	pcm_stats_xrun(&pcm_stats_playback);
 	printf("ERROR: an underrun occured\n");
-	snd_pcm_prepare(pcm_handle);
+	pcm = snd_pcm_prepare(pcm_handle);
+    }
+    else if (pcm == -ESTRPIPE)
+    {
+	pcm_stats_suspend(&pcm_stats_playback);
+	printf("ERROR: a suspend event occured\n");
+	/* as recover_capture(): resume if the driver can, else prepare */
+	pcm = resume_pcm(pcm_handle);
+	if (pcm < 0)
+	    pcm = snd_pcm_prepare(pcm_handle);
     }
-    else if (pcm < 0) 
+    if (pcm < 0) 
     {
 	printf("ERROR. Can't write to PCM device. %s\n",
 	       snd_strerror(pcm));
@@ -219,43 +600,580 @@ void play(snd_pcm_t *pcm_handle,
 
 
 /**
- * Reading from audio card to the buffer
- * write errors too
- * @param **pcm_handle handle to playback
- * @param frames period size
- * @param period length of period
- * @param *buffer pointer to buffer
- * @param buff_size size of the buffer
+ * Restart a capture stream after an overrun or a suspend and account
+ * for the audio lost: what sat in the buffer (an overrun discards it)
+ * plus the time the stream was stopped, measured between the trigger
+ * timestamps snd_pcm_status() reports before and after the restart.
+ * For a stream of its own: the streams of a duplex session are
+ * recovered together by duplex_recover()
+ * @param *pcm_handle handle to capture
+ * @param err -EPIPE or -ESTRPIPE
+ * @return 0 on success or a negative error code
  */
-void record(snd_pcm_t *pcm_handle,  
-	       char *buff,	  
-	       snd_pcm_uframes_t frames) 
-		  
+int recover_capture(snd_pcm_t *pcm_handle,
+		    int err)
 {
-    unsigned int pcm;
-    pcm = snd_pcm_readi (pcm_handle, buff, frames);
-    if (pcm != frames) 
+    snd_pcm_status_t *status;
+    snd_pcm_hw_params_t *params;
+    snd_htimestamp_t stopped, restarted;
+    snd_pcm_uframes_t buffer_size = 0, lost = 0;
+    unsigned int rate = 0;
+    double elapsed;
+    int resumed = 0;
+
+    snd_pcm_status_alloca(&status);
+    snd_pcm_hw_params_alloca(&params);
+    if (snd_pcm_hw_params_current(pcm_handle, params) == 0)
     {
-	fprintf (stderr, "ERROR: read from audio interface failed (%s)\n",
-		 snd_strerror (pcm));
-	exit (1);
+	snd_pcm_hw_params_get_rate(params, &rate, NULL);
+	snd_pcm_hw_params_get_buffer_size(params, &buffer_size);
     }
-    if (pcm == -EBADFD)
+    snd_pcm_status(pcm_handle, status);
+    snd_pcm_status_get_trigger_htstamp(status, &stopped);
+
+    if (err == -ESTRPIPE)
     {
-	fprintf (stderr, "ERROR: PCM is not in the right state (%s)\n",
-		 snd_strerror (pcm));
-	exit (1);
+	err = resume_pcm(pcm_handle);
+	resumed = err == 0;
+	if (err < 0)
+	    err = snd_pcm_prepare(pcm_handle);
     }
-    if (pcm == -EPIPE)
+    else
+	err = snd_pcm_prepare(pcm_handle);
+    if (err == 0 && !resumed)
+	err = snd_pcm_start(pcm_handle);
+    if (err < 0)
+	return err;
+
+    snd_pcm_status(pcm_handle, status);
+    snd_pcm_status_get_trigger_htstamp(status, &restarted);
+    elapsed = (restarted.tv_sec - stopped.tv_sec) +
+	(restarted.tv_nsec - stopped.tv_nsec) / 1e9;
+    if (elapsed > 0)
+	lost = elapsed * rate;
+    if (!resumed)
+	lost += buffer_size;
+    pcm_stats_gap(&pcm_stats_capture, &stopped, lost);
+    return 0;
+}
+
+
+/**
+ * Read a number of frames from the audio card into the buffer.
+ * Overruns and suspends are recovered from, counted and their
+ * lost frames logged (see recover_capture()), and the read goes on,
+ * so the buffer is always filled with audio from after the gap
+ * @param *pcm_handle handle to capture
+ * @param *buff buffer of at least frames frames
+ * @param frames frames to read
+ * @return frames read, or a negative error code the stream can't
+ *         recover from (or -EAGAIN in non-blocking mode)
+ */
+snd_pcm_sframes_t record(snd_pcm_t *pcm_handle,
+			 char *buff,
+			 snd_pcm_uframes_t frames)
+{
+    snd_pcm_uframes_t done = 0;
+    snd_pcm_sframes_t pcm;
+    int err;
+
+    pcm_stats_wakeup(&pcm_stats_capture, pcm_handle);
+    while (done < frames)
     {
-	fprintf (stderr, "ERROR: an overrun occured  (%s)\n",
-		 snd_strerror (pcm));
-	exit (1);
+	pcm = snd_pcm_readi(pcm_handle,
+			    buff + snd_pcm_frames_to_bytes(pcm_handle, done),
+			    frames - done);
+	if (pcm == -EPIPE || pcm == -ESTRPIPE)
+	{
+	    pcm_stats_error(&pcm_stats_capture, pcm);
+	    err = recover_capture(pcm_handle, pcm);
+	    if (err < 0)
+	    {
+		fprintf(stderr, "ERROR: Can't recover from %s (%s)\n",
+			pcm == -EPIPE ? "an overrun" : "a suspend",
+			snd_strerror(err));
+		return err;
+	    }
+	    continue;
+	}
+	if (pcm == -EINTR)
+	    continue;
+	if (pcm < 0)
+	{
+	    if (pcm != -EAGAIN)
+		fprintf(stderr, "ERROR: read from audio interface failed (%s)\n",
+			snd_strerror(pcm));
+	    return done > 0 ? (snd_pcm_sframes_t) done : pcm;
+	}
+	done += pcm;
     }
-    if (pcm == -ESTRPIPE)
+    return done;
+}
+
+
+#define DUPLEX_CONV_BYTES 16384	/* per stream, frames in the device format */
+
+/**
+ * A linked capture/playback pair sharing one start trigger,
+ * so both streams run from the same point in time. Both keep a start
+ * threshold of boundary: they never start on their own, only together
+ * from duplex_start() and duplex_recover().
+ * Each stream runs in a format its device takes natively; frames are
+ * read and written in the session format and converted on the way
+ * (fmtconv.h), in a buffer of each stream's own
+ */
+struct duplex_session
+{
+    snd_pcm_t *capture_handle;
+    snd_pcm_t *playback_handle;
+    int linked;				/* snd_pcm_link() succeeded */
+    unsigned int channels;
+    unsigned int rate;			/* native rate both streams run at */
+    struct fmtconv format;		/* of the frames read and written */
+    struct fmtconv capture_format;	/* native to each device */
+    struct fmtconv playback_format;
+    snd_pcm_uframes_t conv_frames;	/* frames converted at a time */
+    char capture_buf[DUPLEX_CONV_BYTES];
+    char playback_buf[DUPLEX_CONV_BYTES];
+    char silence[4096];			/* in the playback format */
+    snd_pcm_uframes_t buffer_size;	/* playback buffer, the most we can prime */
+    snd_pcm_uframes_t prime;		/* silence queued at every start */
+    pthread_mutex_t lock;		/* one recovery at a time */
+    _Atomic unsigned long restarts;	/* recoveries done */
+    snd_pcm_sframes_t latency;		/* last measured round trip */
+    snd_pcm_sframes_t latency_min;
+    snd_pcm_sframes_t latency_max;
+};
+
+
+/**
+ * Keep the stream from starting on its own when data is written,
+ * so that only an explicit snd_pcm_start() starts it
+ * and writes an error if software parameters can't be set
+ * @param *pcm_handle handle to the pcm
+ */
+void set_manual_start(snd_pcm_t *pcm_handle)
+{
+    snd_pcm_sw_params_t *swparams;
+    snd_pcm_uframes_t boundary;
+    int pcm;
+
+    snd_pcm_sw_params_alloca(&swparams);
+    snd_pcm_sw_params_current(pcm_handle, swparams);
+    snd_pcm_sw_params_get_boundary(swparams, &boundary);
+    snd_pcm_sw_params_set_start_threshold(pcm_handle, swparams, boundary);
+    pcm = snd_pcm_sw_params(pcm_handle, swparams);
+    if (pcm < 0)
     {
-	fprintf (stderr, "ERROR: a suspend event occured (%s)\n",
-		 snd_strerror (pcm));
-	exit (1);
+	printf("ERROR: Can't set software parameters. %s\n",
+	       snd_strerror(pcm));
+	exit(1);
     }
 }
+
+
+/**
+ * Open, configure and link a capture and a playback stream
+ * on the same card and prepare both for a common start.
+ * Each stream takes the format its device runs natively, nearest
+ * the session format, and is converted to and from it
+ * and writes an error if a format can't be converted
+ * @param *session duplex session to fill in
+ * @param *card audio card to use
+ * @param format format of the frames read and written
+ * @param channels channels count
+ * @param rate approximate rate
+ * @param profile latency profile of both streams
+ */
+void duplex_open(struct duplex_session *session,
+		 char *card,
+		 snd_pcm_format_t format,
+		 int channels,
+		 int rate,
+		 enum pcm_profile profile)
+{
+    snd_pcm_hw_params_t *params;
+    snd_pcm_format_t capture_format, playback_format;
+    unsigned int width;
+    int pcm;
+
+    open_pcm(&session->capture_handle, card, SND_PCM_STREAM_CAPTURE, 0);
+    open_pcm(&session->playback_handle, card, SND_PCM_STREAM_PLAYBACK, 0);
+
+    snd_pcm_hw_params_alloca(&params);
+    snd_pcm_hw_params_any(session->playback_handle, params);
+    set_access(session->playback_handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
+    playback_format = set_native_format(session->playback_handle, params,
+					format, NULL);
+    set_channels(session->playback_handle, params, channels);
+    session->rate = set_native_rate(session->playback_handle, params, rate);
+    session->buffer_size = set_profile(session->playback_handle, params,
+				       profile);
+    snd_pcm_hw_params_any(session->capture_handle, params);
+    set_access(session->capture_handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
+    capture_format = set_native_format(session->capture_handle, params,
+				       format, NULL);
+    set_channels(session->capture_handle, params, channels);
+    set_rate(session->capture_handle, params, session->rate);
+    set_profile(session->capture_handle, params, profile);
+
+    if (fmtconv_init(&session->format, format) < 0 ||
+	fmtconv_init(&session->capture_format, capture_format) < 0 ||
+	fmtconv_init(&session->playback_format, playback_format) < 0)
+    {
+	printf("ERROR: Can't convert %s\n", snd_pcm_format_name(format));
+	exit(1);
+    }
+    session->channels = channels;
+    /* the widest of the three formats fills the conversion buffers */
+    width = session->format.bytes;
+    width = width > session->capture_format.bytes ? width :
+	session->capture_format.bytes;
+    width = width > session->playback_format.bytes ? width :
+	session->playback_format.bytes;
+    session->conv_frames = DUPLEX_CONV_BYTES / (width * channels);
+    snd_pcm_format_set_silence(playback_format, session->silence,
+			       sizeof(session->silence) /
+			       session->playback_format.bytes);
+
+    set_manual_start(session->playback_handle);
+    set_manual_start(session->capture_handle);
+
+    pcm = snd_pcm_link(session->capture_handle, session->playback_handle);
+    session->linked = pcm == 0;
+    if (!session->linked)
+	fprintf(stderr, "WARNING: Can't link streams, "
+		"starting them one after the other. %s\n",
+		snd_strerror(pcm));
+
+    prepair_interface(session->capture_handle);
+    prepair_interface(session->playback_handle);
+    pcm_stats_attach(&pcm_stats_capture, session->capture_handle);
+    pcm_stats_attach(&pcm_stats_playback, session->playback_handle);
+    session->latency = 0;
+    session->latency_min = 0;
+    session->latency_max = 0;
+    session->prime = 0;
+    session->restarts = 0;
+    pthread_mutex_init(&session->lock, NULL);
+}
+
+
+/*
+ * Queue frames of silence on a prepared playback stream and start both
+ * streams: with one trigger when linked, playback first otherwise
+ */
+static int duplex_prime_start(struct duplex_session *session,
+			      snd_pcm_uframes_t prime_frames)
+{
+    snd_pcm_sframes_t written, chunk;
+    int pcm;
+
+    /* prime from one block of silence, so starting needs no allocation */
+    chunk = snd_pcm_bytes_to_frames(session->playback_handle,
+				    sizeof(session->silence));
+    while (prime_frames > 0)
+    {
+	written = snd_pcm_writei(session->playback_handle, session->silence,
+				 prime_frames < (snd_pcm_uframes_t) chunk ?
+				 prime_frames : (snd_pcm_uframes_t) chunk);
+	if (written < 0)
+	    return written;
+	prime_frames -= written;
+    }
+    if (session->linked)
+	return snd_pcm_start(session->capture_handle);
+    pcm = snd_pcm_start(session->playback_handle);
+    if (pcm == 0)
+	pcm = snd_pcm_start(session->capture_handle);
+    return pcm;
+}
+
+
+/**
+ * Prime the playback buffer with silence and start both streams.
+ * The primed frames become the loop latency, as capture and playback
+ * then advance in lockstep with the same hardware clock
+ * and writes an error if the streams can't be started
+ * @param *session opened duplex session
+ * @param prime_frames frames of silence queued ahead of the first capture
+ */
+void duplex_start(struct duplex_session *session,
+		  snd_pcm_uframes_t prime_frames)
+{
+    int pcm;
+
+    /* the streams aren't running yet, so a bigger prime would never fit */
+    if (prime_frames > session->buffer_size)
+    {
+	fprintf(stderr, "WARNING: Priming %lu frames, the whole buffer\n",
+		session->buffer_size);
+	prime_frames = session->buffer_size;
+    }
+    session->prime = prime_frames;
+    pcm = duplex_prime_start(session, prime_frames);
+    if (pcm < 0)
+    {
+	printf("ERROR: Can't start streams. %s\n", snd_strerror(pcm));
+	exit(1);
+    }
+}
+
+
+/**
+ * Get a duplex session going again after an xrun or a suspend of
+ * either stream. The streams only ever run together, so they are
+ * recovered together: a suspend is resumed on both, anything else
+ * drops both, prepares them, primes the playback silence again and
+ * starts them, as duplex_start() did. A device still suspended is
+ * waited for with recovery_wait(), with the lock released. When each
+ * stream has a thread of its own, both may fail on one event; the
+ * second finds the session already restarted past what it saw and
+ * goes on
+ * @param *session running duplex session
+ * @param seen session->restarts read before the transfer that failed
+ * @param err error of that transfer: -EPIPE, -ESTRPIPE or -EBADFD
+ * @return 0 on success or a negative error code
+ */
+int duplex_recover(struct duplex_session *session,
+		   unsigned long seen,
+		   int err)
+{
+    int backoff = RECOVER_BACKOFF_MIN;
+    int pcm = 0;
+
+    pthread_mutex_lock(&session->lock);
+    while (err == -ESTRPIPE && atomic_load(&session->restarts) == seen)
+    {
+	/* resume acts on the whole group of a linked stream */
+	pcm = 0;
+	if (snd_pcm_state(session->playback_handle) == SND_PCM_STATE_SUSPENDED)
+	    pcm = snd_pcm_resume(session->playback_handle);
+	if (pcm == 0 && !session->linked &&
+	    snd_pcm_state(session->capture_handle) == SND_PCM_STATE_SUSPENDED)
+	    pcm = snd_pcm_resume(session->capture_handle);
+	if (pcm != -EAGAIN)
+	    break;
+	/* the other stream's thread must not wait on the lock meanwhile */
+	pthread_mutex_unlock(&session->lock);
+	recovery_wait(session->playback_handle, backoff);
+	if (backoff < RECOVER_BACKOFF_MAX)
+	    backoff *= 2;
+	pthread_mutex_lock(&session->lock);
+    }
+    if (atomic_load(&session->restarts) != seen)
+    {
+	pthread_mutex_unlock(&session->lock);
+	return 0;
+    }
+    if (err != -ESTRPIPE || pcm < 0)
+    {
+	/* drop and prepare act on the whole group of a linked stream */
+	snd_pcm_drop(session->capture_handle);
+	if (!session->linked)
+	    snd_pcm_drop(session->playback_handle);
+	pcm = snd_pcm_prepare(session->capture_handle);
+	if (pcm == 0 && !session->linked)
+	    pcm = snd_pcm_prepare(session->playback_handle);
+	if (pcm == 0)
+	    pcm = duplex_prime_start(session, session->prime);
+    }
+    if (pcm == 0)
+	atomic_fetch_add(&session->restarts, 1);
+    pthread_mutex_unlock(&session->lock);
+    return pcm;
+}
+
+
+/*
+ * Read frames in the capture format, recovering the session from
+ * xruns and suspends on the way
+ */
+static snd_pcm_sframes_t duplex_readi(struct duplex_session *session,
+				      char *buff,
+				      snd_pcm_uframes_t frames)
+{
+    snd_pcm_uframes_t done = 0;
+    snd_pcm_sframes_t pcm;
+    unsigned long seen;
+    int err;
+
+    pcm_stats_wakeup(&pcm_stats_capture, session->capture_handle);
+    while (done < frames)
+    {
+	seen = atomic_load(&session->restarts);
+	pcm = snd_pcm_readi(session->capture_handle,
+			    buff + snd_pcm_frames_to_bytes(session->capture_handle, done),
+			    frames - done);
+	if (pcm == -EINTR || pcm == -EAGAIN)
+	    continue;
+	if (pcm < 0)
+	{
+	    pcm_stats_error(&pcm_stats_capture, pcm);
+	    if (pcm != -EPIPE && pcm != -ESTRPIPE && pcm != -EBADFD)
+		return pcm;
+	    err = duplex_recover(session, seen, pcm);
+	    if (err < 0)
+	    {
+		fprintf(stderr, "ERROR: Can't restart the streams (%s)\n",
+			snd_strerror(err));
+		return err;
+	    }
+	    continue;
+	}
+	done += pcm;
+    }
+    return done;
+}
+
+
+/*
+ * Write frames in the playback format, recovering the session from
+ * xruns and suspends on the way
+ */
+static snd_pcm_sframes_t duplex_writei(struct duplex_session *session,
+				       const char *buff,
+				       snd_pcm_uframes_t frames)
+{
+    snd_pcm_uframes_t done = 0;
+    snd_pcm_sframes_t pcm;
+    unsigned long seen;
+    int err;
+
+    pcm_stats_wakeup(&pcm_stats_playback, session->playback_handle);
+    while (done < frames)
+    {
+	seen = atomic_load(&session->restarts);
+	pcm = snd_pcm_writei(session->playback_handle,
+			     buff + snd_pcm_frames_to_bytes(session->playback_handle, done),
+			     frames - done);
+	if (pcm == -EINTR || pcm == -EAGAIN)
+	    continue;
+	if (pcm < 0)
+	{
+	    pcm_stats_error(&pcm_stats_playback, pcm);
+	    if (pcm != -EPIPE && pcm != -ESTRPIPE && pcm != -EBADFD)
+		return pcm;
+	    err = duplex_recover(session, seen, pcm);
+	    if (err < 0)
+	    {
+		fprintf(stderr, "ERROR: Can't restart the streams (%s)\n",
+			snd_strerror(err));
+		return err;
+	    }
+	    continue;
+	}
+	done += pcm;
+    }
+    return done;
+}
+
+
+/**
+ * Read frames from the capture stream of a duplex session,
+ * recovering the session from xruns and suspends on the way
+ * @param *session running duplex session
+ * @param *buff buffer of at least frames frames, in the session format
+ * @param frames frames to read
+ * @return frames read, or a negative error code
+ */
+snd_pcm_sframes_t duplex_read(struct duplex_session *session,
+			      char *buff,
+			      snd_pcm_uframes_t frames)
+{
+    size_t frame_bytes = session->format.bytes * session->channels;
+    snd_pcm_uframes_t done, n;
+    snd_pcm_sframes_t pcm;
+
+    if (session->capture_format.format == session->format.format)
+	return duplex_readi(session, buff, frames);
+    for (done = 0; done < frames; done += n)
+    {
+	n = frames - done < session->conv_frames ? frames - done :
+	    session->conv_frames;
+	pcm = duplex_readi(session, session->capture_buf, n);
+	if (pcm < 0)
+	    return pcm;
+	fmtconv_convert(&session->capture_format, &session->format,
+			buff + done * frame_bytes, session->capture_buf,
+			n * session->channels);
+    }
+    return done;
+}
+
+
+/**
+ * Write frames to the playback stream of a duplex session,
+ * recovering the session from xruns and suspends on the way
+ * @param *session running duplex session
+ * @param *buff frames to write, in the session format
+ * @param frames frames to write
+ * @return frames written, or a negative error code
+ */
+snd_pcm_sframes_t duplex_write(struct duplex_session *session,
+			       const char *buff,
+			       snd_pcm_uframes_t frames)
+{
+    size_t frame_bytes = session->format.bytes * session->channels;
+    snd_pcm_uframes_t done, n;
+    snd_pcm_sframes_t pcm;
+
+    if (session->playback_format.format == session->format.format)
+	return duplex_writei(session, buff, frames);
+    for (done = 0; done < frames; done += n)
+    {
+	n = frames - done < session->conv_frames ? frames - done :
+	    session->conv_frames;
+	fmtconv_convert(&session->format, &session->playback_format,
+			session->playback_buf, buff + done * frame_bytes,
+			n * session->channels);
+	pcm = duplex_writei(session, session->playback_buf, n);
+	if (pcm < 0)
+	    return pcm;
+    }
+    return done;
+}
+
+
+/**
+ * Measure the current round-trip latency: frames waiting in the
+ * capture buffer plus frames queued for playback plus any frames the
+ * caller holds in between, and track its range
+ * @param *session running duplex session
+ * @param held frames buffered by the application
+ * @return latency in frames, or a negative error code
+ */
+snd_pcm_sframes_t duplex_measure(struct duplex_session *session,
+				 snd_pcm_sframes_t held)
+{
+    snd_pcm_sframes_t capture_delay, playback_delay;
+    int pcm;
+
+    pcm = snd_pcm_delay(session->capture_handle, &capture_delay);
+    if (pcm == 0)
+	pcm = snd_pcm_delay(session->playback_handle, &playback_delay);
+    if (pcm < 0)
+	return pcm;
+    session->latency = capture_delay + playback_delay + held;
+    if (session->latency_min == 0 || session->latency < session->latency_min)
+	session->latency_min = session->latency;
+    if (session->latency > session->latency_max)
+	session->latency_max = session->latency;
+    return session->latency;
+}
+
+
+/**
+ * Stop, unlink and close both streams of a duplex session
+ * @param *session duplex session
+ */
+void duplex_close(struct duplex_session *session)
+{
+    if (session->linked)
+	snd_pcm_unlink(session->capture_handle);
+    snd_pcm_drain(session->playback_handle);
+    snd_pcm_drop(session->capture_handle);
+    snd_pcm_close(session->playback_handle);
+    snd_pcm_close(session->capture_handle);
+    pthread_mutex_destroy(&session->lock);
+}
@@ -0,0 +1,889 @@
+#ifndef OSC_H
+#define OSC_H
+
+#include <alsa/asoundlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <string.h>
+#include <errno.h>
+#include "kernel.h"
+#include "arena.h"
+
+#define OSC_LANES 8		/* samples advanced per phasor rotation */
+#define OSC_BLOCK 256		/* samples rendered before storing */
+#define OSC_NOISE_LANES 16	/* xorshift generators run side by side */
+#define OSC_CHECK_TOLERANCE 1e-9	/* sine kernels against sin() */
+
+/*
+ * Sample kernels, compiled once for every instruction set level of
+ * kernel.h from the bodies below and picked at startup through
+ * osc_kernel_select(); osc_render() and osc_noise() call the pick.
+ */
+typedef void (*osc_render_t)(double *out,
+			     int count,
+			     double phase,
+			     double step);
+typedef void (*osc_noise_t)(unsigned char *buf,
+			    size_t bytes,
+			    uint32_t *state);
+
+/*
+ * Sine renderer with a recursive complex phasor. OSC_LANES phasors,
+ * each one sample apart, are rotated together by OSC_LANES steps at a
+ * time, so one multiply of each lane array yields OSC_LANES new
+ * samples; the lane loops have a fixed trip count, which the compiler
+ * turns into vector code for the level's registers. Magnitude drift is
+ * renormalized after every rotation and the lanes are reseeded exactly
+ * from phase on every call. The lanes are double, so a vector holds 2
+ * (SSE2, NEON), 4 (AVX2) or 8 (AVX-512) of them, not 8-16 floats: float
+ * lanes are about 6e-7 off, a few LSB at 24 bits and more at 32, where
+ * these match osc_generate_ref() exactly. The render is done once per
+ * frame for all channels, so past a few channels the stores dominate.
+ */
+#define OSC_RENDER(name, attr)						\
+static attr void name(double *out,					\
+		      int count,					\
+		      double phase,					\
+		      double step)					\
+{									\
+  double re[OSC_LANES], im[OSC_LANES], t[OSC_LANES], g;			\
+  double rot_re = cos(OSC_LANES * step), rot_im = sin(OSC_LANES * step); \
+  int i, k;								\
+  for (k = 0; k < OSC_LANES; k++) {					\
+    re[k] = cos(phase + k * step);					\
+    im[k] = sin(phase + k * step);					\
+  }									\
+  for (i = 0; i + OSC_LANES <= count; i += OSC_LANES) {			\
+    for (k = 0; k < OSC_LANES; k++)					\
+      out[i + k] = im[k];						\
+    for (k = 0; k < OSC_LANES; k++) {					\
+      t[k] = re[k] * rot_re - im[k] * rot_im;				\
+      im[k] = re[k] * rot_im + im[k] * rot_re;				\
+      re[k] = t[k];							\
+    }									\
+    /* first order correction back to the unit circle */		\
+    for (k = 0; k < OSC_LANES; k++) {					\
+      g = 1.5 - 0.5 * (re[k] * re[k] + im[k] * im[k]);			\
+      re[k] *= g;							\
+      im[k] *= g;							\
+    }									\
+  }									\
+  for (k = 0; i < count; i++, k++)					\
+    out[i] = im[k];							\
+}
+
+/*
+ * Noise filler: OSC_NOISE_LANES xorshift32 generators stepped side by
+ * side, each one giving 4 bytes of every 4 * OSC_NOISE_LANES byte
+ * block. Integer only, so every level gives the very same bytes.
+ */
+#define OSC_NOISE(name, attr)						\
+static attr void name(unsigned char *buf,				\
+		      size_t bytes,					\
+		      uint32_t *state)					\
+{									\
+  uint32_t x[OSC_NOISE_LANES];						\
+  size_t i;								\
+  int k;								\
+  memcpy(x, state, sizeof(x));						\
+  for (i = 0; i < bytes; i += sizeof(x)) {				\
+    for (k = 0; k < OSC_NOISE_LANES; k++) {				\
+      x[k] ^= x[k] << 13;						\
+      x[k] ^= x[k] >> 17;						\
+      x[k] ^= x[k] << 5;						\
+    }									\
+    memcpy(buf + i, x, bytes - i < sizeof(x) ? bytes - i : sizeof(x));	\
+  }									\
+  memcpy(state, x, sizeof(x));						\
+}
+
+#define OSC_KERNELS(suffix, attr)					\
+  OSC_RENDER(osc_render_##suffix, attr)					\
+  OSC_NOISE(osc_noise_##suffix, attr)
+
+OSC_KERNELS(generic, KERNEL_ATTR_GENERIC)
+#if KERNEL_X86
+OSC_KERNELS(sse2, KERNEL_ATTR_SSE2)
+OSC_KERNELS(avx2, KERNEL_ATTR_AVX2)
+OSC_KERNELS(avx512, KERNEL_ATTR_AVX512)
+#endif
+#if KERNEL_ARM64
+OSC_KERNELS(neon, KERNEL_ATTR_NEON)
+#endif
+
+struct osc_kernel {
+  enum kernel_isa isa;
+  osc_render_t render;
+  osc_noise_t noise;
+};
+
+/* lowest level first, the generic kernels are the reference */
+static const struct osc_kernel osc_kernels[] = {
+  { KERNEL_GENERIC, osc_render_generic, osc_noise_generic },
+#if KERNEL_X86
+  { KERNEL_SSE2, osc_render_sse2, osc_noise_sse2 },
+  { KERNEL_AVX2, osc_render_avx2, osc_noise_avx2 },
+  { KERNEL_AVX512, osc_render_avx512, osc_noise_avx512 },
+#endif
+#if KERNEL_ARM64
+  { KERNEL_NEON, osc_render_neon, osc_noise_neon },
+#endif
+};
+#define OSC_KERNEL_COUNT (sizeof(osc_kernels) / sizeof(osc_kernels[0]))
+
+/* the kernels in use, NULL until the first call picks the best ones */
+static const struct osc_kernel *osc_kernel = NULL;
+
+
+/**
+ * Seed a noise generator state
+ * @param *state OSC_NOISE_LANES words
+ * @param seed any value, the same seed gives the same noise
+ */
+void osc_noise_seed(uint32_t *state,
+		    uint32_t seed)
+{
+  uint32_t x = seed;
+  int k;
+
+  /* splitmix32 spreads the seed over the lanes, none of them zero */
+  for (k = 0; k < OSC_NOISE_LANES; k++) {
+    x += 0x9e3779b9;
+    state[k] = x;
+    state[k] = (state[k] ^ (state[k] >> 16)) * 0x85ebca6b;
+    state[k] = (state[k] ^ (state[k] >> 13)) * 0xc2b2ae35;
+    state[k] ^= state[k] >> 16;
+    if (state[k] == 0)
+      state[k] = 1;
+  }
+}
+
+
+/**
+ * Check a kernel set against the scalar reference: the sine against
+ * sin() of every sample's phase, within OSC_CHECK_TOLERANCE, as vector
+ * code may contract multiply-adds; the noise bit-exact against the
+ * generic kernel
+ * @param *kernel kernels to check, runnable on this CPU
+ * @return 0 if they pass, -1 if not
+ */
+int osc_kernel_check(const struct osc_kernel *kernel)
+{
+  static const double steps[] = { 2. * M_PI * 440 / 44100, 2. * M_PI * 5000 / 8000, 1e-4 };
+  const int count = OSC_BLOCK + OSC_LANES - 1;  /* a tail after the lanes */
+  double out[OSC_BLOCK + OSC_LANES], phase;
+  unsigned char noise[2][4 * OSC_NOISE_LANES * 3 + 5];
+  uint32_t state[2][OSC_NOISE_LANES];
+  unsigned int s;
+  int i;
+
+  for (s = 0; s < sizeof(steps) / sizeof(steps[0]); s++) {
+    phase = s * 1.25;
+    kernel->render(out, count, phase, steps[s]);
+    for (i = 0; i < count; i++)
+      if (fabs(out[i] - sin(phase + i * steps[s])) > OSC_CHECK_TOLERANCE)
+	return -1;
+  }
+  osc_noise_seed(state[0], 1);
+  osc_noise_seed(state[1], 1);
+  osc_noise_generic(noise[0], sizeof(noise[0]), state[0]);
+  kernel->noise(noise[1], sizeof(noise[1]), state[1]);
+  if (memcmp(noise[0], noise[1], sizeof(noise[0])) ||
+      memcmp(state[0], state[1], sizeof(state[0])))
+    return -1;
+  return 0;
+}
+
+
+/**
+ * Check every kernel set this CPU runs and print the results
+ * @param *out where to print
+ * @return number of kernel sets that failed
+ */
+int osc_kernel_report(FILE *out)
+{
+  unsigned int k;
+  int failed = 0;
+
+  for (k = 0; k < OSC_KERNEL_COUNT; k++) {
+    fprintf(out, "%-8s ", kernel_isa_names[osc_kernels[k].isa]);
+    if (!kernel_isa_supported(osc_kernels[k].isa)) {
+      fprintf(out, "not supported by this CPU\n");
+    } else if (osc_kernel_check(&osc_kernels[k]) < 0) {
+      fprintf(out, "FAILED\n");
+      failed++;
+    } else {
+      fprintf(out, "ok\n");
+    }
+  }
+  return failed;
+}
+
+
+/**
+ * Pick the kernels osc_render(), osc_noise() and osc_generate() run.
+ * The chosen set is self-checked first; a set that fails is never used
+ * @param isa enum kernel_isa level to use, -1 for the best one this CPU
+ *        runs that passes the check
+ * @return the level picked, the generic one when a forced level fails
+ */
+enum kernel_isa osc_kernel_select(int isa)
+{
+  const char *name = isa >= 0 ? kernel_isa_names[isa] : NULL;
+  int k, built = 0;
+
+  for (k = OSC_KERNEL_COUNT - 1; k > 0; k--) {
+    if (name && (int) osc_kernels[k].isa != isa)
+      continue;
+    built = 1;
+    if (!kernel_isa_supported(osc_kernels[k].isa)) {
+      if (name)
+	fprintf(stderr, "Kernel %s is not supported by this CPU\n", name);
+      continue;
+    }
+    if (osc_kernel_check(&osc_kernels[k]) == 0)
+      break;
+    fprintf(stderr, "Kernel %s failed its self-check\n",
+	    kernel_isa_names[osc_kernels[k].isa]);
+  }
+  if (name && isa != KERNEL_GENERIC && k == 0) {
+    if (!built)
+      fprintf(stderr, "Kernel %s is not built for this machine\n", name);
+    fprintf(stderr, "Using the %s kernel\n", kernel_isa_names[KERNEL_GENERIC]);
+  }
+  osc_kernel = &osc_kernels[k];
+  return osc_kernel->isa;
+}
+
+
+/**
+ * Render a block of sine samples with the selected kernel
+ * @param *out destination, count samples in [-1, 1]
+ * @param count samples to render
+ * @param phase phase of the first sample in radians
+ * @param step phase increment per sample in radians
+ */
+void osc_render(double *out,
+		int count,
+		double phase,
+		double step)
+{
+  if (osc_kernel == NULL)
+    osc_kernel_select(-1);
+  osc_kernel->render(out, count, phase, step);
+}
+
+
+/**
+ * Fill a buffer with white noise bytes with the selected kernel
+ * @param *buf destination
+ * @param bytes bytes to fill
+ * @param *state generator state from osc_noise_seed(), updated
+ */
+void osc_noise(unsigned char *buf,
+	       size_t bytes,
+	       uint32_t *state)
+{
+  if (osc_kernel == NULL)
+    osc_kernel_select(-1);
+  osc_kernel->noise(buf, bytes, state);
+}
+
+
+/*
+ * Format specialized store kernels: convert a rendered block (at most
+ * OSC_BLOCK samples) and write it to every channel. One kernel per sample layout, chosen once
+ * per call, so the per-sample loop has no format or endian branches.
+ */
+typedef void (*osc_store_t)(unsigned char **samples,
+			    const int *steps,
+			    unsigned int channels,
+			    const double *s,
+			    int count,
+			    double maxval);
+
+#define OSC_STORE(name, type, conv)					\
+static void name(unsigned char **samples,				\
+		 const int *steps,					\
+		 unsigned int channels,					\
+		 const double *s,					\
+		 int count,						\
+		 double maxval)						\
+{									\
+  type v[OSC_BLOCK];							\
+  unsigned char *p;							\
+  unsigned int chn;							\
+  int i;								\
+  for (i = 0; i < count; i++) {						\
+    int32_t res = s[i] * maxval;					\
+    (void) res;								\
+    v[i] = (conv);							\
+  }									\
+  if (steps[0] == sizeof(type)) {					\
+    /* non-interleaved: one sequential stream per channel */		\
+    for (chn = 0; chn < channels; chn++) {				\
+      p = samples[chn];							\
+      for (i = 0; i < count; i++, p += steps[chn])			\
+	memcpy(p, &v[i], sizeof(v[i]));					\
+      samples[chn] = p;							\
+    }									\
+  } else {								\
+    /* interleaved: fill whole frames in memory order */		\
+    for (i = 0; i < count; i++)						\
+      for (chn = 0; chn < channels; chn++) {				\
+	memcpy(samples[chn], &v[i], sizeof(v[i]));			\
+	samples[chn] += steps[chn];					\
+      }									\
+  }									\
+}
+
+static inline uint32_t osc_float_bits(double x)
+{
+  union { float f; uint32_t i; } fval;
+  fval.f = x;
+  return fval.i;
+}
+
+/* the stores below assume a little endian host, as the callers check */
+OSC_STORE(osc_store_s16_le, uint16_t, res)
+OSC_STORE(osc_store_s16_be, uint16_t, __builtin_bswap16(res))
+OSC_STORE(osc_store_u16_le, uint16_t, res ^ 0x8000)
+OSC_STORE(osc_store_u16_be, uint16_t, __builtin_bswap16(res ^ 0x8000))
+OSC_STORE(osc_store_s24_le, uint32_t, res & 0xffffff)
+OSC_STORE(osc_store_s24_be, uint32_t, __builtin_bswap32(res & 0xffffff))
+OSC_STORE(osc_store_u24_le, uint32_t, (res ^ 0x800000) & 0xffffff)
+OSC_STORE(osc_store_u24_be, uint32_t,
+	  __builtin_bswap32((res ^ 0x800000) & 0xffffff))
+OSC_STORE(osc_store_s32_le, uint32_t, res)
+OSC_STORE(osc_store_s32_be, uint32_t, __builtin_bswap32(res))
+OSC_STORE(osc_store_u32_le, uint32_t, res ^ 0x80000000U)
+OSC_STORE(osc_store_u32_be, uint32_t, __builtin_bswap32(res ^ 0x80000000U))
+OSC_STORE(osc_store_float_le, uint32_t, osc_float_bits(s[i]))
+OSC_STORE(osc_store_float_be, uint32_t, __builtin_bswap32(osc_float_bits(s[i])))
+
+
+/**
+ * Pick the store kernel for a sample format
+ * @param format sample format
+ * @return store kernel, or NULL when only the generic path handles it
+ */
+osc_store_t osc_store_for(snd_pcm_format_t format)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  switch (format) {
+  case SND_PCM_FORMAT_S16_LE: return osc_store_s16_le;
+  case SND_PCM_FORMAT_S16_BE: return osc_store_s16_be;
+  case SND_PCM_FORMAT_U16_LE: return osc_store_u16_le;
+  case SND_PCM_FORMAT_U16_BE: return osc_store_u16_be;
+  case SND_PCM_FORMAT_S24_LE: return osc_store_s24_le;
+  case SND_PCM_FORMAT_S24_BE: return osc_store_s24_be;
+  case SND_PCM_FORMAT_U24_LE: return osc_store_u24_le;
+  case SND_PCM_FORMAT_U24_BE: return osc_store_u24_be;
+  case SND_PCM_FORMAT_S32_LE: return osc_store_s32_le;
+  case SND_PCM_FORMAT_S32_BE: return osc_store_s32_be;
+  case SND_PCM_FORMAT_U32_LE: return osc_store_u32_le;
+  case SND_PCM_FORMAT_U32_BE: return osc_store_u32_be;
+  case SND_PCM_FORMAT_FLOAT_LE: return osc_store_float_le;
+  case SND_PCM_FORMAT_FLOAT_BE: return osc_store_float_be;
+  default: break;
+  }
+#endif
+  return NULL;
+}
+
+
+/*
+ * Interleaved writers specialized for the configurations in common use.
+ * Sample type, full scale and channel count are all compile time
+ * constants, so the frame loop is unrolled with no branch per sample;
+ * a channel count of 0 takes the count at run time instead.
+ */
+typedef void (*osc_fill_t)(unsigned char *frames,
+			   unsigned int channels,
+			   const double *s,
+			   int count);
+
+#define OSC_FILL(name, type, chans, maxval, conv)			\
+static void name(unsigned char *frames,					\
+		 unsigned int channels,					\
+		 const double *s,					\
+		 int count)						\
+{									\
+  const unsigned int n = (chans) ? (chans) : channels;			\
+  type *p = (type *) frames;						\
+  unsigned int chn;							\
+  int i;								\
+  for (i = 0; i < count; i++, p += n) {					\
+    int32_t res = s[i] * (maxval);					\
+    type v;								\
+    (void) res;								\
+    v = (conv);								\
+    for (chn = 0; chn < n; chn++)					\
+      p[chn] = v;							\
+  }									\
+}
+
+OSC_FILL(osc_fill_s16_le_1, int16_t, 1, 32767.0, res)
+OSC_FILL(osc_fill_s16_le_2, int16_t, 2, 32767.0, res)
+OSC_FILL(osc_fill_s32_le_2, int32_t, 2, 2147483647.0, res)
+OSC_FILL(osc_fill_s32_le_8, int32_t, 8, 2147483647.0, res)
+OSC_FILL(osc_fill_float_le, float, 0, 1.0, s[i])
+
+static const struct {
+  snd_pcm_format_t format;
+  unsigned int channels;	/* 0 for any count */
+  const char *name;
+  osc_fill_t fill;
+} osc_fills[] = {
+  { SND_PCM_FORMAT_S16_LE, 1, "S16_LE mono", osc_fill_s16_le_1 },
+  { SND_PCM_FORMAT_S16_LE, 2, "S16_LE stereo", osc_fill_s16_le_2 },
+  { SND_PCM_FORMAT_S32_LE, 2, "S32_LE stereo", osc_fill_s32_le_2 },
+  { SND_PCM_FORMAT_S32_LE, 8, "S32_LE 8 channels", osc_fill_s32_le_8 },
+  { SND_PCM_FORMAT_FLOAT_LE, 0, "FLOAT_LE", osc_fill_float_le },
+};
+
+
+/**
+ * Check the channel areas and compute per channel start pointers
+ * and steps in bytes
+ * @param *areas channel areas
+ * @param offset first frame
+ * @param channels channels count
+ * @param **samples returns the start pointers
+ * @param *steps returns the steps
+ */
+static void osc_prepare_areas(const snd_pcm_channel_area_t *areas,
+			      snd_pcm_uframes_t offset,
+			      unsigned int channels,
+			      unsigned char **samples,
+			      int *steps)
+{
+  unsigned int chn;
+
+  for (chn = 0; chn < channels; chn++) {
+    if ((areas[chn].first % 8) != 0) {
+      printf("areas[%i].first == %i, aborting...\n", chn, areas[chn].first);
+      exit(EXIT_FAILURE);
+    }
+    samples[chn] = (((unsigned char *)areas[chn].addr) + (areas[chn].first / 8));
+    if ((areas[chn].step % 16) != 0) {
+      printf("areas[%i].step == %i, aborting...\n", chn, areas[chn].step);
+      exit(EXIT_FAILURE);
+    }
+    steps[chn] = areas[chn].step / 8;
+    samples[chn] += offset * steps[chn];
+  }
+}
+
+
+/**
+ * Scalar reference generator: one sin() per frame and a byte by byte
+ * store for any linear or float format. Used as the fallback for
+ * formats without a store kernel and as the reference for checks.
+ * Float formats are written in [-1, 1].
+ * @param *areas channel areas
+ * @param offset first frame
+ * @param count frames to generate
+ * @param channels channels count
+ * @param format sample format
+ * @param freq sine frequency in Hz
+ * @param rate stream rate in Hz
+ * @param *_phase running phase, updated
+ */
+void osc_generate_ref(const snd_pcm_channel_area_t *areas,
+		      snd_pcm_uframes_t offset,
+		      int count,
+		      unsigned int channels,
+		      snd_pcm_format_t format,
+		      double freq,
+		      unsigned int rate,
+		      double *_phase)
+{
+  static double max_phase = 2. * M_PI;
+  double phase = *_phase;
+  double step = max_phase*freq/(double)rate;
+  unsigned char *samples[channels];
+  int steps[channels];
+  unsigned int chn;
+  int format_bits = snd_pcm_format_width(format);
+  unsigned int maxval = (1U << (format_bits - 1)) - 1;
+  int bps = format_bits / 8;  /* bytes per sample */
+  int phys_bps = snd_pcm_format_physical_width(format) / 8;
+  int big_endian = snd_pcm_format_big_endian(format) == 1;
+  int to_unsigned = snd_pcm_format_unsigned(format) == 1;
+  int is_float = (format == SND_PCM_FORMAT_FLOAT_LE ||
+		  format == SND_PCM_FORMAT_FLOAT_BE);
+
+  osc_prepare_areas(areas, offset, channels, samples, steps);
+  /* fill the channel areas */
+  while (count-- > 0) {
+    union {
+      float f;
+      int i;
+    } fval;
+    int res, i;
+    if (is_float) {
+      fval.f = sin(phase);
+      res = fval.i;
+    } else
+      res = sin(phase) * maxval;
+    if (to_unsigned)
+      res ^= 1U << (format_bits - 1);
+    for (chn = 0; chn < channels; chn++) {
+      /* Generate data in native endian format */
+      if (big_endian) {
+	for (i = 0; i < bps; i++)
+	  *(samples[chn] + phys_bps - 1 - i) = (res >> i * 8) & 0xff;
+      } else {
+	for (i = 0; i < bps; i++)
+	  *(samples[chn] + i) = (res >>  i * 8) & 0xff;
+      }
+      samples[chn] += steps[chn];
+    }
+    phase += step;
+    if (phase >= max_phase)
+      phase -= max_phase;
+  }
+  *_phase = phase;
+}
+
+
+/**
+ * A sine generator set up for one stream configuration. The format is
+ * looked at once, when the hardware parameters are settled, and the
+ * fastest path for it is kept: a specialized interleaved writer, the
+ * store kernel of the format, or osc_generate_ref()
+ */
+struct osc_gen {
+  snd_pcm_format_t format;
+  unsigned int channels;
+  double freq;
+  unsigned int rate;
+  double step;			/* phase increment per frame */
+  double maxval;		/* full scale of the format */
+  osc_fill_t fill;		/* interleaved writer, or NULL */
+  osc_store_t store;		/* store kernel, or NULL for the reference */
+  unsigned int frame_bytes;
+  const char *name;		/* of the path taken, for messages */
+};
+
+
+/**
+ * Set up a generator
+ * @param *gen generator to initialise
+ * @param format sample format
+ * @param channels channels count
+ * @param freq sine frequency in Hz
+ * @param rate stream rate in Hz
+ * @param interleaved the areas passed to osc_gen_run() hold whole
+ *        frames one after the other, channels in order
+ */
+void osc_gen_init(struct osc_gen *gen,
+		  snd_pcm_format_t format,
+		  unsigned int channels,
+		  double freq,
+		  unsigned int rate,
+		  int interleaved)
+{
+  unsigned int k;
+
+  gen->format = format;
+  gen->channels = channels;
+  gen->freq = freq;
+  gen->rate = rate;
+  gen->step = 2. * M_PI * freq / (double) rate;
+  gen->fill = NULL;
+  gen->store = osc_store_for(format);
+  gen->name = gen->store ? "store kernels" : "reference";
+  gen->frame_bytes = channels * (snd_pcm_format_physical_width(format) / 8);
+  gen->maxval = snd_pcm_format_float(format) ? 1.0 :
+    (double) ((1U << (snd_pcm_format_width(format) - 1)) - 1);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  for (k = 0; interleaved && k < sizeof(osc_fills) / sizeof(osc_fills[0]); k++)
+    if (osc_fills[k].format == format &&
+	(osc_fills[k].channels == 0 || osc_fills[k].channels == channels)) {
+      gen->fill = osc_fills[k].fill;
+      gen->name = osc_fills[k].name;
+      break;
+    }
+#else
+  (void) k;
+  (void) interleaved;
+#endif
+}
+
+
+/**
+ * Generate a sine into channel areas with a generator
+ * @param *gen generator
+ * @param *areas channel areas, laid out as given to osc_gen_init()
+ * @param offset first frame
+ * @param count frames to generate
+ * @param *_phase running phase, updated
+ */
+void osc_gen_run(const struct osc_gen *gen,
+		 const snd_pcm_channel_area_t *areas,
+		 snd_pcm_uframes_t offset,
+		 int count,
+		 double *_phase)
+{
+  const double max_phase = 2. * M_PI;
+  double phase = *_phase;
+  double block[OSC_BLOCK];
+  unsigned char *samples[gen->channels], *frames = NULL;
+  int steps[gen->channels];
+  int n;
+
+  if (gen->fill == NULL && gen->store == NULL) {
+    osc_generate_ref(areas, offset, count, gen->channels, gen->format,
+		     gen->freq, gen->rate, _phase);
+    return;
+  }
+  if (gen->fill)
+    frames = (unsigned char *) areas[0].addr + areas[0].first / 8 +
+      offset * gen->frame_bytes;
+  else
+    osc_prepare_areas(areas, offset, gen->channels, samples, steps);
+  while (count > 0) {
+    n = count < OSC_BLOCK ? count : OSC_BLOCK;
+    osc_render(block, n, phase, gen->step);
+    if (gen->fill) {
+      gen->fill(frames, gen->channels, block, n);
+      frames += n * gen->frame_bytes;
+    } else {
+      gen->store(samples, steps, gen->channels, block, n, gen->maxval);
+    }
+    phase = fmod(phase + n * gen->step, max_phase);
+    count -= n;
+  }
+  *_phase = phase;
+}
+
+
+/**
+ * Generate a sine into channel areas: a generator set up for the call,
+ * taking the specialized writer when the areas are plainly interleaved.
+ * Same arguments as osc_generate_ref(); callers that stay with one
+ * configuration set up an osc_gen once instead.
+ */
+void osc_generate(const snd_pcm_channel_area_t *areas,
+		  snd_pcm_uframes_t offset,
+		  int count,
+		  unsigned int channels,
+		  snd_pcm_format_t format,
+		  double freq,
+		  unsigned int rate,
+		  double *_phase)
+{
+  unsigned int width = snd_pcm_format_physical_width(format), chn;
+  int interleaved = 1;
+  struct osc_gen gen;
+
+  for (chn = 0; chn < channels; chn++)
+    if (areas[chn].addr != areas[0].addr || areas[chn].first != chn * width ||
+	areas[chn].step != channels * width)
+      interleaved = 0;
+  osc_gen_init(&gen, format, channels, freq, rate, interleaved);
+  osc_gen_run(&gen, areas, offset, count, _phase);
+}
+
+/**
+ * Loop cache: one stretch of a steady tone holding a whole number of
+ * sine cycles, rendered once in the stream format and then replayed by
+ * copying, so a tone costs no trigonometry at all once it runs. When no
+ * stretch short enough holds the exact frequency, the nearest one that
+ * fits is played and its frequency error reported.
+ */
+struct osc_loop {
+  unsigned char *frames;	/* length frames, cache line aligned */
+  snd_pcm_uframes_t length;	/* frames in the loop */
+  unsigned long cycles;		/* sine cycles in the loop */
+  double freq;			/* frequency played, cycles * rate / length */
+  double error;			/* freq minus the requested one, in Hz */
+  unsigned int channels;
+  unsigned int frame_bytes;
+  unsigned int sample_bytes;
+  int interleaved;		/* areas given to osc_loop_run() */
+  snd_pcm_uframes_t pos;	/* next frame played */
+};
+
+
+/**
+ * Find the shortest loop holding a whole number of cycles of a tone:
+ * for integer frequencies, rate / gcd(freq, rate) frames. If that is
+ * too long, or the frequency isn't an integer, the cycles / length
+ * ratio nearest to freq / rate with length at most max_frames is taken,
+ * from the continued fraction expansion of freq / rate
+ * @param freq tone frequency in Hz, below rate
+ * @param rate stream rate in Hz
+ * @param max_frames longest loop allowed
+ * @param *cycles returns the sine cycles in the loop
+ * @return frames in the loop
+ */
+snd_pcm_uframes_t osc_loop_fit(double freq,
+			       unsigned int rate,
+			       snd_pcm_uframes_t max_frames,
+			       unsigned long *cycles)
+{
+  unsigned long p0 = 0, q0 = 1, p1 = 1, q1 = 0, a, k, g, f, t;
+  double x = freq / rate, r = x;
+  int i;
+
+  if (freq == floor(freq) && freq >= 1) {
+    f = freq;
+    g = rate;
+    while (f) {
+      t = g % f;
+      g = f;
+      f = t;
+    }
+    if (rate / g <= max_frames) {
+      *cycles = (unsigned long) freq / g;
+      return rate / g;
+    }
+  }
+  /* convergents p1 / q1 of x until the next one is too long */
+  for (i = 0; i < 64; i++) {
+    a = floor(r);
+    if (q1 && a > (max_frames - q0) / q1) {
+      /* the longest semiconvergent that fits, if it beats p1 / q1 */
+      k = (max_frames - q0) / q1;
+      if (k > 0 && fabs(x - (double) (p0 + k * p1) / (q0 + k * q1)) <
+	  fabs(x - (double) p1 / q1)) {
+	p1 = p0 + k * p1;
+	q1 = q0 + k * q1;
+      }
+      break;
+    }
+    t = a * p1 + p0;
+    p0 = p1;
+    p1 = t;
+    t = a * q1 + q0;
+    q0 = q1;
+    q1 = t;
+    if (r - a < 1e-12)
+      break;
+    r = 1 / (r - a);
+  }
+  if (p1 == 0) {
+    /* a tone too low for any loop that fits: one cycle, the longest */
+    *cycles = 1;
+    return max_frames;
+  }
+  *cycles = p1;
+  return q1;
+}
+
+
+/**
+ * Render a loop for a tone. The loop buffer is taken from an arena
+ * @param *loop loop to initialise
+ * @param *arena arena for the loop buffer
+ * @param format sample format
+ * @param channels channels count
+ * @param freq tone frequency in Hz
+ * @param rate stream rate in Hz
+ * @param max_bytes largest loop buffer allowed
+ * @param interleaved the areas passed to osc_loop_run() hold whole
+ *        frames one after the other, channels in order
+ * @return 0 on success, -EINVAL if not even one frame fits in
+ *         max_bytes, -ENOMEM if the arena is full
+ */
+int osc_loop_init(struct osc_loop *loop,
+		  struct arena *arena,
+		  snd_pcm_format_t format,
+		  unsigned int channels,
+		  double freq,
+		  unsigned int rate,
+		  size_t max_bytes,
+		  int interleaved)
+{
+  unsigned int width = snd_pcm_format_physical_width(format), chn;
+  snd_pcm_channel_area_t areas[channels];
+  struct osc_gen gen;
+  double phase = 0;
+
+  loop->channels = channels;
+  loop->sample_bytes = width / 8;
+  loop->frame_bytes = channels * loop->sample_bytes;
+  loop->interleaved = interleaved;
+  loop->pos = 0;
+  if (max_bytes < loop->frame_bytes)
+    return -EINVAL;
+  loop->length = osc_loop_fit(freq, rate, max_bytes / loop->frame_bytes,
+			      &loop->cycles);
+  loop->freq = (double) loop->cycles * rate / loop->length;
+  loop->error = loop->freq - freq;
+  loop->frames = arena_alloc(arena, loop->length * loop->frame_bytes, 0);
+  if (loop->frames == NULL)
+    return -ENOMEM;
+  for (chn = 0; chn < channels; chn++) {
+    areas[chn].addr = loop->frames;
+    areas[chn].first = chn * width;
+    areas[chn].step = channels * width;
+  }
+  osc_gen_init(&gen, format, channels, loop->freq, rate, 1);
+  osc_gen_run(&gen, areas, 0, loop->length, &phase);
+  return 0;
+}
+
+
+/**
+ * Play the next frames of a loop into channel areas: straight copies of
+ * whole frames for interleaved areas, sample by sample otherwise
+ * @param *loop loop
+ * @param *areas channel areas, laid out as given to osc_loop_init()
+ * @param offset first frame
+ * @param count frames to play
+ */
+void osc_loop_run(struct osc_loop *loop,
+		  const snd_pcm_channel_area_t *areas,
+		  snd_pcm_uframes_t offset,
+		  snd_pcm_uframes_t count)
+{
+  unsigned char *samples[loop->channels], *dst = NULL, *src;
+  int steps[loop->channels];
+  snd_pcm_uframes_t n, i;
+  unsigned int chn;
+
+  if (loop->interleaved)
+    dst = (unsigned char *) areas[0].addr + areas[0].first / 8 +
+      offset * loop->frame_bytes;
+  else
+    osc_prepare_areas(areas, offset, loop->channels, samples, steps);
+  while (count > 0) {
+    /* up to the end of the loop, then around */
+    n = loop->length - loop->pos;
+    if (n > count)
+      n = count;
+    src = loop->frames + loop->pos * loop->frame_bytes;
+    if (loop->interleaved) {
+      memcpy(dst, src, n * loop->frame_bytes);
+      dst += n * loop->frame_bytes;
+    } else {
+      for (chn = 0; chn < loop->channels; chn++) {
+	for (i = 0; i < n; i++, samples[chn] += steps[chn])
+	  memcpy(samples[chn], src + i * loop->frame_bytes,
+		 loop->sample_bytes);
+	src += loop->sample_bytes;
+      }
+    }
+    loop->pos = (loop->pos + n) % loop->length;
+    count -= n;
+  }
+}
+
+
+/**
+ * Step a loop back, for frames rewound in the device buffer
+ * @param *loop loop
+ * @param frames frames to step back
+ */
+void osc_loop_rewind(struct osc_loop *loop,
+		     snd_pcm_uframes_t frames)
+{
+  frames %= loop->length;
+  loop->pos = (loop->pos + loop->length - frames) % loop->length;
+}
+
+#endif
@@ -0,0 +1,382 @@
+#ifndef PCMSTATS_H
+#define PCMSTATS_H
+
+#include <alsa/asoundlib.h>
+#include <stdatomic.h>
+#include <signal.h>
+
+#define PCM_STATS_BUCKETS 20	/* log2 buckets: [0], [1], [2,3], [4,7], ... */
+#define PCM_STATS_GAPS 16	/* most recent gaps kept with their time */
+
+/**
+ * A stretch of audio lost to an xrun or a suspend
+ */
+struct pcm_gap
+{
+    snd_htimestamp_t at;	/* when the stream stopped */
+    snd_pcm_uframes_t frames;	/* frames lost */
+};
+
+/**
+ * Lock-free xrun and timing counters for one stream direction.
+ * Counters are relaxed atomics, safe to bump from transfer threads
+ * and signal handlers. Histograms are only sampled once the stats are
+ * attached to a PCM with pcm_stats_attach(), so unattached stats cost
+ * one atomic add per xrun and nothing per period.
+ */
+struct pcm_stats
+{
+    const char *name;
+    _Atomic int attached;
+    _Atomic unsigned long xruns;
+    _Atomic unsigned long suspends;
+    _Atomic unsigned long wakeups;
+    _Atomic unsigned long avail_hist[PCM_STATS_BUCKETS]; /* frames */
+    _Atomic unsigned long late_hist[PCM_STATS_BUCKETS];  /* microseconds */
+    _Atomic long min_fill;	/* lowest fill seen in frames, -1 if none */
+    _Atomic unsigned long gaps;
+    _Atomic unsigned long lost_frames;
+    struct pcm_gap gap_log[PCM_STATS_GAPS]; /* by the transfer thread only */
+    _Atomic unsigned long recoveries;
+    _Atomic unsigned long recovery_us;	/* total time to audio after an xrun */
+    _Atomic unsigned long recovery_us_max;
+    snd_pcm_uframes_t buffer_size;
+    snd_pcm_uframes_t avail_min;
+    unsigned int rate;
+    snd_htimestamp_t trigger;	/* start the lag baseline belongs to */
+    double lag_min;		/* smallest pointer lag since, in seconds */
+};
+
+struct pcm_stats pcm_stats_playback = { .name = "playback", .min_fill = -1 };
+struct pcm_stats pcm_stats_capture = { .name = "capture", .min_fill = -1 };
+static volatile sig_atomic_t pcm_stats_dump_requested = 0;
+
+
+/**
+ * Index of the log2 bucket holding a value
+ * @param value value to bucket
+ * @return bucket index
+ */
+static int pcm_stats_bucket(unsigned long value)
+{
+    int b = 0;
+    while (value && b < PCM_STATS_BUCKETS - 1)
+    {
+	value >>= 1;
+	b++;
+    }
+    return b;
+}
+
+
+/**
+ * Count an underrun or overrun
+ * @param *stats stats of the stream
+ */
+void pcm_stats_xrun(struct pcm_stats *stats)
+{
+    atomic_fetch_add_explicit(&stats->xruns, 1, memory_order_relaxed);
+}
+
+
+/**
+ * Count a suspend event
+ * @param *stats stats of the stream
+ */
+void pcm_stats_suspend(struct pcm_stats *stats)
+{
+    atomic_fetch_add_explicit(&stats->suspends, 1, memory_order_relaxed);
+}
+
+
+/**
+ * Count a transfer error if it is an xrun (-EPIPE) or a suspend (-ESTRPIPE)
+ * @param *stats stats of the stream
+ * @param err error code returned by alsa-lib
+ */
+void pcm_stats_error(struct pcm_stats *stats,
+		     int err)
+{
+    if (err == -EPIPE)
+	pcm_stats_xrun(stats);
+    else if (err == -ESTRPIPE)
+	pcm_stats_suspend(stats);
+}
+
+
+/**
+ * Account for audio lost while the stream was stopped.
+ * Call from the transfer thread, which owns the gap log
+ * @param *stats stats of the stream
+ * @param *at when the stream stopped
+ * @param frames frames lost
+ */
+void pcm_stats_gap(struct pcm_stats *stats,
+		   const snd_htimestamp_t *at,
+		   snd_pcm_uframes_t frames)
+{
+    unsigned long n = atomic_load_explicit(&stats->gaps, memory_order_relaxed);
+    stats->gap_log[n % PCM_STATS_GAPS].at = *at;
+    stats->gap_log[n % PCM_STATS_GAPS].frames = frames;
+    atomic_fetch_add_explicit(&stats->lost_frames, frames, memory_order_relaxed);
+    atomic_store_explicit(&stats->gaps, n + 1, memory_order_release);
+}
+
+
+/**
+ * Count a finished xrun or suspend recovery and how long it took
+ * to get audio going again
+ * @param *stats stats of the stream
+ * @param us recovery time in microseconds
+ */
+void pcm_stats_recovery(struct pcm_stats *stats,
+			unsigned long us)
+{
+    unsigned long max = atomic_load_explicit(&stats->recovery_us_max,
+					     memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->recoveries, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->recovery_us, us, memory_order_relaxed);
+    while (us > max &&
+	   !atomic_compare_exchange_weak_explicit(&stats->recovery_us_max, &max, us,
+						  memory_order_relaxed,
+						  memory_order_relaxed))
+	;
+}
+
+
+static void pcm_stats_print_gaps(FILE *out,
+				 struct pcm_stats *stats)
+{
+    unsigned long n = atomic_load_explicit(&stats->gaps, memory_order_acquire);
+    unsigned long i = n > PCM_STATS_GAPS ? n - PCM_STATS_GAPS : 0;
+    unsigned long recoveries = atomic_load_explicit(&stats->recoveries,
+						    memory_order_relaxed);
+    struct pcm_gap *gap;
+
+    if (recoveries)
+	fprintf(out, "  recoveries %lu, mean %lu us, max %lu us\n", recoveries,
+		atomic_load_explicit(&stats->recovery_us, memory_order_relaxed) /
+		recoveries,
+		atomic_load_explicit(&stats->recovery_us_max, memory_order_relaxed));
+    if (n == 0)
+	return;
+    fprintf(out, "  lost %lu frames in %lu gaps",
+	    atomic_load_explicit(&stats->lost_frames, memory_order_relaxed), n);
+    if (n > PCM_STATS_GAPS)
+	fprintf(out, ", last %d", PCM_STATS_GAPS);
+    fprintf(out, ":\n");
+    for (; i < n; i++)
+    {
+	gap = &stats->gap_log[i % PCM_STATS_GAPS];
+	fprintf(out, "    at %ld.%06ld: %lu frames", (long) gap->at.tv_sec,
+		gap->at.tv_nsec / 1000, gap->frames);
+	if (stats->rate)
+	    fprintf(out, " (%.1f ms)", gap->frames * 1000.0 / stats->rate);
+	fprintf(out, "\n");
+    }
+}
+
+
+static void pcm_stats_print_hist(FILE *out,
+				 const char *what,
+				 _Atomic unsigned long *hist)
+{
+    unsigned long n;
+    int b;
+
+    fprintf(out, "  %s:", what);
+    for (b = 0; b < PCM_STATS_BUCKETS; b++)
+    {
+	n = atomic_load_explicit(&hist[b], memory_order_relaxed);
+	if (n)
+	    fprintf(out, " [%lu..%lu]=%lu", b ? 1UL << (b - 1) : 0,
+		    b ? (1UL << b) - 1 : 0, n);
+    }
+    fprintf(out, "\n");
+}
+
+
+/**
+ * Print the counters and histograms of one stream
+ * @param *stats stats of the stream
+ * @param *out where to print
+ */
+void pcm_stats_dump(struct pcm_stats *stats,
+		    FILE *out)
+{
+    fprintf(out, "%s: xruns %lu, suspends %lu, wakeups %lu, min fill %ld",
+	    stats->name,
+	    atomic_load_explicit(&stats->xruns, memory_order_relaxed),
+	    atomic_load_explicit(&stats->suspends, memory_order_relaxed),
+	    atomic_load_explicit(&stats->wakeups, memory_order_relaxed),
+	    atomic_load_explicit(&stats->min_fill, memory_order_relaxed));
+    if (atomic_load(&stats->attached))
+	fprintf(out, " of %lu frames\n", stats->buffer_size);
+    else
+    {
+	fprintf(out, "\n");
+	pcm_stats_print_gaps(out, stats);
+	return;
+    }
+    pcm_stats_print_gaps(out, stats);
+    pcm_stats_print_hist(out, "avail at wakeup (frames)", stats->avail_hist);
+    pcm_stats_print_hist(out, "wakeup lateness (us)", stats->late_hist);
+}
+
+
+static void pcm_stats_dump_all(void)
+{
+    if (atomic_load(&pcm_stats_playback.attached) ||
+	atomic_load(&pcm_stats_playback.xruns))
+	pcm_stats_dump(&pcm_stats_playback, stderr);
+    if (atomic_load(&pcm_stats_capture.attached) ||
+	atomic_load(&pcm_stats_capture.xruns))
+	pcm_stats_dump(&pcm_stats_capture, stderr);
+}
+
+
+static void pcm_stats_on_signal(int sig ATTRIBUTE_UNUSED)
+{
+    pcm_stats_dump_requested = 1;
+}
+
+
+/**
+ * Sample the stream state at a wakeup of the transfer loop:
+ * avail goes in one histogram, and lateness, the time since avail
+ * crossed avail_min extrapolated back from the position and timestamp
+ * reported by snd_pcm_status(), in the other.
+ * The hardware pointer often moves a period at a time, so the frames
+ * past avail_min miss how far the device has played since it last
+ * moved. That lag is the time since the trigger (htstamp less
+ * trigger_htstamp) less the time the position accounts for
+ * (audio_htstamp); audio_htstamp counts from wherever the position
+ * stood at the start, so the lag is taken against its smallest value
+ * since the trigger, seen right after the pointer moved. Without
+ * timestamps only the frames count.
+ * Doesn't print, so it's usable from async (signal) callbacks; call it
+ * from one thread per stream, which owns the lag baseline.
+ * @param *stats stats of the stream
+ * @param *pcm_handle handle to the pcm
+ */
+void pcm_stats_sample(struct pcm_stats *stats,
+		      snd_pcm_t *pcm_handle)
+{
+    snd_pcm_status_t *status;
+    snd_pcm_uframes_t avail;
+    snd_htimestamp_t now, trigger, audio;
+    long fill, min;
+    unsigned long late_us = 0;
+    double late, lag;
+
+    if (!atomic_load_explicit(&stats->attached, memory_order_relaxed))
+	return;
+    snd_pcm_status_alloca(&status);
+    if (snd_pcm_status(pcm_handle, status) < 0)
+	return;
+    if (snd_pcm_status_get_state(status) != SND_PCM_STATE_RUNNING)
+	return;
+
+    avail = snd_pcm_status_get_avail(status);
+    atomic_fetch_add_explicit(&stats->wakeups, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->avail_hist[pcm_stats_bucket(avail)], 1,
+			      memory_order_relaxed);
+    late = ((double) avail - stats->avail_min) / stats->rate;
+    snd_pcm_status_get_htstamp(status, &now);
+    if (now.tv_sec || now.tv_nsec)
+    {
+	snd_pcm_status_get_trigger_htstamp(status, &trigger);
+	snd_pcm_status_get_audio_htstamp(status, &audio);
+	lag = (now.tv_sec - trigger.tv_sec) +
+	    (now.tv_nsec - trigger.tv_nsec) / 1e9 -
+	    (audio.tv_sec + audio.tv_nsec / 1e9);
+	if (trigger.tv_sec != stats->trigger.tv_sec ||
+	    trigger.tv_nsec != stats->trigger.tv_nsec || lag < stats->lag_min)
+	{
+	    stats->trigger = trigger;
+	    stats->lag_min = lag;
+	}
+	late += lag - stats->lag_min;
+    }
+    if (late > 0)
+	late_us = late * 1e6;
+    atomic_fetch_add_explicit(&stats->late_hist[pcm_stats_bucket(late_us)], 1,
+			      memory_order_relaxed);
+
+    /* playback: frames still queued; capture: room left before overrun */
+    fill = avail > stats->buffer_size ? 0 : stats->buffer_size - avail;
+    min = atomic_load_explicit(&stats->min_fill, memory_order_relaxed);
+    if (min < 0 || fill < min)
+	atomic_store_explicit(&stats->min_fill, fill, memory_order_relaxed);
+}
+
+
+/**
+ * Print the stats if SIGUSR1 asked for it since the last call.
+ * Call from the transfer loop, never from a signal handler
+ */
+void pcm_stats_service(void)
+{
+    if (pcm_stats_dump_requested)
+    {
+	pcm_stats_dump_requested = 0;
+	pcm_stats_dump_all();
+    }
+}
+
+
+/**
+ * Sample the stream at a wakeup and print any requested dump
+ * @param *stats stats of the stream
+ * @param *pcm_handle handle to the pcm
+ */
+void pcm_stats_wakeup(struct pcm_stats *stats,
+		      snd_pcm_t *pcm_handle)
+{
+    pcm_stats_service();
+    pcm_stats_sample(stats, pcm_handle);
+}
+
+
+/**
+ * Start sampling histograms for a configured stream, and arrange for
+ * all stats to be printed on SIGUSR1 and at exit
+ * @param *stats stats of the stream
+ * @param *pcm_handle handle to the pcm, with hw and sw params set
+ */
+void pcm_stats_attach(struct pcm_stats *stats,
+		      snd_pcm_t *pcm_handle)
+{
+    static int installed = 0;
+    snd_pcm_hw_params_t *params;
+    snd_pcm_sw_params_t *swparams;
+    struct sigaction sa;
+
+    snd_pcm_hw_params_alloca(&params);
+    snd_pcm_sw_params_alloca(&swparams);
+    if (snd_pcm_hw_params_current(pcm_handle, params) < 0 ||
+	snd_pcm_sw_params_current(pcm_handle, swparams) < 0)
+	return;
+    snd_pcm_hw_params_get_rate(params, &stats->rate, NULL);
+    snd_pcm_hw_params_get_buffer_size(params, &stats->buffer_size);
+    snd_pcm_sw_params_get_avail_min(swparams, &stats->avail_min);
+    if (stats->rate == 0)
+	return;
+    /* status only carries the htstamp and audio_htstamp of a running
+       stream in this mode */
+    snd_pcm_sw_params_set_tstamp_mode(pcm_handle, swparams, SND_PCM_TSTAMP_ENABLE);
+    snd_pcm_sw_params(pcm_handle, swparams);
+    atomic_store(&stats->attached, 1);
+
+    if (!installed)
+    {
+	installed = 1;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = pcm_stats_on_signal;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sa, NULL);
+	atexit(pcm_stats_dump_all);
+    }
+}
+
+#endif
@@ -2,65 +2,728 @@
  * Simple sound playback using ALSA API and libasound.
  *
  * Compile:
- * gcc  playback.c -o playback -lasound
- * 
+ * gcc -O2 playback.c -o playback -lasound -lm -lpthread
+ *
  * Usage:
+ * $ ./play < "file.wav"
+ * $ ./play "file.wav"
  * $ ./play "sample_rate" "channels" "seconds" < "file"
- * 
+ * $ ./play "sample_rate" "channels" "seconds" "file"
+ *
  * Examples:
+ * $ ./play < 440Hz_44100Hz_16bit_05sec.wav
  * $ ./play 44100 2 5 < /dev/urandom
- * $ ./play 22050 1 8 < /path/to/file.wav
+ * $ ./play 44100 1 5 440Hz_44100Hz_16bit_05sec.wav
+ * $ ./play --rt-priority 70 --rt-mlock file.wav
+ *
+ * WAV input configures rate, channels and format from its header and
+ * plays exactly the data chunk. Raw input is taken as S16_LE.
+ * When a file name is given it is memory-mapped and played through
+ * direct (mmap) access: samples go from the page cache straight
+ * into the device ring, with no read() or intermediate buffer.
+ * Standard input is read ahead by a separate thread into a ring of a
+ * few seconds, so a stalling pipe is reported as starvation (and
+ * played as silence) instead of causing an xrun.
+ * The device is opened at its native formats and rates only. A stream
+ * in another format is converted here (fmtconv.h), at another rate
+ * resampled (resample.h) at the quality named by $PCM_RESAMPLE: fast,
+ * medium (default) or best; a mapped file is then read through the
+ * reader thread too.
+ * The real-time flags of rt.h may come anywhere on the command line.
  *
  */
- 
+
+#include "rt.h"
 #include "mypcm.h"
+#include "wav.h"
+#include "arena.h"
+#include "ringbuf.h"
+#include "resample.h"
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define READAHEAD (1024 * 1024)		/* bytes to ask the kernel to prefetch */
+#define PREFETCH_SECONDS 4		/* stdin audio read ahead of playback */
+#define PREFILL_SECONDS 1		/* read ahead before playback starts */
+#define READ_CHUNK 65536		/* bytes per read() of stdin */
+#define READER_WAIT 2000		/* us between checks of the ring */
+#define PIPE_BYTES (1024 * 1024)	/* pipe buffer asked for on stdin */
+#define RESAMPLE_ENV "PCM_RESAMPLE"	/* quality tier of the rate conversion */
+
+static struct arena arena;		/* hw params and transfer buffers */
+
+/**
+ * Give the kernel advice on a byte range of the mapped sample data.
+ * The data starts at the WAV payload, not on a page, so the range is
+ * widened to whole pages, or for MADV_DONTNEED narrowed, so no page
+ * still being played is let go. A failure is reported once
+ * @param *data mapped sample data, inside a page aligned mapping
+ * @param from first byte
+ * @param len bytes
+ * @param advice MADV_ value
+ */
+static void advise(const char *data,
+		   size_t from,
+		   size_t len,
+		   int advice)
+{
+    static int warned = 0;
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t) (data + from), end = start + len;
+
+    if (advice == MADV_DONTNEED)
+    {
+	start = (start + page - 1) & ~(page - 1);
+	end &= ~(page - 1);
+    }
+    else
+    {
+	start &= ~(page - 1);
+	end = (end + page - 1) & ~(page - 1);
+    }
+    if (end <= start)
+	return;
+    if (madvise((void *) start, end - start, advice) < 0 && !warned)
+    {
+	warned = 1;
+	fprintf(stderr, "WARNING: madvise() failed, no readahead. %s\n",
+		strerror(errno));
+    }
+}
+
+
+/**
+ * Play a memory-mapped file through the mmap areas of the device
+ * @param *pcm_handle handle to playback, set up for mmap access
+ * @param *data mapped sample data
+ * @param total frames to play
+ * @param *info sample format, channels count and frame size
+ * @param period period size in frames
+ */
+static void play_mapped(snd_pcm_t *pcm_handle,
+			const char *data,
+			snd_pcm_uframes_t total,
+			const struct wav_info *info,
+			snd_pcm_uframes_t period)
+{
+    snd_pcm_channel_area_t src[info->channels];
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t pos = 0, offset, frames;
+    snd_pcm_sframes_t avail, commitres;
+    size_t frame_bytes = info->block_align;
+    size_t advised = 0, released = 0, at;
+    unsigned int chn;
+    int err, first = 1;
+
+    for (chn = 0; chn < info->channels; chn++)
+    {
+	src[chn].addr = (void *) data;
+	src[chn].first = chn * snd_pcm_format_physical_width(info->format);
+	src[chn].step = frame_bytes * 8;
+    }
+    advise(data, 0, total * frame_bytes, MADV_SEQUENTIAL);
+
+    while (pos < total)
+    {
+	/* keep the kernel one window ahead of us, drop what's been played */
+	at = pos * frame_bytes;
+	if (advised < at + READAHEAD && advised < total * frame_bytes)
+	{
+	    advise(data, advised, total * frame_bytes - advised < READAHEAD ?
+		   total * frame_bytes - advised : READAHEAD, MADV_WILLNEED);
+	    advised += READAHEAD;
+	}
+	if (at - released >= READAHEAD)
+	{
+	    advise(data, released, READAHEAD, MADV_DONTNEED);
+	    released += READAHEAD;
+	}
+
+	avail = snd_pcm_avail_update(pcm_handle);
+	if (avail < 0)
+	{
+	    pcm_stats_error(&pcm_stats_playback, avail);
+	    err = snd_pcm_recover(pcm_handle, avail, 0);
+	    if (err < 0)
+	    {
+		printf("ERROR: Can't recover from xrun. %s\n",
+		       snd_strerror(err));
+		exit(1);
+	    }
+	    first = 1;
+	    continue;
+	}
+	if ((snd_pcm_uframes_t) avail < period &&
+	    (snd_pcm_uframes_t) avail < total - pos)
+	{
+	    if (first)
+	    {
+		first = 0;
+		err = snd_pcm_start(pcm_handle);
+		if (err < 0)
+		{
+		    printf("ERROR: Can't start PCM. %s\n", snd_strerror(err));
+		    exit(1);
+		}
+	    }
+	    else
+		snd_pcm_wait(pcm_handle, -1);
+	    continue;
+	}
+
+	frames = total - pos < (snd_pcm_uframes_t) avail ?
+	    total - pos : (snd_pcm_uframes_t) avail;
+	err = snd_pcm_mmap_begin(pcm_handle, &areas, &offset, &frames);
+	if (err < 0)
+	{
+	    printf("ERROR: MMAP begin failed. %s\n", snd_strerror(err));
+	    exit(1);
+	}
+	snd_pcm_areas_copy(areas, offset, src, pos, info->channels, frames,
+			   info->format);
+	commitres = snd_pcm_mmap_commit(pcm_handle, offset, frames);
+	if (commitres < 0 || (snd_pcm_uframes_t) commitres != frames)
+	{
+	    pcm_stats_error(&pcm_stats_playback,
+			    commitres >= 0 ? -EPIPE : commitres);
+	    err = snd_pcm_recover(pcm_handle,
+				  commitres >= 0 ? -EPIPE : commitres, 0);
+	    if (err < 0)
+	    {
+		printf("ERROR: MMAP commit failed. %s\n", snd_strerror(err));
+		exit(1);
+	    }
+	    first = 1;
+	    continue;
+	}
+	pos += frames;
+    }
+
+    /* a file shorter than the buffer never reached the start point */
+    if (snd_pcm_state(pcm_handle) == SND_PCM_STATE_PREPARED)
+	snd_pcm_start(pcm_handle);
+}
+
+
+/**
+ * Prefetching reader: a thread reads stdin ahead of playback into a
+ * ring holding several seconds of audio, so a slow pipe or disk shows
+ * up as reported starvation instead of an xrun or a stale period
+ */
+struct stdin_reader
+{
+    int fd;
+    struct ringbuf ring;
+    char *chunk;		/* READ_CHUNK bytes, read() lands here */
+    uint64_t left;		/* bytes still to read, or WAV_DATA_UNKNOWN */
+    _Atomic int eof;		/* nothing more will be queued */
+    _Atomic int stop;		/* playback is over, stop reading */
+    int error;			/* errno of a failed read, valid after eof */
+};
+
+
+/**
+ * Reader thread: fill the ring with whole frames from the input,
+ * waiting for room rather than letting the ring drop any
+ * @param *arg the stdin_reader
+ */
+static void *reader_thread(void *arg)
+{
+    struct stdin_reader *r = arg;
+    size_t frame_bytes = r->ring.frame_bytes;
+    size_t have = 0, want, frames;
+    ssize_t got;
+
+    while (!atomic_load(&r->stop))
+    {
+	want = READ_CHUNK - have;
+	if (r->left != WAV_DATA_UNKNOWN && want > r->left)
+	    want = r->left;
+	if (want == 0)
+	    break;	/* end of the data chunk */
+	got = read(r->fd, r->chunk + have, want);
+	if (got < 0 && errno == EINTR)
+	    continue;
+	if (got < 0)
+	    r->error = errno;
+	if (got <= 0)
+	    break;
+	have += got;
+	if (r->left != WAV_DATA_UNKNOWN)
+	    r->left -= got;
+
+	/* a short read may end mid-frame, keep the tail for next time */
+	frames = have / frame_bytes;
+	while (r->ring.size - ringbuf_fill(&r->ring) < frames &&
+	       !atomic_load(&r->stop))
+	    usleep(READER_WAIT);
+	ringbuf_write(&r->ring, r->chunk, frames);
+	memmove(r->chunk, r->chunk + frames * frame_bytes,
+		have - frames * frame_bytes);
+	have -= frames * frame_bytes;
+    }
+    atomic_store(&r->eof, 1);
+    return NULL;
+}
+
+
+/**
+ * Set up the ring in the arena and start reading ahead
+ * @param *r reader to start
+ * @param *thread returns the reader thread
+ * @param fd input, positioned at the first sample
+ * @param *info stream parameters
+ * @param left bytes to read, or WAV_DATA_UNKNOWN to read to the end
+ */
+static void reader_start(struct stdin_reader *r,
+			 pthread_t *thread,
+			 int fd,
+			 const struct wav_info *info,
+			 uint64_t left)
+{
+    size_t frames = (size_t) PREFETCH_SECONDS * info->rate;
+    struct stat st;
+    char *data;
+
+    data = arena_alloc(&arena, ringbuf_capacity(frames) * info->block_align, 4096);
+    r->chunk = arena_alloc(&arena, READ_CHUNK, 4096);
+    if (data == NULL || r->chunk == NULL)
+    {
+	printf("ERROR: No enough memory\n");
+	exit(1);
+    }
+    ringbuf_init_with(&r->ring, data, frames, info->block_align);
+    r->fd = fd;
+    r->left = left;
+    r->error = 0;
+    atomic_init(&r->eof, 0);
+    atomic_init(&r->stop, 0);
+
+    /* let the writer get ahead of us too; the pipe limit may refuse it */
+    if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode))
+	fcntl(fd, F_SETPIPE_SZ, PIPE_BYTES);
+    if (pthread_create(thread, NULL, reader_thread, r))
+    {
+	printf("ERROR: Can't start reader thread\n");
+	exit(1);
+    }
+}
+
+
+/**
+ * Stop the reader, which may be blocked in read() on a quiet pipe
+ * @param *r reader
+ * @param thread the reader thread
+ */
+static void reader_stop(struct stdin_reader *r,
+			pthread_t thread)
+{
+    atomic_store(&r->stop, 1);
+    if (!atomic_load(&r->eof))
+	pthread_cancel(thread);
+    pthread_join(thread, NULL);
+}
+
+
+/**
+ * Conversion of the stream to the device format and rate, between the
+ * reader's periods and the device. Format only conversions go straight
+ * from one format to the other (fmtconv.h); resampling goes through float
+ */
+struct stream_converter
+{
+    struct fmtconv from;	/* stream format */
+    struct fmtconv to;		/* device format */
+    struct resampler rs;
+    int resample;		/* the rates differ */
+    unsigned int channels;
+    float *in;			/* a period of input as float */
+    float *out;			/* its resampled output */
+    char *dev;			/* the output in the device format */
+    size_t out_max;		/* frames out, and in dev */
+};
+
+
+/**
+ * Set up the conversion of a period at a time to the device
+ * @param *conv converter to set up
+ * @param *info stream parameters
+ * @param format device format
+ * @param rate device rate
+ * @param period input frames per call
+ * @param quality resampler tier
+ */
+static void converter_init(struct stream_converter *conv,
+			   const struct wav_info *info,
+			   snd_pcm_format_t format,
+			   unsigned int rate,
+			   snd_pcm_uframes_t period,
+			   enum resample_quality quality)
+{
+    if (fmtconv_init(&conv->from, info->format) < 0 ||
+	fmtconv_init(&conv->to, format) < 0)
+    {
+	printf("ERROR: Can't convert %s to %s\n",
+	       snd_pcm_format_name(info->format), snd_pcm_format_name(format));
+	exit(1);
+    }
+    conv->channels = info->channels;
+    conv->resample = rate != info->rate;
+    conv->out_max = period;
+    if (conv->resample)
+    {
+	if (resample_init(&conv->rs, &arena, info->channels, info->rate, rate,
+			  quality, period) < 0)
+	{
+	    printf("ERROR: Can't convert %u Hz to %u Hz\n", info->rate, rate);
+	    exit(1);
+	}
+	conv->out_max = resample_max_out(&conv->rs, period);
+	conv->in = arena_alloc(&arena, period * info->channels * sizeof(float), 0);
+	conv->out = arena_alloc(&arena, conv->out_max * info->channels *
+				sizeof(float), 0);
+	if (conv->in == NULL || conv->out == NULL)
+	{
+	    printf("ERROR: No enough memory\n");
+	    exit(1);
+	}
+    }
+    conv->dev = arena_alloc(&arena, conv->out_max * info->channels *
+			    conv->to.bytes, 0);
+    if (conv->dev == NULL)
+    {
+	printf("ERROR: No enough memory\n");
+	exit(1);
+    }
+}
+
+
+/**
+ * Play frames of the stream, through the converter if there is one
+ * @param *pcm_handle handle to playback
+ * @param *conv converter, or NULL to play the frames as they are
+ * @param *buf frames in the stream format and rate
+ * @param frames frames in buf
+ */
+static void play_frames(snd_pcm_t *pcm_handle,
+			struct stream_converter *conv,
+			char *buf,
+			snd_pcm_uframes_t frames)
+{
+    long got;
+
+    if (conv == NULL)
+    {
+	play(pcm_handle, buf, frames);
+	return;
+    }
+    if (!conv->resample)
+    {
+	fmtconv_convert(&conv->from, &conv->to, conv->dev, buf,
+			frames * conv->channels);
+	play(pcm_handle, conv->dev, frames);
+	return;
+    }
+    fmtconv_decode(&conv->from, conv->in, buf, frames * conv->channels);
+    got = resample_process(&conv->rs, conv->in, frames, conv->out, conv->out_max);
+    if (got <= 0)
+	return;
+    fmtconv_encode(&conv->to, conv->dev, conv->out, got * conv->channels);
+    play(pcm_handle, conv->dev, got);
+}
+
+
+/**
+ * Play from the reader's ring only, a period at a time. Input that
+ * hasn't arrived in time is played as silence and reported, never
+ * as whatever the buffer held before
+ * @param *pcm_handle handle to playback
+ * @param *r running reader
+ * @param *conv stream converter, or NULL
+ * @param *info stream parameters
+ * @param *buf one period of frames
+ * @param period period size in frames, at the stream rate
+ * @param total frames to play at most
+ */
+static void play_prefetched(snd_pcm_t *pcm_handle,
+			    struct stdin_reader *r,
+			    struct stream_converter *conv,
+			    const struct wav_info *info,
+			    char *buf,
+			    snd_pcm_uframes_t period,
+			    snd_pcm_uframes_t total)
+{
+    size_t prefill = (size_t) PREFILL_SECONDS * info->rate;
+    size_t frame_bytes = info->block_align;
+    snd_pcm_uframes_t played = 0, want, n, gap = 0;
+    unsigned long starved = 0, silence = 0;
+
+    /* start with a cushion, so the first slow read doesn't starve us */
+    while (ringbuf_fill(&r->ring) < prefill && !atomic_load(&r->eof))
+	usleep(READER_WAIT);
+
+    while (played < total)
+    {
+	want = total - played < period ? total - played : period;
+	n = ringbuf_read(&r->ring, buf, want);
+	if (n < want && atomic_load(&r->eof))
+	{
+	    /* the reader may have queued its last frames since */
+	    n += ringbuf_read(&r->ring, buf + n * frame_bytes, want - n);
+	    if (n < want)
+	    {
+		if (n > 0)
+		    play_frames(pcm_handle, conv, buf, n);
+		break;
+	    }
+	}
+	else if (n < want)
+	{
+	    /* one report per stall, not one per period */
+	    if (gap == 0)
+	    {
+		starved++;
+		fprintf(stderr, "WARNING: input starved, playing silence\n");
+	    }
+	    gap += want - n;
+	    snd_pcm_format_set_silence(info->format, buf + n * frame_bytes,
+				       (want - n) * info->channels);
+	    n = want;
+	}
+	else if (gap)
+	{
+	    fprintf(stderr, "input back after %lu frames (%.1f ms) of silence\n",
+		    gap, gap * 1000.0 / info->rate);
+	    silence += gap;
+	    gap = 0;
+	}
+	play_frames(pcm_handle, conv, buf, n);
+	played += n;
+    }
+    if (conv && conv->resample)
+    {
+	/* push the last frames out of the filter */
+	n = resample_latency(&conv->rs);
+	n = n < period ? n : period;
+	snd_pcm_format_set_silence(info->format, buf, n * info->channels);
+	play_frames(pcm_handle, conv, buf, n);
+    }
+    silence += gap;
+    if (r->error)
+	fprintf(stderr, "WARNING: Can't read input. %s\n", strerror(r->error));
+    if (starved)
+	fprintf(stderr, "input starved %lu times, %lu frames of silence "
+		"(%.1f ms)\n", starved, silence, silence * 1000.0 / info->rate);
+}
+
+
+/**
+ * Map a file read-only for playback. A WAV header, when present,
+ * is parsed and the returned pointer is the start of its data chunk
+ * @param *path file to map
+ * @param *info stream parameters, updated from a WAV header
+ * @param *data returns the first sample
+ * @param *size returns the mapping size in bytes
+ * @return pointer to the mapping
+ */
+static char *map_file(const char *path,
+		      struct wav_info *info,
+		      const char **data,
+		      size_t *size)
+{
+    struct stat st;
+    char *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+	printf("ERROR: Can't open \"%s\". %s\n", path, strerror(errno));
+	exit(1);
+    }
+    if (wav_read_header(fd, info) < 0)
+    {
+	info->format = SND_PCM_FORMAT_UNKNOWN;
+	info->data_offset = 0;
+	info->data_size = st.st_size;
+    }
+    if (info->data_size == WAV_DATA_UNKNOWN ||
+	info->data_offset + info->data_size > (uint64_t) st.st_size)
+	info->data_size = st.st_size - info->data_offset;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+	printf("ERROR: Can't map \"%s\". %s\n", path, strerror(errno));
+	exit(1);
+    }
+    *data = map + info->data_offset;
+    *size = st.st_size;
+    return map;
+}
+
+
 int main(int argc, char *argv[])
 {
     char *buf;
-    unsigned int period;
-    int rate;
-    int channels;
-    int seconds;
-    int buf_size;
-    int i;
+    int seconds = 0;
     snd_pcm_t *playback_handle;
-    snd_pcm_hw_params_t *params;
+    snd_pcm_hw_params_t *params, *probe;
     snd_pcm_uframes_t frames;
+    struct wav_info info;
+    struct stream_converter converter, *conv = NULL;
+    snd_pcm_format_t format;
+    unsigned int rate;
+    size_t arena_size;
+    char *map = NULL;
+    const char *data = NULL;
+    size_t map_size = 0;
+    snd_pcm_uframes_t total;
+    struct rt_config rt;
+    struct stdin_reader reader;
+    pthread_t reader_thread_id;
+    int raw, fd = 0, quality = RESAMPLE_MEDIUM;
+
+    rt_parse_args(&argc, argv, &rt);
+    rt_apply(&rt);
+    raw = argc >= 4;
 
-    if (argc < 4)
+    if (argc == 2 || argc > 4)
+	map = map_file(argv[argc - 1], &info, &data, &map_size);
+    else if (argc == 1)
     {
-	printf("Usage: %s <sample_rate> <channels> <seconds>\n",
+	if (wav_read_header(0, &info) < 0)
+	{
+	    printf("ERROR: stdin is not a supported WAV stream\n");
+	    exit(1);
+	}
+    }
+    else if (argc != 4)
+    {
+	printf("Usage: %s [<sample_rate> <channels> <seconds>] [file]\n",
 	       argv[0]);
+	rt_usage(stdout);
+	exit(1);
+    }
+    if (map && !raw && info.format == SND_PCM_FORMAT_UNKNOWN)
+    {
+	printf("ERROR: \"%s\" is not a supported WAV file\n", argv[1]);
 	exit(1);
     }
- 
-    rate  = atoi(argv[1]);
-    channels = atoi(argv[2]);
-    seconds  = atoi(argv[3]);
+    if (raw)
+    {
+	/* a raw file mapped in map_file() has no header to go by */
+	info.rate = atoi(argv[1]);
+	info.channels = atoi(argv[2]);
+	info.format = SND_PCM_FORMAT_S16_LE;
+	info.block_align = info.channels * 2;
+	seconds = atoi(argv[3]);
+    }
 
     open_pcm(&playback_handle,PCM_DEVICE,SND_PCM_STREAM_PLAYBACK,0);
-    snd_pcm_hw_params_malloc (&params);
+    /* find the native format and rate first; others are converted here */
+    snd_pcm_hw_params_alloca(&probe);
+    snd_pcm_hw_params_any(playback_handle, probe);
+    format = set_native_format(playback_handle, probe, info.format, NULL);
+    set_channels(playback_handle, probe, info.channels);
+    rate = set_native_rate(playback_handle, probe, info.rate);
+    if (format != info.format || rate != info.rate)
+    {
+	if (getenv(RESAMPLE_ENV) &&
+	    (quality = resample_quality_from_name(getenv(RESAMPLE_ENV))) < 0)
+	{
+	    printf("ERROR: %s must be fast, medium or best\n", RESAMPLE_ENV);
+	    exit(1);
+	}
+	conv = &converter;
+	if (map)
+	{
+	    /* the mapped path copies straight to the device: read it instead */
+	    fd = open(argv[argc - 1], O_RDONLY);
+	    if (fd < 0 || lseek(fd, info.data_offset, SEEK_SET) < 0)
+	    {
+		printf("ERROR: Can't open \"%s\". %s\n", argv[argc - 1],
+		       strerror(errno));
+		exit(1);
+	    }
+	    munmap(map, map_size);
+	    map = NULL;
+	}
+    }
+
+    /* the read-ahead ring, a period and a read chunk, with slack */
+    arena_size = map ? 65536 : ringbuf_capacity((size_t) PREFETCH_SECONDS *
+						info.rate) * info.block_align +
+	(size_t) info.rate * info.block_align + READ_CHUNK + 65536;
+    /* and the converter with its buffers, for periods up to a second */
+    if (conv)
+	arena_size += resample_arena_size(info.channels, info.rate, rate,
+					  quality, info.rate) +
+	    ((size_t) info.rate + 2 * ((size_t) rate + info.rate + 2)) *
+	    info.channels * sizeof(float);
+    if (arena_init(&arena, arena_size, 0) < 0 ||
+	(params = arena_hw_params(&arena)) == NULL)
+    {
+	printf("ERROR: No enough memory\n");
+	exit(1);
+    }
     snd_pcm_hw_params_any(playback_handle, params);
+    snd_pcm_hw_params_set_rate_resample(playback_handle, params, 0);
 
-    set_params(playback_handle,params,channels,rate);
-    write_params(playback_handle,params);    
-  
-    /* Allocate buffer to hold single period */
+    set_stream_params(playback_handle,params,
+		      map ? SND_PCM_ACCESS_MMAP_INTERLEAVED :
+		      SND_PCM_ACCESS_RW_INTERLEAVED,
+		      format,info.channels,rate);
+    set_profile(playback_handle,params,PCM_PROFILE_BALANCED);
     snd_pcm_hw_params_get_period_size(params, &frames, 0);
-    buf_size = frames * channels * 2 /* 2 -> sample size */;
-    buf = (char *) malloc(buf_size);  
-  
-    period = get_period_time(params);
-    snd_pcm_hw_params_free(params);
-    for (i = (seconds * 1000000) / period; i > 0; i--)
+    pcm_stats_attach(&pcm_stats_playback, playback_handle);
+
+    if (map)
     {
-	read(0,buf,buf_size);
-	play(playback_handle,buf,frames); 
+	total = info.data_size / info.block_align;
+	if (raw && total > (snd_pcm_uframes_t) seconds * info.rate)
+	    total = (snd_pcm_uframes_t) seconds * info.rate;
+	play_mapped(playback_handle, data, total, &info, frames);
+	snd_pcm_drain(playback_handle);
+	snd_pcm_close(playback_handle);
+	munmap(map, map_size);
+	return 0;
     }
-    
+
+    if (conv)
+    {
+	/* read periods of input that come out as about a device period */
+	frames = (frames * info.rate + rate - 1) / rate;
+	converter_init(conv, &info, format, rate, frames, quality);
+    }
+
+    /* Allocate buffer to hold single period */
+    buf = arena_alloc(&arena, frames * info.block_align, 0);
+    if (buf == NULL)
+    {
+	printf("ERROR: No enough memory\n");
+	exit(1);
+    }
+
+    if (raw)
+    {
+	reader_start(&reader, &reader_thread_id, fd, &info,
+		     fd ? info.data_size : WAV_DATA_UNKNOWN);
+	total = (snd_pcm_uframes_t) seconds * info.rate;
+    }
+    else
+    {
+	reader_start(&reader, &reader_thread_id, fd, &info, info.data_size);
+	total = info.data_size == WAV_DATA_UNKNOWN ? (snd_pcm_uframes_t) -1 :
+	    info.data_size / info.block_align;
+    }
+    play_prefetched(playback_handle, &reader, conv, &info, buf, frames, total);
+    reader_stop(&reader, reader_thread_id);
+
     snd_pcm_drain(playback_handle);
     snd_pcm_close(playback_handle);
-    free(buf);
+    arena_destroy(&arena);
     return 0;
 }
- 
@@ -2,26 +2,41 @@
  * compile:
  * gcc playback_sin.c -o playback_sin -lasound -lm
  *
+ * usage:
+ * ./playback_sin [--kernel=NAME] frequency
  *
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <alsa/asoundlib.h>
 #include <math.h>    
+#include "osc.h"
 
 
 #define PCM_DEVICE "plughw:0,0"
-#define PI 3.14159265
+#define LOOP_MAX_BYTES (4 * 1024 * 1024)
 
 
  
 int main (int argc, char *argv[])
 {
-  int i;
   int err;
-  float buf[10000];
+  unsigned int rate = 44100;
+  snd_pcm_sframes_t n;
   snd_pcm_t *playback_handle;
   snd_pcm_hw_params_t *hw_params;
+  struct kernel_config kernel;
+  struct arena arena;
+  struct osc_loop loop;
+
+  kernel_parse_args(&argc, argv, &kernel);
+  if (kernel.check)
+    return osc_kernel_report(stdout) ? 1 : 0;
+  if (argc < 2) {
+    fprintf (stderr, "usage: %s [--kernel=NAME] frequency\n", argv[0]);
+    exit (1);
+  }
+  osc_kernel_select(kernel.isa);
   float freq = atoi(argv[1]);
 
 if ((err = snd_pcm_open (&playback_handle, PCM_DEVICE, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
@@ -55,8 +70,7 @@ if ((err = snd_pcm_open (&playback_handle, PCM_DEVICE, SND_PCM_STREAM_PLAYBACK,
     exit (1);
   }
  
-  int rate = 44100;
-  if ((err = snd_pcm_hw_params_set_rate_resample (playback_handle, hw_params, rate)) < 0) {
+  if ((err = snd_pcm_hw_params_set_rate_near (playback_handle, hw_params, &rate, 0)) < 0) {
     fprintf (stderr, "cannot set sample rate (%s)\n",snd_strerror (err));
     exit (1);
   }
@@ -82,29 +96,35 @@ if ((err = snd_pcm_open (&playback_handle, PCM_DEVICE, SND_PCM_STREAM_PLAYBACK,
   }
  
 
-  for(i = 0; i < 10000; i++)
-    {
-      // i is the sample index
-      // Straight sine function means one cycle every 2*pi samples:
-      //buf[i] = sin(i); 
-      // Multiply by 2*pi--now it's one cycle per sample:
-      // buf[i] = sin((2 * PI) * i); 
-      // Multiply by 1,000 samples per second--now it's 1,000 cycles per second:
-      // buf[i] = sin(freq * (2 * PI) * i);
-      // Divide by 44,100 samples per second--now it's 1,000 cycles per 44,100
-      // samples, which is just what we needed:
-       buf[i] = sin(freq  * (2 * PI) * i / 44100);
-             printf ("%f\n",buf[i]);
-    }
-  
+  // A sine of freq Hz at rate samples per second is
+  //   sin(freq * (2 * PI) * i / rate)
+  // for sample i. It repeats after rate / gcd(freq, rate) samples, which
+  // hold a whole number of cycles: render that much once, in the stream
+  // format, and send the same samples over and over.
+  if ((err = arena_init (&arena, LOOP_MAX_BYTES + 65536, 0)) < 0 ||
+      (err = osc_loop_init (&loop, &arena, SND_PCM_FORMAT_S16_LE, 2, freq, rate,
+			    LOOP_MAX_BYTES, 1)) < 0) {
+    fprintf (stderr, "cannot render the sine (%s)\n", snd_strerror (err));
+    exit (1);
+  }
+  printf ("%lu frames hold %lu cycles of %.6f Hz (%+.3g Hz)\n",
+	  loop.length, loop.cycles, loop.freq, loop.error);
+
   while(1) {
-    err = snd_pcm_writei (playback_handle, buf , 4);
-    if (err != 4)  //must be 4
+    // straight from the loop, up to its end, then around
+    n = loop.length - loop.pos;
+    if (n > 4096)
+      n = 4096;
+    err = snd_pcm_writei (playback_handle, loop.frames + loop.pos * loop.frame_bytes, n);
+    if (err < 0)
+      err = snd_pcm_recover (playback_handle, err, 0);
+    if (err < 0)
       {
       fprintf (stderr, "write to audio interface failed (%s)\n",
 	       snd_strerror (err));
       exit (1);
     }
+    loop.pos = (loop.pos + err) % loop.length;
   }
  
   snd_pcm_close (playback_handle);
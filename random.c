@@ -1,18 +1,27 @@
 /*
  *  This extra small demo sends a random samples to your speakers.
+ *  The noise comes from the vectorized generator of osc.h, run with the
+ *  best kernels for this CPU or the ones named with --kernel=NAME.
  */
 #include <alsa/asoundlib.h>
+#include "osc.h"
 static char *device = "plughw:0,0";                        /* playback device */
 snd_output_t *output = NULL;
 unsigned char buffer[16*1024];                          /* some random data */
-int main(void)
+int main(int argc, char *argv[])
 {
   int err;
   unsigned int i;
   snd_pcm_t *handle;
   snd_pcm_sframes_t frames;
-  for (i = 0; i < sizeof(buffer); i++)
-    buffer[i] = random() & 0xff;
+  struct kernel_config kernel;
+  uint32_t state[OSC_NOISE_LANES];
+  kernel_parse_args(&argc, argv, &kernel);
+  if (kernel.check)
+    return osc_kernel_report(stdout) ? 1 : 0;
+  osc_kernel_select(kernel.isa);
+  osc_noise_seed(state, 1);
+  osc_noise(buffer, sizeof(buffer), state);
   if ((err = snd_pcm_open(&handle, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
     printf("Playback open error: %s\n", snd_strerror(err));
     exit(EXIT_FAILURE);
@@ -0,0 +1,230 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <alsa/asoundlib.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <errno.h>
+#include "arena.h"
+
+#define REACTOR_EVENTS 64	/* epoll events taken per wakeup */
+
+struct reactor_stream;
+
+/**
+ * Called when a stream is ready: to be filled (playback) or
+ * drained (capture), or with POLLERR after an xrun or suspend
+ * @param *stream ready stream
+ * @param revents demangled events from snd_pcm_poll_descriptors_revents()
+ * @return 0 to keep the stream, a negative error code to drop it
+ */
+typedef int (*reactor_cb_t)(struct reactor_stream *stream,
+			    unsigned short revents);
+
+/**
+ * One poll descriptor of a stream, the epoll user data
+ */
+struct reactor_fd
+{
+    struct reactor_stream *stream;
+    int index;			/* into stream->ufds */
+};
+
+/**
+ * A PCM registered with a reactor
+ */
+struct reactor_stream
+{
+    snd_pcm_t *handle;
+    reactor_cb_t ready;
+    void *data;			/* for the callback */
+    struct pollfd *ufds;	/* the PCM's poll descriptors */
+    struct reactor_fd *fds;
+    int count;			/* poll descriptors count */
+    int pending;		/* events collected, not yet dispatched */
+    unsigned long wakeups;
+};
+
+/**
+ * One epoll set serving any number of playback and capture streams
+ * from the thread calling reactor_run_once()
+ */
+struct reactor
+{
+    int epfd;
+    int streams;		/* registered streams */
+};
+
+
+/**
+ * Create the epoll set
+ * @param *reactor reactor to initialise
+ * @return 0 on success or -errno
+ */
+int reactor_init(struct reactor *reactor)
+{
+    reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epfd < 0)
+	return -errno;
+    reactor->streams = 0;
+    return 0;
+}
+
+
+/**
+ * Register every poll descriptor of a PCM. The PCM should be
+ * configured already, as the descriptors depend on its setup.
+ * The descriptor tables are carved from an arena, and go back with
+ * the arena reset that tears the stream down
+ * @param *reactor reactor
+ * @param *stream stream to fill in, must stay valid while registered
+ * @param *arena arena for the descriptor tables
+ * @param *pcm_handle handle to the pcm
+ * @param ready callback for the stream
+ * @param *data passed along in stream->data
+ * @return 0 on success or a negative error code
+ */
+int reactor_add(struct reactor *reactor,
+		struct reactor_stream *stream,
+		struct arena *arena,
+		snd_pcm_t *pcm_handle,
+		reactor_cb_t ready,
+		void *data)
+{
+    struct epoll_event ev;
+    int i, err;
+
+    stream->handle = pcm_handle;
+    stream->ready = ready;
+    stream->data = data;
+    stream->pending = 0;
+    stream->wakeups = 0;
+    stream->count = snd_pcm_poll_descriptors_count(pcm_handle);
+    if (stream->count <= 0)
+	return stream->count < 0 ? stream->count : -EINVAL;
+    stream->ufds = arena_alloc(arena, stream->count * sizeof(*stream->ufds), 0);
+    stream->fds = arena_alloc(arena, stream->count * sizeof(*stream->fds), 0);
+    if (stream->ufds == NULL || stream->fds == NULL)
+    {
+	err = -ENOMEM;
+	goto fail;
+    }
+    err = snd_pcm_poll_descriptors(pcm_handle, stream->ufds, stream->count);
+    if (err < 0)
+	goto fail;
+
+    for (i = 0; i < stream->count; i++)
+    {
+	stream->fds[i].stream = stream;
+	stream->fds[i].index = i;
+	/* level triggered, so the set behaves exactly like poll() */
+	ev.events = stream->ufds[i].events;
+	ev.data.ptr = &stream->fds[i];
+	if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, stream->ufds[i].fd, &ev) < 0)
+	{
+	    err = -errno;
+	    while (--i >= 0)
+		epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, stream->ufds[i].fd, NULL);
+	    goto fail;
+	}
+    }
+    reactor->streams++;
+    return 0;
+
+fail:
+    stream->ufds = NULL;
+    stream->fds = NULL;
+    return err;
+}
+
+
+/**
+ * Unregister a stream. The PCM itself is left open, the descriptor
+ * tables stay in the arena until it is reset
+ * @param *reactor reactor
+ * @param *stream registered stream
+ */
+void reactor_remove(struct reactor *reactor,
+		    struct reactor_stream *stream)
+{
+    int i;
+
+    if (stream->ufds == NULL)
+	return;
+    for (i = 0; i < stream->count; i++)
+	epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, stream->ufds[i].fd, NULL);
+    stream->ufds = NULL;
+    stream->fds = NULL;
+    reactor->streams--;
+}
+
+
+/**
+ * Wait for ready streams and run their callbacks once. Events are
+ * first gathered per stream, so a PCM with several descriptors is
+ * demangled by snd_pcm_poll_descriptors_revents() and dispatched once.
+ * A stream whose callback fails is removed
+ * @param *reactor reactor
+ * @param timeout epoll timeout in ms, -1 to wait forever
+ * @return streams dispatched, or the first error
+ */
+int reactor_run_once(struct reactor *reactor,
+		     int timeout)
+{
+    struct epoll_event events[REACTOR_EVENTS];
+    struct reactor_stream *ready[REACTOR_EVENTS];
+    struct reactor_fd *fd;
+    struct reactor_stream *stream;
+    unsigned short revents;
+    int n, i, nready = 0, err, first_err = 0;
+
+    n = epoll_wait(reactor->epfd, events, REACTOR_EVENTS, timeout);
+    if (n < 0)
+	return errno == EINTR ? 0 : -errno;
+
+    for (i = 0; i < n; i++)
+    {
+	fd = events[i].data.ptr;
+	stream = fd->stream;
+	stream->ufds[fd->index].revents = events[i].events;
+	if (!stream->pending)
+	{
+	    stream->pending = 1;
+	    ready[nready++] = stream;
+	}
+    }
+
+    for (i = 0; i < nready; i++)
+    {
+	stream = ready[i];
+	stream->pending = 0;
+	err = snd_pcm_poll_descriptors_revents(stream->handle, stream->ufds,
+					       stream->count, &revents);
+	for (n = 0; n < stream->count; n++)
+	    stream->ufds[n].revents = 0;
+	if (err < 0 || revents == 0)
+	    continue;
+	stream->wakeups++;
+	err = stream->ready(stream, revents);
+	if (err < 0)
+	{
+	    reactor_remove(reactor, stream);
+	    if (first_err == 0)
+		first_err = err;
+	}
+    }
+    return first_err < 0 ? first_err : nready;
+}
+
+
+/**
+ * Close the epoll set. Remove the streams first
+ * @param *reactor reactor
+ */
+void reactor_close(struct reactor *reactor)
+{
+    close(reactor->epfd);
+    reactor->epfd = -1;
+}
+
+#endif
@@ -0,0 +1,357 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <math.h>
+#include "arena.h"
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#define RESAMPLE_LANES 8		/* taps per phase are a multiple of this */
+#define RESAMPLE_MAX_PHASES 2048	/* L of the reduced rate ratio L/M */
+
+/**
+ * Quality and CPU tiers: taps per polyphase branch, cutoff as a fraction
+ * of the lower Nyquist frequency and the Kaiser window beta. The cost
+ * is the tap count in multiply-adds per output sample and channel;
+ * the stopband is about 50, 75 and 90 dB down
+ */
+enum resample_quality
+{
+    RESAMPLE_FAST,
+    RESAMPLE_MEDIUM,
+    RESAMPLE_BEST
+};
+
+struct resample_tier
+{
+    const char *name;
+    unsigned int taps;
+    double cutoff;
+    double beta;
+};
+
+static const struct resample_tier resample_tiers[] = {
+    { "fast",   16, 0.80, 4.5 },
+    { "medium", 32, 0.88, 7.0 },
+    { "best",   64, 0.92, 9.0 },
+};
+
+/**
+ * Streaming polyphase windowed-sinc resampler. The rate ratio is reduced
+ * to out/in = L/M and one filter branch is kept for each of the L output
+ * phases, so every output sample is a single dot product of one branch
+ * with the input history, whatever the ratio. Input is kept planar, one
+ * history per channel, so the dot products run over contiguous floats.
+ */
+struct resampler
+{
+    unsigned int channels;
+    unsigned int in_rate;
+    unsigned int out_rate;
+    unsigned int L;		/* phases, out_rate / gcd */
+    unsigned int M;		/* input step, in_rate / gcd */
+    unsigned int taps;		/* per phase */
+    enum resample_quality quality;
+    float *coeffs;		/* L branches of taps, time reversed */
+    float **hist;		/* per channel: taps - 1 history + input */
+    size_t cap;			/* frames each history holds */
+    size_t fill;		/* frames in the histories */
+    size_t pos;			/* newest input frame of the next output */
+    unsigned int phase;		/* of the next output, in [0, L) */
+};
+
+
+static unsigned int resample_gcd(unsigned int a,
+				 unsigned int b)
+{
+    unsigned int t;
+
+    while (b)
+    {
+	t = a % b;
+	a = b;
+	b = t;
+    }
+    return a;
+}
+
+
+/* zeroth order modified Bessel function, for the Kaiser window */
+static double resample_bessel_i0(double x)
+{
+    double sum = 1, term = 1, q = x * x / 4;
+    int k;
+
+    for (k = 1; k < 50 && term > sum * 1e-12; k++)
+    {
+	term *= q / ((double) k * k);
+	sum += term;
+    }
+    return sum;
+}
+
+
+/**
+ * Look up a quality tier by name
+ * @param *name "fast", "medium" or "best"
+ * @return the tier, or -1 if the name is unknown
+ */
+int resample_quality_from_name(const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(resample_tiers) / sizeof(resample_tiers[0]); i++)
+	if (!strcasecmp(name, resample_tiers[i].name))
+	    return i;
+    return -1;
+}
+
+
+/**
+ * Arena bytes resample_init() takes, to size the arena with
+ * @param channels channels count
+ * @param in_rate input rate
+ * @param out_rate output rate
+ * @param quality tier
+ * @param max_in most input frames passed to one resample_process()
+ * @return bytes, or 0 if the ratio can't be converted
+ */
+size_t resample_arena_size(unsigned int channels,
+			   unsigned int in_rate,
+			   unsigned int out_rate,
+			   enum resample_quality quality,
+			   size_t max_in)
+{
+    unsigned int g, taps = resample_tiers[quality].taps;
+
+    if (in_rate == 0 || out_rate == 0)
+	return 0;
+    g = resample_gcd(in_rate, out_rate);
+    if (out_rate / g > RESAMPLE_MAX_PHASES)
+	return 0;
+    return (size_t) out_rate / g * taps * sizeof(float) + ARENA_ALIGN +
+	channels * (sizeof(float *) + ARENA_ALIGN +
+		    (taps - 1 + max_in) * sizeof(float) + ARENA_ALIGN);
+}
+
+
+/**
+ * Design the filter bank and set up the stream state.
+ * The prototype is a Kaiser windowed sinc L * taps long, cut off below
+ * the lower of the two Nyquist frequencies; each branch is normalised
+ * to unity gain at DC so no phase adds a ripple of its own
+ * @param *r resampler to initialise
+ * @param *arena arena for the filter bank and the histories
+ * @param channels channels count
+ * @param in_rate input rate
+ * @param out_rate output rate
+ * @param quality tier
+ * @param max_in most input frames passed to one resample_process()
+ * @return 0 on success, -EINVAL if the reduced ratio needs more than
+ *         RESAMPLE_MAX_PHASES phases, -ENOMEM if the arena is full
+ */
+int resample_init(struct resampler *r,
+		  struct arena *arena,
+		  unsigned int channels,
+		  unsigned int in_rate,
+		  unsigned int out_rate,
+		  enum resample_quality quality,
+		  size_t max_in)
+{
+    const struct resample_tier *tier = &resample_tiers[quality];
+    unsigned int g, L, M, N, p, i, chn;
+    double fc, center, x, w, t, sum, i0_beta;
+    float *branch;
+
+    if (in_rate == 0 || out_rate == 0 || channels == 0)
+	return -EINVAL;
+    g = resample_gcd(in_rate, out_rate);
+    L = out_rate / g;
+    M = in_rate / g;
+    N = tier->taps;
+    if (L > RESAMPLE_MAX_PHASES)
+	return -EINVAL;
+
+    r->channels = channels;
+    r->in_rate = in_rate;
+    r->out_rate = out_rate;
+    r->L = L;
+    r->M = M;
+    r->taps = N;
+    r->quality = quality;
+    r->cap = N - 1 + max_in;
+    r->coeffs = arena_alloc(arena, (size_t) L * N * sizeof(float), 0);
+    r->hist = arena_alloc(arena, channels * sizeof(float *), 0);
+    if (r->coeffs == NULL || r->hist == NULL)
+	return -ENOMEM;
+    for (chn = 0; chn < channels; chn++)
+    {
+	r->hist[chn] = arena_alloc(arena, r->cap * sizeof(float), 0);
+	if (r->hist[chn] == NULL)
+	    return -ENOMEM;
+    }
+
+    /* cutoff in cycles per input sample, below the lower Nyquist */
+    fc = tier->cutoff * 0.5 * (L < M ? (double) L / M : 1.0);
+    center = ((double) L * N - 1) / 2;
+    i0_beta = resample_bessel_i0(tier->beta);
+    for (p = 0; p < L; p++)
+    {
+	branch = r->coeffs + (size_t) p * N;
+	sum = 0;
+	for (i = 0; i < N; i++)
+	{
+	    /* prototype tap (N - 1 - i) * L + p, reversed to meet the history */
+	    t = (double) (N - 1 - i) * L + p;
+	    x = (t - center) / L;
+	    w = (t - center) / center;
+	    w = resample_bessel_i0(tier->beta * sqrt(w < 1 ? 1 - w * w : 0)) / i0_beta;
+	    branch[i] = 2 * fc * (x == 0 ? 1 : sin(2 * M_PI * fc * x) / (2 * M_PI * fc * x)) * w;
+	    sum += branch[i];
+	}
+	for (i = 0; i < N; i++)
+	    branch[i] /= sum;
+    }
+
+    /* start on a history of silence, the first input frame is the newest */
+    r->fill = N - 1;
+    r->pos = N - 1;
+    r->phase = 0;
+    return 0;
+}
+
+
+/**
+ * Input frames of delay the filter adds, half its length
+ * @param *r resampler
+ * @return frames at the input rate
+ */
+unsigned int resample_latency(const struct resampler *r)
+{
+    return r->taps / 2;
+}
+
+
+/**
+ * Most output frames one resample_process() call can produce
+ * @param *r resampler
+ * @param in_frames input frames passed
+ * @return frames at the output rate
+ */
+size_t resample_max_out(const struct resampler *r,
+			size_t in_frames)
+{
+    return (in_frames * r->L + r->M - 1) / r->M + 1;
+}
+
+
+/*
+ * Inner loop: one branch against the history. The taps are a multiple
+ * of RESAMPLE_LANES and summed in that many independent lanes, which
+ * the compiler vectorizes without reassociating anything; SSE does it
+ * by hand, the branch is aligned, the history slides.
+ */
+static float resample_dot(const float *c,
+			  const float *x,
+			  unsigned int n)
+{
+    unsigned int i;
+#ifdef __SSE__
+    __m128 a = _mm_setzero_ps(), b = _mm_setzero_ps();
+    float acc[4];
+
+    for (i = 0; i < n; i += RESAMPLE_LANES)
+    {
+	a = _mm_add_ps(a, _mm_mul_ps(_mm_load_ps(c + i), _mm_loadu_ps(x + i)));
+	b = _mm_add_ps(b, _mm_mul_ps(_mm_load_ps(c + i + 4), _mm_loadu_ps(x + i + 4)));
+    }
+    _mm_storeu_ps(acc, _mm_add_ps(a, b));
+    return (acc[0] + acc[2]) + (acc[1] + acc[3]);
+#else
+    float acc[RESAMPLE_LANES] = { 0 };
+    unsigned int k;
+
+    for (i = 0; i < n; i += RESAMPLE_LANES)
+	for (k = 0; k < RESAMPLE_LANES; k++)
+	    acc[k] += c[i + k] * x[i + k];
+    return ((acc[0] + acc[4]) + (acc[2] + acc[6])) +
+	((acc[1] + acc[5]) + (acc[3] + acc[7]));
+#endif
+}
+
+
+/**
+ * Convert a block of interleaved float frames. All the input is taken;
+ * every output frame it completes is produced, the rest waits in the
+ * history for the next call
+ * @param *r resampler
+ * @param *in interleaved input frames
+ * @param in_frames input frames, at most the max_in given to init
+ * @param *out interleaved output, room for out_max frames
+ * @param out_max output frames that fit, resample_max_out(in_frames)
+ *        is always enough
+ * @return output frames produced, or -ENOSPC if the input doesn't fit
+ *         in the history because out_max held back earlier output
+ */
+long resample_process(struct resampler *r,
+		      const float *in,
+		      size_t in_frames,
+		      float *out,
+		      size_t out_max)
+{
+    unsigned int channels = r->channels, taps = r->taps, chn;
+    unsigned int step = r->M / r->L, rem = r->M % r->L, phase;
+    size_t i, done = 0, keep, pos;
+    const float *branch;
+    float *h;
+
+    if (r->fill + in_frames > r->cap)
+	return -ENOSPC;
+    for (chn = 0; chn < channels; chn++)
+    {
+	h = r->hist[chn] + r->fill;
+	for (i = 0; i < in_frames; i++)
+	    h[i] = in[i * channels + chn];
+    }
+    r->fill += in_frames;
+
+    /* stream state in locals: the stores to out could alias *r */
+    pos = r->pos;
+    phase = r->phase;
+    while (pos < r->fill && done < out_max)
+    {
+	branch = r->coeffs + (size_t) phase * taps;
+	for (chn = 0; chn < channels; chn++)
+	    out[chn] = resample_dot(branch, r->hist[chn] + pos - (taps - 1), taps);
+	out += channels;
+	done++;
+	/* advance M / L input frames, without a division per output */
+	pos += step;
+	phase += rem;
+	if (phase >= r->L)
+	{
+	    phase -= r->L;
+	    pos++;
+	}
+    }
+    r->pos = pos;
+    r->phase = phase;
+
+    /* slide the history down to what the next output still needs */
+    keep = r->pos - (taps - 1);
+    if (keep > r->fill)
+	keep = r->fill;
+    for (chn = 0; chn < channels; chn++)
+	memmove(r->hist[chn], r->hist[chn] + keep,
+		(r->fill - keep) * sizeof(float));
+    r->fill -= keep;
+    r->pos -= keep;
+    return done;
+}
+
+#endif
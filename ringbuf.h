@@ -0,0 +1,217 @@
+#ifndef RINGBUF_H
+#define RINGBUF_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+/**
+ * Lock-free single-producer/single-consumer ring of audio frames.
+ * Exactly one thread may call ringbuf_write() and exactly one
+ * (other) thread may call ringbuf_read(); the fill level may be
+ * read from anywhere. Capacity is rounded up to a power of two so
+ * positions wrap with a mask instead of a division.
+ */
+struct ringbuf
+{
+    char *data;
+    size_t frame_bytes;		/* bytes per frame */
+    size_t size;		/* capacity in frames, power of two */
+    size_t mask;
+    _Atomic size_t head;	/* next frame to write, producer owned */
+    _Atomic size_t tail;	/* next frame to read, consumer owned */
+    _Atomic unsigned long overflows; /* writes that did not fit */
+    _Atomic unsigned long underflows; /* reads that came up short */
+};
+
+
+/**
+ * Capacity a ring gets for a minimum number of frames
+ * @param frames minimum capacity in frames
+ * @return capacity in frames, the next power of two
+ */
+size_t ringbuf_capacity(size_t frames)
+{
+    size_t size = 1;
+    while (size < frames)
+	size <<= 1;
+    return size;
+}
+
+
+/**
+ * Set up a ring over storage owned by the caller, for instance
+ * carved out of an arena. ringbuf_free() must not be called on it
+ * @param *rb ring to initialise
+ * @param *data storage of ringbuf_capacity(frames) * frame_bytes bytes
+ * @param frames minimum capacity in frames
+ * @param frame_bytes size of one frame in bytes
+ */
+void ringbuf_init_with(struct ringbuf *rb,
+		       void *data,
+		       size_t frames,
+		       size_t frame_bytes)
+{
+    size_t size = ringbuf_capacity(frames);
+    rb->data = data;
+    rb->frame_bytes = frame_bytes;
+    rb->size = size;
+    rb->mask = size - 1;
+    atomic_init(&rb->head, 0);
+    atomic_init(&rb->tail, 0);
+    atomic_init(&rb->overflows, 0);
+    atomic_init(&rb->underflows, 0);
+}
+
+
+/**
+ * Allocate the ring storage
+ * @param *rb ring to initialise
+ * @param frames minimum capacity in frames
+ * @param frame_bytes size of one frame in bytes
+ * @return 0 on success, -ENOMEM if the storage can't be allocated
+ */
+int ringbuf_init(struct ringbuf *rb,
+		 size_t frames,
+		 size_t frame_bytes)
+{
+    void *data = malloc(ringbuf_capacity(frames) * frame_bytes);
+    if (data == NULL)
+	return -ENOMEM;
+    ringbuf_init_with(rb, data, frames, frame_bytes);
+    return 0;
+}
+
+
+/**
+ * Release the ring storage
+ * @param *rb ring to release
+ */
+void ringbuf_free(struct ringbuf *rb)
+{
+    free(rb->data);
+    rb->data = NULL;
+}
+
+
+/**
+ * Number of frames currently queued in the ring
+ * @param *rb ring buffer
+ * @return fill level in frames
+ */
+size_t ringbuf_fill(struct ringbuf *rb)
+{
+    /* load the tail first so a racing consumer can't pass our head */
+    size_t tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
+    return atomic_load_explicit(&rb->head, memory_order_acquire) - tail;
+}
+
+
+/**
+ * Copy frames between linear memory and the ring, splitting the
+ * copy in two where it wraps around the end of the storage
+ * @param *rb ring buffer
+ * @param pos ring position of the first frame
+ * @param *buf linear buffer
+ * @param frames frames to copy
+ * @param to_ring copy direction
+ */
+static void ringbuf_copy(struct ringbuf *rb,
+			 size_t pos,
+			 char *buf,
+			 size_t frames,
+			 int to_ring)
+{
+    size_t off = pos & rb->mask;
+    size_t first = rb->size - off;
+    if (first > frames)
+	first = frames;
+    if (to_ring)
+    {
+	memcpy(rb->data + off * rb->frame_bytes, buf,
+	       first * rb->frame_bytes);
+	memcpy(rb->data, buf + first * rb->frame_bytes,
+	       (frames - first) * rb->frame_bytes);
+    }
+    else
+    {
+	memcpy(buf, rb->data + off * rb->frame_bytes,
+	       first * rb->frame_bytes);
+	memcpy(buf + first * rb->frame_bytes, rb->data,
+	       (frames - first) * rb->frame_bytes);
+    }
+}
+
+
+/**
+ * Queue frames in the ring (producer side).
+ * Frames that don't fit are dropped and counted as an overflow.
+ * @param *rb ring buffer
+ * @param *buf frames to queue
+ * @param frames number of frames in buf
+ * @return number of frames actually queued
+ */
+size_t ringbuf_write(struct ringbuf *rb,
+		     const char *buf,
+		     size_t frames)
+{
+    size_t head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
+    size_t room = rb->size - (head - tail);
+    if (frames > room)
+    {
+	atomic_fetch_add_explicit(&rb->overflows, 1, memory_order_relaxed);
+	frames = room;
+    }
+    ringbuf_copy(rb, head, (char *) buf, frames, 1);
+    atomic_store_explicit(&rb->head, head + frames, memory_order_release);
+    return frames;
+}
+
+
+/**
+ * Dequeue frames from the ring (consumer side).
+ * A read that finds fewer frames than requested takes what there is
+ * and counts an underflow; the caller decides how to pad.
+ * @param *rb ring buffer
+ * @param *buf destination
+ * @param frames number of frames wanted
+ * @return number of frames actually dequeued
+ */
+size_t ringbuf_read(struct ringbuf *rb,
+		    char *buf,
+		    size_t frames)
+{
+    size_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&rb->head, memory_order_acquire);
+    size_t fill = head - tail;
+    if (frames > fill)
+    {
+	atomic_fetch_add_explicit(&rb->underflows, 1, memory_order_relaxed);
+	frames = fill;
+    }
+    ringbuf_copy(rb, tail, buf, frames, 0);
+    atomic_store_explicit(&rb->tail, tail + frames, memory_order_release);
+    return frames;
+}
+
+
+/**
+ * Drop queued frames without copying them (consumer side)
+ * @param *rb ring buffer
+ * @param frames number of frames to discard
+ * @return number of frames discarded
+ */
+size_t ringbuf_skip(struct ringbuf *rb,
+		    size_t frames)
+{
+    size_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&rb->head, memory_order_acquire);
+    if (frames > head - tail)
+	frames = head - tail;
+    atomic_store_explicit(&rb->tail, tail + frames, memory_order_release);
+    return frames;
+}
+
+#endif
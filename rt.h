@@ -0,0 +1,220 @@
+#ifndef RT_H
+#define RT_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE		/* CPU affinity */
+#endif
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define RT_DEFAULT_PRIORITY 80	/* for threads that always want SCHED_FIFO */
+#define RT_STACK_PREFAULT (256 * 1024)	/* stack bytes touched by rt_apply() */
+
+/**
+ * Real-time setup shared by the tools, filled from the command line
+ * by rt_parse_args()
+ */
+struct rt_config
+{
+    int priority;		/* SCHED_FIFO priority, 0 keeps SCHED_OTHER */
+    int cpu;			/* CPU to pin to, -1 for any */
+    int lock;			/* mlockall() and prefault the stack */
+};
+
+
+/**
+ * Print the flags understood by rt_parse_args()
+ * @param *out where to print
+ */
+void rt_usage(FILE *out)
+{
+    fprintf(out,
+	    "--rt-priority N  run with SCHED_FIFO priority N (1-99)\n"
+	    "--rt-cpu N       pin to CPU N\n"
+	    "--rt-mlock       lock memory and prefault the stack\n");
+}
+
+
+/**
+ * Take the real-time flags out of the command line, leaving the rest
+ * in order for the tool's own parsing. Flags are --rt-priority N,
+ * --rt-cpu N (also as --flag=N) and --rt-mlock
+ * @param *argc argument count, updated
+ * @param **argv arguments, updated
+ * @param *cfg configuration, set to defaults and then from the flags
+ */
+void rt_parse_args(int *argc,
+		   char **argv,
+		   struct rt_config *cfg)
+{
+    int i, out = 1, *value;
+    const char *arg, *eq;
+    size_t len;
+
+    cfg->priority = 0;
+    cfg->cpu = -1;
+    cfg->lock = 0;
+    for (i = 1; i < *argc; i++)
+    {
+	arg = argv[i];
+	eq = strchr(arg, '=');
+	len = eq ? (size_t) (eq - arg) : strlen(arg);
+	if (!strcmp(arg, "--rt-mlock"))
+	{
+	    cfg->lock = 1;
+	    continue;
+	}
+	if (len == 13 && !strncmp(arg, "--rt-priority", len))
+	    value = &cfg->priority;
+	else if (len == 8 && !strncmp(arg, "--rt-cpu", len))
+	    value = &cfg->cpu;
+	else
+	{
+	    argv[out++] = argv[i];
+	    continue;
+	}
+	if (eq)
+	    *value = atoi(eq + 1);
+	else if (i + 1 < *argc)
+	    *value = atoi(argv[++i]);
+	else
+	{
+	    printf("ERROR: %s needs a value\n", arg);
+	    exit(1);
+	}
+    }
+    argv[out] = NULL;
+    *argc = out;
+    if (cfg->priority < 0 || cfg->priority > 99)
+    {
+	printf("ERROR: --rt-priority must be between 1 and 99\n");
+	exit(1);
+    }
+}
+
+
+/**
+ * Write every page of a buffer so its first use in the audio path
+ * doesn't page-fault. The buffer is zeroed
+ * @param *buf buffer
+ * @param len buffer size in bytes
+ */
+void rt_prefault(void *buf,
+		 size_t len)
+{
+    memset(buf, 0, len);
+    /* keep the compiler from dropping the stores */
+    __asm__ __volatile__("" : : "r" (buf) : "memory");
+}
+
+
+static void rt_prefault_stack(void)
+{
+    unsigned char stack[RT_STACK_PREFAULT];
+    rt_prefault(stack, sizeof(stack));
+}
+
+
+/**
+ * Pin a thread to one CPU
+ * @param thread thread to pin
+ * @param cpu CPU number, -1 leaves the thread alone
+ * @return 0 on success or a positive error number
+ */
+static int rt_pin(pthread_t thread,
+		  int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0)
+	return 0;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+
+/**
+ * Apply a configuration to the calling thread and the process memory.
+ * Anything not permitted is reported and skipped, so the tool still
+ * runs, just without that protection
+ * @param *cfg configuration
+ */
+void rt_apply(const struct rt_config *cfg)
+{
+    struct sched_param param;
+    int err;
+
+    if (cfg->lock)
+    {
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+	    fprintf(stderr, "WARNING: Can't lock memory (%s), raise the "
+		    "locked memory limit (ulimit -l) or run as root\n",
+		    strerror(errno));
+	rt_prefault_stack();
+    }
+    err = rt_pin(pthread_self(), cfg->cpu);
+    if (err)
+	fprintf(stderr, "WARNING: Can't pin to CPU %d (%s)\n",
+		cfg->cpu, strerror(err));
+    if (cfg->priority > 0)
+    {
+	param.sched_priority = cfg->priority;
+	err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if (err == EPERM)
+	    fprintf(stderr, "WARNING: no permission for SCHED_FIFO, "
+		    "running with normal priority\n");
+	else if (err)
+	    fprintf(stderr, "WARNING: Can't set SCHED_FIFO priority %d (%s)\n",
+		    cfg->priority, strerror(err));
+    }
+}
+
+
+/**
+ * Start a SCHED_FIFO thread, falling back to normal priority
+ * when that isn't permitted
+ * @param *thread returns the thread id
+ * @param priority SCHED_FIFO priority, 0 for a normal thread
+ * @param cpu CPU to pin the thread to, -1 for any
+ * @param *fn thread function
+ * @param *arg passed to fn
+ * @return 0 on success or a positive error number
+ */
+int rt_thread_create(pthread_t *thread,
+		     int priority,
+		     int cpu,
+		     void *(*fn)(void *),
+		     void *arg)
+{
+    pthread_attr_t attr;
+    struct sched_param param;
+    int err = EPERM;
+
+    if (priority > 0)
+    {
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+	param.sched_priority = priority;
+	pthread_attr_setschedparam(&attr, &param);
+	err = pthread_create(thread, &attr, fn, arg);
+	pthread_attr_destroy(&attr);
+	if (err == EPERM)
+	    fprintf(stderr, "WARNING: no permission for SCHED_FIFO, "
+		    "running with normal priority\n");
+    }
+    if (err == EPERM)
+	err = pthread_create(thread, NULL, fn, arg);
+    if (err == 0 && rt_pin(*thread, cpu))
+	fprintf(stderr, "WARNING: Can't pin thread to CPU %d\n", cpu);
+    return err;
+}
+
+#endif
@@ -1,6 +1,7 @@
 /*
  *  This small demo sends a simple sinusoidal wave to your speakers.
  */
+#include "rt.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,8 +10,18 @@
 #include <getopt.h>
 #include <alsa/asoundlib.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <math.h>
-static char *device = "plughw:0,0";                     /* playback device */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/timerfd.h>
+#include "osc.h"
+#include "pcmstats.h"
+#include "reactor.h"
+#include "arena.h"
+#include "fmtconv.h"
+#include "mypcm.h"
+static char *device = "hw:0,0";                         /* playback device */
 static snd_pcm_format_t format = SND_PCM_FORMAT_S16;    /* sample format */
 static unsigned int rate = 44100;                       /* stream rate */
 static unsigned int channels = 1;                       /* count of channels */
@@ -18,73 +29,66 @@ static unsigned int buffer_time = 500000;               /* ring buffer length in
 static unsigned int period_time = 100000;               /* period time in us */
 static double freq = 440;                               /* sinusoidal wave frequency in Hz */
 static int verbose = 0;                                 /* verbose flag */
-static int resample = 1;                                /* enable alsa-lib resampling */
+static int resample = 0;                                /* alsa-lib resampling, off: native rate */
 static int period_event = 0;                            /* produce poll event after each period */
 static snd_pcm_sframes_t buffer_size;
 static snd_pcm_sframes_t period_size;
 static snd_output_t *output = NULL;
+static snd_pcm_uframes_t bench_frames = 0;              /* stop after this many frames (bench mode) */
+static struct rt_config rt;                             /* real-time setup from the command line */
+static struct kernel_config kernel;                     /* sample kernels from the command line */
+static struct osc_gen gen;                              /* sine writer for the negotiated setup */
+static int loop_mode = 0;                               /* replay a pre-rendered loop of whole cycles */
+static struct osc_loop loop;
+#define LOOP_MAX_BYTES (8 * 1024 * 1024)                /* longest loop, approximated beyond */
+static struct arena arena;                              /* all stream memory, reserved up front */
+static int hugepages = 0;                               /* back the arena with huge pages */
+static int tsched = 0;                                  /* timer scheduling, no period wakeups */
+static volatile sig_atomic_t cut_latency = 0;           /* SIGUSR2: halve the tsched fill target */
+/*
+ *   Per method counters for the transfer method comparison (-B)
+ */
+struct bench_stats {
+  volatile snd_pcm_uframes_t frames;    /* frames handed to the device */
+  unsigned long calls;                  /* alsa calls that may enter the kernel */
+  unsigned long periods;
+  double last;                          /* time the previous period was handed over */
+  double sum, sumsq;                    /* period to period interval statistics */
+};
+static struct bench_stats bench;
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+static int transfer_done(void)
+{
+  return bench_frames && bench.frames >= bench_frames;
+}
+static void count_period(snd_pcm_uframes_t frames)
+{
+  double t = now();
+  bench.frames += frames;
+  /* skip the initial buffer fill, which runs back to back */
+  if (bench.frames > (snd_pcm_uframes_t)buffer_size) {
+    bench.periods++;
+    bench.sum += t - bench.last;
+    bench.sumsq += (t - bench.last) * (t - bench.last);
+  }
+  bench.last = t;
+}
+/* the phase the running transfer loop advances, for the restart fill */
+static double *live_phase;
 static void generate_sine(const snd_pcm_channel_area_t *areas, 
                           snd_pcm_uframes_t offset,
                           int count, double *_phase)
 {
-  static double max_phase = 2. * M_PI;
-  double phase = *_phase;
-  double step = max_phase*freq/(double)rate;
-  unsigned char *samples[channels];
-  int steps[channels];
-  unsigned int chn;
-  int format_bits = snd_pcm_format_width(format);
-  unsigned int maxval = (1 << (format_bits - 1)) - 1;
-  int bps = format_bits / 8;  /* bytes per sample */
-  int phys_bps = snd_pcm_format_physical_width(format) / 8;
-  int big_endian = snd_pcm_format_big_endian(format) == 1;
-  int to_unsigned = snd_pcm_format_unsigned(format) == 1;
-  int is_float = (format == SND_PCM_FORMAT_FLOAT_LE ||
-		  format == SND_PCM_FORMAT_FLOAT_BE);
-  /* verify and prepare the contents of areas */
-  for (chn = 0; chn < channels; chn++) {
-    if ((areas[chn].first % 8) != 0) {
-      printf("areas[%i].first == %i, aborting...\n", chn, areas[chn].first);
-      exit(EXIT_FAILURE);
-    }
-    samples[chn] = /*(signed short *)*/(((unsigned char *)areas[chn].addr) + (areas[chn].first / 8));
-    if ((areas[chn].step % 16) != 0) {
-      printf("areas[%i].step == %i, aborting...\n", chn, areas[chn].step);
-      exit(EXIT_FAILURE);
-    }
-    steps[chn] = areas[chn].step / 8;
-    samples[chn] += offset * steps[chn];
-  }
-  /* fill the channel areas */
-  while (count-- > 0) {
-    union {
-      float f;
-      int i;
-    } fval;
-    int res, i;
-    if (is_float) {
-      fval.f = sin(phase) * maxval;
-      res = fval.i;
-    } else
-      res = sin(phase) * maxval;
-    if (to_unsigned)
-      res ^= 1U << (format_bits - 1);
-    for (chn = 0; chn < channels; chn++) {
-      /* Generate data in native endian format */
-      if (big_endian) {
-	for (i = 0; i < bps; i++)
-	  *(samples[chn] + phys_bps - 1 - i) = (res >> i * 8) & 0xff;
-      } else {
-	for (i = 0; i < bps; i++)
-	  *(samples[chn] + i) = (res >>  i * 8) & 0xff;
-      }
-      samples[chn] += steps[chn];
-    }
-    phase += step;
-    if (phase >= max_phase)
-      phase -= max_phase;
-  }
-  *_phase = phase;
+  live_phase = _phase;
+  if (loop_mode)
+    osc_loop_run(&loop, areas, offset, count);
+  else
+    osc_gen_run(&gen, areas, offset, count, _phase);
 }
 
 static int set_hwparams(snd_pcm_t *handle,
@@ -93,7 +97,7 @@ static int set_hwparams(snd_pcm_t *handle,
 {
   unsigned int rrate;
   snd_pcm_uframes_t size;
-  int err, dir;
+  int err, dir, k;
   /* choose all parameters */
   err = snd_pcm_hw_params_any(handle, params);
   if (err < 0) {
@@ -112,6 +116,17 @@ static int set_hwparams(snd_pcm_t *handle,
     printf("Access type not available for playback: %s\n", snd_strerror(err));
     return err;
   }
+  /* a format the device doesn't take is generated in one it does */
+  if (!resample && snd_pcm_hw_params_test_format(handle, params, format) < 0) {
+    for (k = 0; fmtconv_preferred[k] != SND_PCM_FORMAT_UNKNOWN; k++)
+      if (snd_pcm_hw_params_test_format(handle, params, fmtconv_preferred[k]) == 0)
+        break;
+    if (fmtconv_preferred[k] != SND_PCM_FORMAT_UNKNOWN) {
+      printf("Sample format %s is not native, playing %s\n",
+             snd_pcm_format_name(format), snd_pcm_format_name(fmtconv_preferred[k]));
+      format = fmtconv_preferred[k];
+    }
+  }
   /* set the sample format */
   err = snd_pcm_hw_params_set_format(handle, params, format);
   if (err < 0) {
@@ -131,6 +146,11 @@ static int set_hwparams(snd_pcm_t *handle,
     printf("Rate %iHz not available for playback: %s\n", rate, snd_strerror(err));
     return err;
   }
+  if (rrate != rate && !resample) {
+    /* a sine needs no conversion, generate it at the rate the device runs */
+    printf("Rate %iHz is not native, playing at %iHz\n", rate, rrate);
+    rate = rrate;
+  }
   if (rrate != rate) {
     printf("Rate doesn't match (requested %iHz, get %iHz)\n", rate, err);
     return -EINVAL;
@@ -159,6 +179,12 @@ static int set_hwparams(snd_pcm_t *handle,
     return err;
   }
   period_size = size;
+  /* timer scheduling wakes itself, period interrupts are only overhead */
+  if (tsched) {
+    err = snd_pcm_hw_params_set_period_wakeup(handle, params, 0);
+    if (err < 0 && verbose)
+      printf("Unable to disable period wakeups, keeping them: %s\n", snd_strerror(err));
+  }
   /* write the parameters to device */
   err = snd_pcm_hw_params(handle, params);
   if (err < 0) {
@@ -185,7 +211,7 @@ static int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams)
   }
   /* allow the transfer when at least period_size samples can be processed */
   /* or disable this mechanism when period event is enabled (aka interrupt like style processing) */
-  err = snd_pcm_sw_params_set_avail_min(handle, swparams, period_event ? buffer_size : period_size);
+  err = snd_pcm_sw_params_set_avail_min(handle, swparams, period_event || tsched ? buffer_size : period_size);
   if (err < 0) {
     printf("Unable to set avail min for playback: %s\n", snd_strerror(err));
     return err;
@@ -198,6 +224,14 @@ static int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams)
       return err;
     }
   }
+  /* timer scheduling reads positions with monotonic timestamps */
+  if (tsched) {
+    err = snd_pcm_sw_params_set_tstamp_mode(handle, swparams, SND_PCM_TSTAMP_ENABLE);
+    if (err >= 0)
+      err = snd_pcm_sw_params_set_tstamp_type(handle, swparams, SND_PCM_TSTAMP_TYPE_MONOTONIC);
+    if (err < 0 && verbose)
+      printf("Unable to enable monotonic timestamps: %s\n", snd_strerror(err));
+  }
   /* write the parameters to the playback device */
   err = snd_pcm_sw_params(handle, swparams);
   if (err < 0) {
@@ -208,29 +242,160 @@ static int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams)
 }
 /*
  *   Underrun and suspend recovery
+ *
+ *   A small state machine: resume a suspended stream, or prepare it,
+ *   then queue a fill so the stream restarts after one more period
+ *   instead of a whole buffer of freshly generated ones. The fill
+ *   buffer is set up with the stream; the fill itself is rendered from
+ *   where the tone stands, and the tone moves on by what was queued.
+ *   While the device is still suspended it is waited for with
+ *   recovery_wait() (mypcm.h), with a backoff bounded by
+ *   RECOVER_BACKOFF_MAX, rather than sleep(1). The time each recovery
+ *   takes goes to the stats.
  */
- 
-static int xrun_recovery(snd_pcm_t *handle, int err)
+enum recovery_state {
+  RECOVER_RESUME,
+  RECOVER_PREPARE,
+  RECOVER_FILL,
+  RECOVER_DONE
+};
+struct recovery {
+  enum recovery_state state;
+  int backoff;                          /* ms to wait on the next -EAGAIN */
+  int quiet;                            /* on the real-time thread: no printing */
+};
+static struct restart_fill {
+  void *data;                           /* fill frames, interleaved or not */
+  void **bufs;                          /* per channel, non-interleaved access */
+  snd_pcm_channel_area_t *areas;        /* over data */
+  snd_pcm_uframes_t frames;             /* queued after a prepare, below the start threshold */
+  snd_pcm_access_t access;
+} restart;
+static void restart_init(snd_pcm_access_t access)
 {
-  if (verbose)
-    printf("stream recovery\n");
-  if (err == -EPIPE) {    /* under-run */
+  unsigned int chn, width = snd_pcm_format_physical_width(format);
+  snd_pcm_channel_area_t *fill_areas;
+  restart.access = access;
+  live_phase = NULL;
+  restart.frames = buffer_size / period_size > 1 ? (buffer_size / period_size - 1) * period_size : 0;
+  /* avail_min is the whole buffer with period events, a poll would never wake */
+  if (period_event)
+    restart.frames = 0;
+  restart.data = arena_alloc(&arena, restart.frames * channels * width / 8, 0);
+  restart.bufs = arena_alloc(&arena, channels * sizeof(void *), 0);
+  fill_areas = arena_alloc(&arena, channels * sizeof(snd_pcm_channel_area_t), 0);
+  restart.areas = fill_areas;
+  if (restart.data == NULL || restart.bufs == NULL || fill_areas == NULL) {
+    restart.frames = 0;
+    return;
+  }
+  for (chn = 0; chn < channels; chn++) {
+    if (access == SND_PCM_ACCESS_MMAP_NONINTERLEAVED) {
+      restart.bufs[chn] = (char *)restart.data + chn * restart.frames * width / 8;
+      fill_areas[chn].addr = restart.bufs[chn];
+      fill_areas[chn].first = 0;
+      fill_areas[chn].step = width;
+    } else {
+      fill_areas[chn].addr = restart.data;
+      fill_areas[chn].first = chn * width;
+      fill_areas[chn].step = channels * width;
+    }
+  }
+}
+/*
+ *   One step of a recovery: 0 when done, the ms to wait before the
+ *   next step, or an error code
+ */
+static int recovery_step(snd_pcm_t *handle, struct recovery *rec)
+{
+  snd_pcm_sframes_t n;
+  double phase;
+  int err, wait;
+  switch (rec->state) {
+  case RECOVER_RESUME:
+    err = snd_pcm_resume(handle);
+    if (err == -EAGAIN) {       /* the suspend flag is not released yet */
+      wait = rec->backoff;
+      if (rec->backoff < RECOVER_BACKOFF_MAX)
+        rec->backoff *= 2;
+      return wait;
+    }
+    if (err == 0) {             /* resumed where it stopped, buffer intact */
+      rec->state = RECOVER_DONE;
+      return 0;
+    }
+    rec->state = RECOVER_PREPARE;
+    /* fall through: no resume support, restart from scratch */
+  case RECOVER_PREPARE:
     err = snd_pcm_prepare(handle);
-    if (err < 0)
-      printf("Can't recovery from underrun, prepare failed: %s\n", snd_strerror(err));
-    return 0;
-  } else if (err == -ESTRPIPE) {
-    while ((err = snd_pcm_resume(handle)) == -EAGAIN)
-      sleep(1);       /* wait until the suspend flag is released */
     if (err < 0) {
-      err = snd_pcm_prepare(handle);
-      if (err < 0)
-	printf("Can't recovery from suspend, prepare failed: %s\n", snd_strerror(err));
+      if (!rec->quiet)
+        printf("Can't recovery, prepare failed: %s\n", snd_strerror(err));
+      return err;
     }
+    rec->state = RECOVER_FILL;
+    /* fall through */
+  case RECOVER_FILL:
+    rec->state = RECOVER_DONE;
+    if (restart.frames == 0)
+      return 0;
+    /* carry on the tone; not through generate_sine(), this phase is a copy */
+    phase = live_phase ? *live_phase : 0;
+    if (loop_mode)
+      osc_loop_run(&loop, restart.areas, 0, restart.frames);
+    else
+      osc_gen_run(&gen, restart.areas, 0, restart.frames, &phase);
+    if (restart.access == SND_PCM_ACCESS_RW_INTERLEAVED)
+      n = snd_pcm_writei(handle, restart.data, restart.frames);
+    else if (restart.access == SND_PCM_ACCESS_MMAP_NONINTERLEAVED)
+      n = snd_pcm_mmap_writen(handle, restart.bufs, restart.frames);
+    else
+      n = snd_pcm_mmap_writei(handle, restart.data, restart.frames);
+    bench.calls++;
+    /* the loops generate the rest themselves, a failed fill costs nothing */
+    if (n < 0 && verbose && !rec->quiet)
+      printf("Restart fill failed: %s\n", snd_strerror(n));
+    /* the tone only moves on by the frames queued */
+    n = n < 0 ? 0 : n;
+    if (loop_mode)
+      osc_loop_rewind(&loop, restart.frames - n);
+    else if (live_phase)
+      *live_phase = n == (snd_pcm_sframes_t)restart.frames ? phase :
+        fmod(*live_phase + n * gen.step, 2. * M_PI);
     return 0;
+  case RECOVER_DONE:
+    break;
+  }
+  return 0;
+}
+/*
+ *   A whole recovery; quiet on the real-time callback thread, which
+ *   hands its errors to the main thread instead of printing them
+ */
+static int recovery_run(snd_pcm_t *handle, int err, int quiet)
+{
+  struct recovery rec;
+  double start = now();
+  pcm_stats_error(&pcm_stats_playback, err);
+  if (err != -EPIPE && err != -ESTRPIPE)
+    return err;
+  if (verbose && !quiet)
+    printf("stream recovery\n");
+  rec.state = err == -EPIPE ? RECOVER_PREPARE : RECOVER_RESUME;
+  rec.backoff = RECOVER_BACKOFF_MIN;
+  rec.quiet = quiet;
+  while ((err = recovery_step(handle, &rec)) > 0) {
+    recovery_wait(handle, err);
+    bench.calls++;
   }
+  if (err == 0)
+    pcm_stats_recovery(&pcm_stats_playback, (now() - start) * 1e6);
   return err;
 }
+static int xrun_recovery(snd_pcm_t *handle, int err)
+{
+  return recovery_run(handle, err, 0);
+}
 /*
  *   Transfer method - write only
  */
@@ -239,14 +404,16 @@ static int write_loop(snd_pcm_t *handle,
                       snd_pcm_channel_area_t *areas)
 {
   double phase = 0;
-  signed short *ptr;
+  char *ptr;
   int err, cptr;
-  while (1) {
+  while (!transfer_done()) {
+    pcm_stats_wakeup(&pcm_stats_playback, handle);
     generate_sine(areas, 0, period_size, &phase);
-    ptr = samples;
+    ptr = (char *)samples;
     cptr = period_size;
     while (cptr > 0) {
       err = snd_pcm_writei(handle, ptr, cptr);
+      bench.calls++;
       if (err == -EAGAIN)
 	continue;
       if (err < 0) {
@@ -256,10 +423,12 @@ static int write_loop(snd_pcm_t *handle,
 	}
 	break;  /* skip one period */
       }
-      ptr += err * channels;
+      ptr += snd_pcm_frames_to_bytes(handle, err);
       cptr -= err;
     }
+    count_period(period_size);
   }
+  return 0;
 }
  
 /*
@@ -270,6 +439,7 @@ static int wait_for_poll(snd_pcm_t *handle, struct pollfd *ufds, unsigned int co
   unsigned short revents;
   while (1) {
     poll(ufds, count, -1);
+    bench.calls++;
     snd_pcm_poll_descriptors_revents(handle, ufds, count, &revents);
     if (revents & POLLERR)
       return -EIO;
@@ -283,14 +453,14 @@ static int write_and_poll_loop(snd_pcm_t *handle,
 {
   struct pollfd *ufds;
   double phase = 0;
-  signed short *ptr;
+  char *ptr;
   int err, count, cptr, init;
   count = snd_pcm_poll_descriptors_count (handle);
   if (count <= 0) {
     printf("Invalid poll descriptors count\n");
     return count;
   }
-  ufds = malloc(sizeof(struct pollfd) * count);
+  ufds = arena_alloc(&arena, sizeof(struct pollfd) * count, 0);
   if (ufds == NULL) {
     printf("No enough memory\n");
     return -ENOMEM;
@@ -300,7 +470,7 @@ static int write_and_poll_loop(snd_pcm_t *handle,
     return err;
   }
   init = 1;
-  while (1) {
+  while (!transfer_done()) {
     if (!init) {
       err = wait_for_poll(handle, ufds, count);
       if (err < 0) {
@@ -318,11 +488,13 @@ static int write_and_poll_loop(snd_pcm_t *handle,
 	}
       }
     }
+    pcm_stats_wakeup(&pcm_stats_playback, handle);
     generate_sine(areas, 0, period_size, &phase);
-    ptr = samples;
+    ptr = (char *)samples;
     cptr = period_size;
     while (cptr > 0) {
       err = snd_pcm_writei(handle, ptr, cptr);
+      bench.calls++;
       if (err < 0) {
 	if (xrun_recovery(handle, err) < 0) {
 	  printf("Write error: %s\n", snd_strerror(err));
@@ -333,7 +505,7 @@ static int write_and_poll_loop(snd_pcm_t *handle,
       }
       if (snd_pcm_state(handle) == SND_PCM_STATE_RUNNING)
 	init = 0;
-      ptr += err * channels;
+      ptr += snd_pcm_frames_to_bytes(handle, err);
       cptr -= err;
       if (cptr == 0)
 	break;
@@ -355,7 +527,9 @@ static int write_and_poll_loop(snd_pcm_t *handle,
 	}
       }
     }
+    count_period(period_size);
   }
+  return 0;
 }
 /*
  *   Transfer method - asynchronous notification
@@ -374,10 +548,13 @@ static void async_callback(snd_async_handler_t *ahandler)
   snd_pcm_sframes_t avail;
   int err;
         
+  pcm_stats_sample(&pcm_stats_playback, handle);
   avail = snd_pcm_avail_update(handle);
+  bench.calls++;
   while (avail >= period_size) {
     generate_sine(areas, 0, period_size, &data->phase);
     err = snd_pcm_writei(handle, samples, period_size);
+    bench.calls++;
     if (err < 0) {
       printf("Write error: %s\n", snd_strerror(err));
       exit(EXIT_FAILURE);
@@ -386,7 +563,9 @@ static void async_callback(snd_async_handler_t *ahandler)
       printf("Write error: written %i expected %li\n", err, period_size);
       exit(EXIT_FAILURE);
     }
+    count_period(period_size);
     avail = snd_pcm_avail_update(handle);
+    bench.calls++;
   }
 }
 static int async_loop(snd_pcm_t *handle,
@@ -402,7 +581,7 @@ static int async_loop(snd_pcm_t *handle,
   err = snd_async_add_pcm_handler(&ahandler, handle, async_callback, &data);
   if (err < 0) {
     printf("Unable to register async handler\n");
-    exit(EXIT_FAILURE);
+    return err;
   }
   for (count = 0; count < 2; count++) {
     generate_sine(areas, 0, period_size, &data.phase);
@@ -415,6 +594,7 @@ static int async_loop(snd_pcm_t *handle,
       printf("Initial write error: written %i expected %li\n", err, period_size);
       exit(EXIT_FAILURE);
     }
+    count_period(period_size);
   }
   if (snd_pcm_state(handle) == SND_PCM_STATE_PREPARED) {
     err = snd_pcm_start(handle);
@@ -425,9 +605,12 @@ static int async_loop(snd_pcm_t *handle,
   }
   /* because all other work is done in the signal handler,
      suspend the process */
-  while (1) {
+  while (!transfer_done()) {
     sleep(1);
+    pcm_stats_service();
   }
+  snd_async_del_handler(ahandler);
+  return 0;
 }
 /*
  *   Transfer method - asynchronous notification + direct write
@@ -459,6 +642,7 @@ static void async_direct_callback(snd_async_handler_t *ahandler)
       }
     }
     avail = snd_pcm_avail_update(handle);
+    bench.calls++;
     if (avail < 0) {
       err = xrun_recovery(handle, avail);
       if (err < 0) {
@@ -472,6 +656,7 @@ static void async_direct_callback(snd_async_handler_t *ahandler)
       if (first) {
 	first = 0;
 	err = snd_pcm_start(handle);
+	bench.calls++;
 	if (err < 0) {
 	  printf("Start error: %s\n", snd_strerror(err));
 	  exit(EXIT_FAILURE);
@@ -481,6 +666,7 @@ static void async_direct_callback(snd_async_handler_t *ahandler)
       }
       continue;
     }
+    pcm_stats_sample(&pcm_stats_playback, handle);
     size = period_size;
     while (size > 0) {
       frames = size;
@@ -494,6 +680,7 @@ static void async_direct_callback(snd_async_handler_t *ahandler)
       }
       generate_sine(my_areas, offset, frames, &data->phase);
       commitres = snd_pcm_mmap_commit(handle, offset, frames);
+      bench.calls++;
       if (commitres < 0 || (snd_pcm_uframes_t)commitres != frames) {
 	if ((err = xrun_recovery(handle, commitres >= 0 ? -EPIPE : commitres)) < 0) {
 	  printf("MMAP commit error: %s\n", snd_strerror(err));
@@ -503,6 +690,7 @@ static void async_direct_callback(snd_async_handler_t *ahandler)
       }
       size -= frames;
     }
+    count_period(period_size);
   }
 }
 static int async_direct_loop(snd_pcm_t *handle,
@@ -521,7 +709,7 @@ static int async_direct_loop(snd_pcm_t *handle,
   err = snd_async_add_pcm_handler(&ahandler, handle, async_direct_callback, &data);
   if (err < 0) {
     printf("Unable to register async handler\n");
-    exit(EXIT_FAILURE);
+    return err;
   }
   for (count = 0; count < 2; count++) {
     size = period_size;
@@ -544,6 +732,7 @@ static int async_direct_loop(snd_pcm_t *handle,
       }
       size -= frames;
     }
+    count_period(period_size);
   }
   err = snd_pcm_start(handle);
   if (err < 0) {
@@ -552,9 +741,12 @@ static int async_direct_loop(snd_pcm_t *handle,
   }
   /* because all other work is done in the signal handler,
      suspend the process */
-  while (1) {
+  while (!transfer_done()) {
     sleep(1);
+    pcm_stats_service();
   }
+  snd_async_del_handler(ahandler);
+  return 0;
 }
 /*
  *   Transfer method - direct write only
@@ -569,7 +761,7 @@ static int direct_loop(snd_pcm_t *handle,
   snd_pcm_sframes_t avail, commitres;
   snd_pcm_state_t state;
   int err, first = 1;
-  while (1) {
+  while (!transfer_done()) {
     state = snd_pcm_state(handle);
     if (state == SND_PCM_STATE_XRUN) {
       err = xrun_recovery(handle, -EPIPE);
@@ -586,6 +778,7 @@ static int direct_loop(snd_pcm_t *handle,
       }
     }
     avail = snd_pcm_avail_update(handle);
+    bench.calls++;
     if (avail < 0) {
       err = xrun_recovery(handle, avail);
       if (err < 0) {
@@ -599,12 +792,14 @@ static int direct_loop(snd_pcm_t *handle,
       if (first) {
 	first = 0;
 	err = snd_pcm_start(handle);
+	bench.calls++;
 	if (err < 0) {
 	  printf("Start error: %s\n", snd_strerror(err));
 	  exit(EXIT_FAILURE);
 	}
       } else {
 	err = snd_pcm_wait(handle, -1);
+	bench.calls++;
 	if (err < 0) {
 	  if ((err = xrun_recovery(handle, err)) < 0) {
 	    printf("snd_pcm_wait error: %s\n", snd_strerror(err));
@@ -615,6 +810,7 @@ static int direct_loop(snd_pcm_t *handle,
       }
       continue;
     }
+    pcm_stats_wakeup(&pcm_stats_playback, handle);
     size = period_size;
     while (size > 0) {
       frames = size;
@@ -628,6 +824,7 @@ static int direct_loop(snd_pcm_t *handle,
       }
       generate_sine(my_areas, offset, frames, &phase);
       commitres = snd_pcm_mmap_commit(handle, offset, frames);
+      bench.calls++;
       if (commitres < 0 || (snd_pcm_uframes_t)commitres != frames) {
 	if ((err = xrun_recovery(handle, commitres >= 0 ? -EPIPE : commitres)) < 0) {
 	  printf("MMAP commit error: %s\n", snd_strerror(err));
@@ -637,7 +834,9 @@ static int direct_loop(snd_pcm_t *handle,
       }
       size -= frames;
     }
+    count_period(period_size);
   }
+  return 0;
 }
  
 /*
@@ -648,14 +847,16 @@ static int direct_write_loop(snd_pcm_t *handle,
                              snd_pcm_channel_area_t *areas)
 {
   double phase = 0;
-  signed short *ptr;
+  char *ptr;
   int err, cptr;
-  while (1) {
+  while (!transfer_done()) {
+    pcm_stats_wakeup(&pcm_stats_playback, handle);
     generate_sine(areas, 0, period_size, &phase);
-    ptr = samples;
+    ptr = (char *)samples;
     cptr = period_size;
     while (cptr > 0) {
       err = snd_pcm_mmap_writei(handle, ptr, cptr);
+      bench.calls++;
       if (err == -EAGAIN)
 	continue;
       if (err < 0) {
@@ -665,10 +866,394 @@ static int direct_write_loop(snd_pcm_t *handle,
 	}
 	break;  /* skip one period */
       }
-      ptr += err * channels;
+      ptr += snd_pcm_frames_to_bytes(handle, err);
       cptr -= err;
     }
+    count_period(period_size);
   }
+  return 0;
+}
+ 
+/*
+ *   Transfer method - write from an epoll reactor callback
+ *   (one stream here, but the same reactor serves any number of them)
+ */
+static int epoll_callback(struct reactor_stream *stream, unsigned short revents)
+{
+  snd_pcm_t *handle = stream->handle;
+  struct async_private_data *data = stream->data;
+  snd_pcm_sframes_t avail;
+  snd_pcm_state_t state;
+  int err;
+  if (revents & POLLERR) {
+    state = snd_pcm_state(handle);
+    if (state != SND_PCM_STATE_XRUN && state != SND_PCM_STATE_SUSPENDED)
+      return -EIO;
+    err = xrun_recovery(handle, state == SND_PCM_STATE_XRUN ? -EPIPE : -ESTRPIPE);
+    if (err < 0)
+      printf("XRUN recovery failed: %s\n", snd_strerror(err));
+    return err;
+  }
+  avail = snd_pcm_avail_update(handle);
+  bench.calls++;
+  if (avail < 0)
+    return xrun_recovery(handle, avail);
+  pcm_stats_wakeup(&pcm_stats_playback, handle);
+  while (avail >= period_size && !transfer_done()) {
+    generate_sine(data->areas, 0, period_size, &data->phase);
+    err = snd_pcm_writei(handle, data->samples, period_size);
+    bench.calls++;
+    if (err < 0)
+      return xrun_recovery(handle, err);
+    count_period(err);
+    avail -= err;
+  }
+  return 0;
+}
+static int epoll_loop(snd_pcm_t *handle,
+                      signed short *samples,
+                      snd_pcm_channel_area_t *areas)
+{
+  struct async_private_data data;
+  struct reactor reactor;
+  struct reactor_stream stream;
+  int err;
+  data.samples = samples;
+  data.areas = areas;
+  data.phase = 0;
+  if ((err = reactor_init(&reactor)) < 0) {
+    printf("Unable to create epoll set: %s\n", snd_strerror(err));
+    return err;
+  }
+  if ((err = reactor_add(&reactor, &stream, &arena, handle, epoll_callback, &data)) < 0) {
+    printf("Unable to register poll descriptors: %s\n", snd_strerror(err));
+    reactor_close(&reactor);
+    return err;
+  }
+  while (!transfer_done() && reactor.streams > 0) {
+    err = reactor_run_once(&reactor, -1);
+    bench.calls++;
+    if (err < 0) {
+      printf("Stream failed: %s\n", snd_strerror(err));
+      break;
+    }
+  }
+  reactor_remove(&reactor, &stream);
+  reactor_close(&reactor);
+  return err < 0 ? err : 0;
+}
+ 
+/*
+ *   Transfer method - fill callback on a dedicated real-time thread,
+ *   woken by the PCM poll descriptors or by a timerfd. Nothing on the
+ *   thread prints or exits: errors are handed to the main thread, and
+ *   xruns and suspends go through the recovery of the other methods,
+ *   restart fill included, silently, and are counted in the stats.
+ */
+struct callback_data {
+  snd_pcm_t *handle;
+  signed short *samples;
+  snd_pcm_channel_area_t *areas;
+  double phase;
+  struct pollfd *ufds;            /* PCM descriptors, or the timerfd alone */
+  int count;
+  int timerfd;                    /* -1 when woken by the PCM */
+  _Atomic int error;              /* first fatal error, for the main thread */
+  _Atomic int done;
+};
+static int callback_recover(struct callback_data *data, int err)
+{
+  if (err == -EINTR)
+    return 0;
+  return recovery_run(data->handle, err, 1);
+}
+static int callback_fill(struct callback_data *data)
+{
+  snd_pcm_sframes_t avail;
+  int err;
+  avail = snd_pcm_avail_update(data->handle);
+  bench.calls++;
+  if (avail < 0)
+    return callback_recover(data, avail);
+  pcm_stats_sample(&pcm_stats_playback, data->handle);
+  while (avail >= period_size && !transfer_done()) {
+    generate_sine(data->areas, 0, period_size, &data->phase);
+    err = snd_pcm_writei(data->handle, data->samples, period_size);
+    bench.calls++;
+    if (err < 0)
+      return callback_recover(data, err);
+    count_period(err);
+    avail -= err;
+  }
+  return 0;
+}
+static int callback_wait(struct callback_data *data)
+{
+  unsigned short revents;
+  uint64_t ticks;
+  snd_pcm_state_t state;
+  if (poll(data->ufds, data->count, -1) < 0)
+    return errno == EINTR ? 0 : -errno;
+  bench.calls++;
+  if (data->timerfd >= 0)
+    return read(data->timerfd, &ticks, sizeof(ticks)) < 0 && errno != EAGAIN ? -errno : 0;
+  snd_pcm_poll_descriptors_revents(data->handle, data->ufds, data->count, &revents);
+  if (revents & POLLERR) {
+    state = snd_pcm_state(data->handle);
+    if (state != SND_PCM_STATE_XRUN && state != SND_PCM_STATE_SUSPENDED)
+      return -EIO;
+    return callback_recover(data, state == SND_PCM_STATE_XRUN ? -EPIPE : -ESTRPIPE);
+  }
+  return 0;
+}
+static void *callback_thread(void *arg)
+{
+  struct callback_data *data = arg;
+  int err = 0;
+  while (!transfer_done()) {
+    err = callback_fill(data);
+    if (err >= 0)
+      err = callback_wait(data);
+    if (err < 0)
+      break;
+  }
+  atomic_store(&data->error, err < 0 ? err : 0);
+  atomic_store(&data->done, 1);
+  return NULL;
+}
+static int callback_start_thread(pthread_t *thread, struct callback_data *data)
+{
+  return -rt_thread_create(thread, rt.priority ? rt.priority : RT_DEFAULT_PRIORITY,
+                           rt.cpu, callback_thread, data);
+}
+static int callback_run(snd_pcm_t *handle,
+                        signed short *samples,
+                        snd_pcm_channel_area_t *areas,
+                        int timer)
+{
+  struct callback_data data;
+  struct itimerspec its;
+  long long ns;
+  pthread_t thread;
+  int err;
+  data.handle = handle;
+  data.samples = samples;
+  data.areas = areas;
+  data.phase = 0;
+  data.timerfd = -1;
+  atomic_init(&data.error, 0);
+  atomic_init(&data.done, 0);
+  if (timer) {
+    data.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (data.timerfd < 0) {
+      err = -errno;
+      printf("Unable to create timerfd: %s\n", snd_strerror(err));
+      return err;
+    }
+    /* tick twice per period, so a tick landing just short of a */
+    /* full period of room costs half a period, not a whole one */
+    ns = period_size * 1000000000LL / rate / 2;
+    its.it_interval.tv_sec = ns / 1000000000LL;
+    its.it_interval.tv_nsec = ns % 1000000000LL;
+    its.it_value = its.it_interval;
+    timerfd_settime(data.timerfd, 0, &its, NULL);
+    data.count = 1;
+  } else {
+    data.count = snd_pcm_poll_descriptors_count(handle);
+    if (data.count <= 0) {
+      printf("Invalid poll descriptors count\n");
+      return data.count < 0 ? data.count : -EINVAL;
+    }
+  }
+  data.ufds = arena_alloc(&arena, sizeof(struct pollfd) * data.count, 0);
+  if (data.ufds == NULL) {
+    printf("No enough memory\n");
+    err = -ENOMEM;
+    goto out;
+  }
+  if (timer) {
+    data.ufds[0].fd = data.timerfd;
+    data.ufds[0].events = POLLIN;
+  } else if ((err = snd_pcm_poll_descriptors(handle, data.ufds, data.count)) < 0) {
+    printf("Unable to obtain poll descriptors for playback: %s\n", snd_strerror(err));
+    goto out;
+  }
+  if ((err = callback_start_thread(&thread, &data)) < 0) {
+    printf("Unable to create callback thread: %s\n", snd_strerror(err));
+    goto out;
+  }
+  /* the main thread only does the slow work: stats dumps and reporting */
+  while (!atomic_load(&data.done)) {
+    usleep(10000);
+    pcm_stats_service();
+  }
+  pthread_join(thread, NULL);
+  err = atomic_load(&data.error);
+  if (err < 0)
+    printf("Callback thread failed: %s\n", snd_strerror(err));
+ out:
+  if (data.timerfd >= 0)
+    close(data.timerfd);
+  return err;
+}
+static int callback_loop(snd_pcm_t *handle,
+                         signed short *samples,
+                         snd_pcm_channel_area_t *areas)
+{
+  return callback_run(handle, samples, areas, 0);
+}
+static int callback_timer_loop(snd_pcm_t *handle,
+                               signed short *samples,
+                               snd_pcm_channel_area_t *areas)
+{
+  return callback_run(handle, samples, areas, 1);
+}
+ 
+/*
+ *   Transfer method - timer scheduling (tsched)
+ *   The buffer is kept filled up to a target level and the loop sleeps
+ *   on a timerfd until the hardware, as positioned by snd_pcm_status(),
+ *   has drained it down to a watermark. The watermark follows the
+ *   observed wakeup jitter and grows after every xrun. SIGUSR2 halves
+ *   the target, rewinding the queued samples instead of waiting for
+ *   them to play out.
+ */
+static void on_cut_latency(int sig ATTRIBUTE_UNUSED)
+{
+  cut_latency = 1;
+}
+static long long ts_ns(const struct timespec *ts)
+{
+  return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+static int tsched_loop(snd_pcm_t *handle,
+                       signed short *samples,
+                       snd_pcm_channel_area_t *areas)
+{
+  const double max_phase = 2. * M_PI;
+  double phase = 0, step = max_phase * freq / rate;
+  snd_pcm_uframes_t target = buffer_size;           /* fill level kept, the latency */
+  snd_pcm_sframes_t floor_wm = rate / 50;           /* 20ms, raised by xruns */
+  snd_pcm_sframes_t watermark = floor_wm, jitter = 0, late;
+  snd_pcm_sframes_t fill, n, rewound;
+  snd_pcm_status_t *status;
+  snd_pcm_state_t state;
+  snd_htimestamp_t tstamp;
+  struct itimerspec its;
+  struct sigaction sa;
+  long long deadline;
+  uint64_t ticks;
+  int timerfd, err = 0, timed = 0;
+  snd_pcm_status_alloca(&status);
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_cut_latency;
+  sa.sa_flags = 0;        /* interrupt the timer wait, cut right away */
+  sigaction(SIGUSR2, &sa, NULL);
+  timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (timerfd < 0) {
+    err = -errno;
+    printf("Unable to create timerfd: %s\n", snd_strerror(err));
+    return err;
+  }
+  memset(&its, 0, sizeof(its));
+  while (!transfer_done()) {
+    if ((err = snd_pcm_status(handle, status)) < 0) {
+      printf("Unable to get status: %s\n", snd_strerror(err));
+      break;
+    }
+    bench.calls++;
+    state = snd_pcm_status_get_state(status);
+    if (state == SND_PCM_STATE_XRUN || state == SND_PCM_STATE_SUSPENDED) {
+      if ((err = xrun_recovery(handle, state == SND_PCM_STATE_XRUN ? -EPIPE : -ESTRPIPE)) < 0) {
+        printf("XRUN recovery failed: %s\n", snd_strerror(err));
+        break;
+      }
+      /* woke too late for the current margin, widen it */
+      if (floor_wm < (snd_pcm_sframes_t)target / 4)
+        floor_wm *= 2;
+      timed = 0;
+      continue;
+    }
+    fill = buffer_size - (snd_pcm_sframes_t)snd_pcm_status_get_avail(status);
+    if (fill < 0)
+      fill = 0;
+    snd_pcm_status_get_htstamp(status, &tstamp);
+    if (tstamp.tv_sec == 0 && tstamp.tv_nsec == 0)
+      clock_gettime(CLOCK_MONOTONIC, &tstamp);
+    pcm_stats_wakeup(&pcm_stats_playback, handle);
+    /* the timer aimed at the watermark: whatever is missing is jitter */
+    if (timed && state == SND_PCM_STATE_RUNNING) {
+      late = watermark - fill;
+      if (late > jitter)
+        jitter = late;
+      else
+        jitter -= jitter / 64 + (jitter > 0);
+    }
+    watermark = floor_wm + 2 * jitter;
+    if (cut_latency) {
+      cut_latency = 0;
+      if (target / 2 >= (snd_pcm_uframes_t)(2 * watermark))
+        target /= 2;
+      n = fill - (snd_pcm_sframes_t)target;
+      if (n > 0 && (rewound = snd_pcm_rewindable(handle)) > 0) {
+        rewound = snd_pcm_rewind(handle, n < rewound ? n : rewound);
+        if (rewound > 0) {
+          /* the generator resumes from the oldest discarded sample */
+          fill -= rewound;
+          phase = fmod(phase - rewound * step, max_phase);
+          if (phase < 0)
+            phase += max_phase;
+          if (loop_mode)
+            osc_loop_rewind(&loop, rewound);
+        }
+      }
+      if (verbose)
+        printf("tsched: target %lu frames, watermark %li, jitter %li\n",
+               target, watermark, jitter);
+    }
+    if (watermark > (snd_pcm_sframes_t)target / 2)
+      watermark = target / 2;
+    /* top up to the target */
+    while (fill < (snd_pcm_sframes_t)target && !transfer_done()) {
+      n = target - fill;
+      if (n > period_size)
+        n = period_size;
+      generate_sine(areas, 0, n, &phase);
+      err = snd_pcm_writei(handle, samples, n);
+      bench.calls++;
+      if (err < 0) {
+        if ((err = xrun_recovery(handle, err)) < 0) {
+          printf("Write error: %s\n", snd_strerror(err));
+          goto out;
+        }
+        break;
+      }
+      count_period(err);
+      fill += err;
+    }
+    if (snd_pcm_state(handle) == SND_PCM_STATE_PREPARED) {
+      if ((err = snd_pcm_start(handle)) < 0) {
+        printf("Start error: %s\n", snd_strerror(err));
+        break;
+      }
+      bench.calls++;
+      clock_gettime(CLOCK_MONOTONIC, &tstamp);
+    }
+    /* sleep until the queue drains to the watermark */
+    deadline = ts_ns(&tstamp) + (fill - watermark) * 1000000000LL / rate;
+    its.it_value.tv_sec = deadline / 1000000000LL;
+    its.it_value.tv_nsec = deadline % 1000000000LL;
+    timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+    timed = read(timerfd, &ticks, sizeof(ticks)) > 0;
+    bench.calls++;
+    if (!timed && errno != EINTR) {
+      err = -errno;
+      break;
+    }
+  }
+ out:
+  close(timerfd);
+  return err < 0 ? err : 0;
 }
  
 /*
@@ -689,6 +1274,10 @@ static struct transfer_method transfer_methods[] = {
   { "direct_interleaved", SND_PCM_ACCESS_MMAP_INTERLEAVED, direct_loop },
   { "direct_noninterleaved", SND_PCM_ACCESS_MMAP_NONINTERLEAVED, direct_loop },
   { "direct_write", SND_PCM_ACCESS_MMAP_INTERLEAVED, direct_write_loop },
+  { "epoll", SND_PCM_ACCESS_RW_INTERLEAVED, epoll_loop },
+  { "callback", SND_PCM_ACCESS_RW_INTERLEAVED, callback_loop },
+  { "callback_timer", SND_PCM_ACCESS_RW_INTERLEAVED, callback_timer_loop },
+  { "tsched", SND_PCM_ACCESS_RW_INTERLEAVED, tsched_loop },
   { NULL, SND_PCM_ACCESS_RW_INTERLEAVED, NULL }
 };
 static void help(void)
@@ -706,9 +1295,17 @@ static void help(void)
 "-m,--method    transfer method\n"
 "-o,--format    sample format\n"
 "-v,--verbose   show the PCM setup parameters\n"
-"-n,--noresample  do not resample\n"
+"-n,--noresample  do not resample (default)\n"
+"-R,--resample    let alsa-lib resample instead of playing at the native rate\n"
 "-e,--pevent    enable poll event after each period\n"
+"-B,--bench     run every transfer method for this many frames and compare\n"
+"-H,--hugepages back stream memory with huge pages\n"
+"-L,--loop      render whole sine cycles once and replay them\n"
+"\n"
+"SIGUSR1 prints xrun and wakeup statistics, SIGUSR2 halves the tsched latency\n"
 "\n");
+  rt_usage(stdout);
+  kernel_usage(stdout);
   printf("Recognized sample formats are:");
   for (k = 0; k < SND_PCM_FORMAT_LAST; ++k) {
     const char *s = snd_pcm_format_name(k);
@@ -721,6 +1318,122 @@ static void help(void)
     printf(" %s", transfer_methods[k].name);
   printf("\n");
 }
+/*
+ *   Open the device, set it up and run one transfer method
+ */
+static int run_method(int method)
+{
+        snd_pcm_t *handle;
+        int err;
+        snd_pcm_hw_params_t *hwparams;
+        snd_pcm_sw_params_t *swparams;
+        signed short *samples;
+        unsigned int chn;
+        snd_pcm_channel_area_t *areas;
+        size_t mark = arena_mark(&arena);
+        hwparams = arena_hw_params(&arena);
+        swparams = arena_sw_params(&arena);
+        if (hwparams == NULL || swparams == NULL) {
+	  printf("No enough memory\n");
+	  exit(EXIT_FAILURE);
+        }
+        tsched = transfer_methods[method].transfer_loop == tsched_loop;
+        if ((err = snd_pcm_open(&handle, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+	  printf("Playback open error: %s\n", snd_strerror(err));
+	  return err;
+        }
+        
+        if ((err = set_hwparams(handle, hwparams, transfer_methods[method].access)) < 0) {
+	  printf("Setting of hwparams failed: %s\n", snd_strerror(err));
+	  exit(EXIT_FAILURE);
+        }
+        /* format, channels and rate are final: pick the sine writer once */
+        osc_gen_init(&gen, format, channels, freq, rate,
+                     transfer_methods[method].access != SND_PCM_ACCESS_MMAP_NONINTERLEAVED);
+        if (verbose > 0)
+	  printf("Sine writer: %s\n", gen.name);
+        if (loop_mode) {
+	  err = osc_loop_init(&loop, &arena, format, channels, freq, rate, LOOP_MAX_BYTES,
+			      transfer_methods[method].access != SND_PCM_ACCESS_MMAP_NONINTERLEAVED);
+	  if (err < 0) {
+	    printf("Unable to render the loop: %s\n", snd_strerror(err));
+	    exit(EXIT_FAILURE);
+	  }
+	  printf("Loop of %lu frames, %lu cycles at %.6fHz (%+.3gHz, %+.3f ppm)\n",
+		 loop.length, loop.cycles, loop.freq, loop.error, loop.error / freq * 1e6);
+        }
+        if ((err = set_swparams(handle, swparams)) < 0) {
+	  printf("Setting of swparams failed: %s\n", snd_strerror(err));
+	  exit(EXIT_FAILURE);
+        }
+        pcm_stats_attach(&pcm_stats_playback, handle);
+        restart_init(transfer_methods[method].access);
+        if (verbose > 0)
+	  snd_pcm_dump(handle, output);
+        samples = arena_alloc(&arena, (period_size * channels * snd_pcm_format_physical_width(format)) / 8, 0);
+        if (samples == NULL) {
+	  printf("No enough memory\n");
+	  exit(EXIT_FAILURE);
+        }
+        
+        areas = arena_alloc(&arena, channels * sizeof(snd_pcm_channel_area_t), 0);
+        if (areas == NULL) {
+	  printf("No enough memory\n");
+	  exit(EXIT_FAILURE);
+        }
+        for (chn = 0; chn < channels; chn++) {
+	  areas[chn].addr = samples;
+	  areas[chn].first = chn * snd_pcm_format_physical_width(format);
+	  areas[chn].step = channels * snd_pcm_format_physical_width(format);
+        }
+        err = transfer_methods[method].transfer_loop(handle, samples, areas);
+        if (err < 0)
+	  printf("Transfer failed: %s\n", snd_strerror(err));
+        snd_pcm_close(handle);
+        arena_reset(&arena, mark);
+        return err;
+}
+static double tv_seconds(struct timeval *tv)
+{
+  return tv->tv_sec + tv->tv_usec / 1e6;
+}
+/*
+ *   Transfer method comparison - run every method for bench_frames
+ *   frames and tabulate what each one costs
+ */
+static void bench_methods(void)
+{
+  struct rusage ru0, ru1;
+  double t0, t1, cpu, mean, jitter;
+  int k, err;
+  printf("Comparing transfer methods over %lu frames\n", bench_frames);
+  printf("%-22s %8s %8s %6s %10s %10s %12s %10s\n", "method", "wall s", "cpu ms",
+         "cpu %", "wakeups/s", "invol cs", "calls/period", "jitter us");
+  for (k = 0; transfer_methods[k].name; k++) {
+    memset(&bench, 0, sizeof(bench));
+    getrusage(RUSAGE_SELF, &ru0);
+    t0 = now();
+    bench.last = t0;
+    err = run_method(k);
+    t1 = now();
+    getrusage(RUSAGE_SELF, &ru1);
+    printf("%-22s ", transfer_methods[k].name);
+    if (err < 0) {
+      printf("failed: %s\n", snd_strerror(err));
+      continue;
+    }
+    cpu = tv_seconds(&ru1.ru_utime) - tv_seconds(&ru0.ru_utime) +
+      tv_seconds(&ru1.ru_stime) - tv_seconds(&ru0.ru_stime);
+    mean = bench.periods ? bench.sum / bench.periods : 0;
+    jitter = bench.periods ? sqrt(fabs(bench.sumsq / bench.periods - mean * mean)) : 0;
+    printf("%8.3f %8.1f %6.1f %10.1f %10ld %12.2f %10.1f\n",
+           t1 - t0, cpu * 1e3, 100 * cpu / (t1 - t0),
+           (ru1.ru_nvcsw - ru0.ru_nvcsw) / (t1 - t0),
+           ru1.ru_nivcsw - ru0.ru_nivcsw,
+           (double) bench.calls * period_size / bench.frames,
+           jitter * 1e6);
+  }
+}
 int main(int argc, char *argv[])
 {
         struct option long_option[] =
@@ -736,23 +1449,22 @@ int main(int argc, char *argv[])
 	    {"format", 1, NULL, 'o'},
 	    {"verbose", 1, NULL, 'v'},
 	    {"noresample", 1, NULL, 'n'},
+	    {"resample", 0, NULL, 'R'},
 	    {"pevent", 1, NULL, 'e'},
+	    {"bench", 1, NULL, 'B'},
+	    {"hugepages", 0, NULL, 'H'},
+	    {"loop", 0, NULL, 'L'},
 	    {NULL, 0, NULL, 0},
 	  };
-        snd_pcm_t *handle;
         int err, morehelp;
-        snd_pcm_hw_params_t *hwparams;
-        snd_pcm_sw_params_t *swparams;
         int method = 0;
-        signed short *samples;
-        unsigned int chn;
-        snd_pcm_channel_area_t *areas;
-        snd_pcm_hw_params_alloca(&hwparams);
-        snd_pcm_sw_params_alloca(&swparams);
+        int device_set = 0;
         morehelp = 0;
+        rt_parse_args(&argc, argv, &rt);
+        kernel_parse_args(&argc, argv, &kernel);
         while (1) {
 	  int c;
-	  if ((c = getopt_long(argc, argv, "hD:r:c:f:b:p:m:o:vne", long_option, NULL)) < 0)
+	  if ((c = getopt_long(argc, argv, "hD:r:c:f:b:p:m:o:vnReB:HL", long_option, NULL)) < 0)
 	    break;
 	  switch (c) {
 	  case 'h':
@@ -760,6 +1472,7 @@ int main(int argc, char *argv[])
 	    break;
 	  case 'D':
 	    device = strdup(optarg);
+	    device_set = 1;
 	    break;
 	  case 'r':
 	    rate = atoi(optarg);
@@ -816,60 +1529,64 @@ int main(int argc, char *argv[])
 	  case 'n':
 	    resample = 0;
 	    break;
+	  case 'R':
+	    resample = 1;
+	    break;
 	  case 'e':
 	    period_event = 1;
 	    break;
+	  case 'B':
+	    bench_frames = atol(optarg);
+	    break;
+	  case 'H':
+	    hugepages = 1;
+	    break;
+	  case 'L':
+	    loop_mode = 1;
+	    break;
 	  }
         }
         if (morehelp) {
 	  help();
 	  return 0;
         }
+        if (kernel.check)
+	  return osc_kernel_report(stdout) ? 1 : 0;
+        osc_kernel_select(kernel.isa);
+        rt_apply(&rt);
+        /* a period and the restart fill each fit in the buffer: reserve twice */
+        /* the buffer time of samples, plus the areas and small per stream blocks */
+        /* (poll descriptors, the reactor's too); */
+        /* without resampling the device may run at any native rate up to 196kHz; */
+        /* the loop takes at most LOOP_MAX_BYTES more */
+        err = arena_init(&arena,
+                         2 * ((size_t)(resample ? rate : 196000) * buffer_time / 1000000 + 1) * channels * 8 +
+                         channels * sizeof(snd_pcm_channel_area_t) + 65536 +
+                         (loop_mode ? LOOP_MAX_BYTES : 0),
+                         hugepages ? ARENA_HUGE : 0);
+        if (err < 0) {
+	  printf("Unable to reserve stream memory: %s\n", snd_strerror(err));
+	  return 1;
+        }
+        if (hugepages && !arena.huge)
+	  printf("No huge pages available, using normal pages\n");
         err = snd_output_stdio_attach(&output, stdout, 0);
         if (err < 0) {
 	  printf("Output failed: %s\n", snd_strerror(err));
 	  return 0;
         }
+        if (bench_frames && !device_set)
+	  device = "null";
         printf("Playback device is %s\n", device);
         printf("Stream parameters are %iHz, %s, %i channels\n", rate, snd_pcm_format_name(format), channels);
         printf("Sine wave rate is %.4fHz\n", freq);
-        printf("Using transfer method: %s\n", transfer_methods[method].name);
-        if ((err = snd_pcm_open(&handle, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
-	  printf("Playback open error: %s\n", snd_strerror(err));
+        printf("Sample kernels: %s\n", kernel_isa_names[osc_kernel->isa]);
+        if (!bench_frames)
+	  printf("Using transfer method: %s\n", transfer_methods[method].name);
+        if (bench_frames) {
+	  bench_methods();
 	  return 0;
         }
-        
-        if ((err = set_hwparams(handle, hwparams, transfer_methods[method].access)) < 0) {
-	  printf("Setting of hwparams failed: %s\n", snd_strerror(err));
-	  exit(EXIT_FAILURE);
-        }
-        if ((err = set_swparams(handle, swparams)) < 0) {
-	  printf("Setting of swparams failed: %s\n", snd_strerror(err));
-	  exit(EXIT_FAILURE);
-        }
-        if (verbose > 0)
-	  snd_pcm_dump(handle, output);
-        samples = malloc((period_size * channels * snd_pcm_format_physical_width(format)) / 8);
-        if (samples == NULL) {
-	  printf("No enough memory\n");
-	  exit(EXIT_FAILURE);
-        }
-        
-        areas = calloc(channels, sizeof(snd_pcm_channel_area_t));
-        if (areas == NULL) {
-	  printf("No enough memory\n");
-	  exit(EXIT_FAILURE);
-        }
-        for (chn = 0; chn < channels; chn++) {
-	  areas[chn].addr = samples;
-	  areas[chn].first = chn * snd_pcm_format_physical_width(format);
-	  areas[chn].step = channels * snd_pcm_format_physical_width(format);
-        }
-        err = transfer_methods[method].transfer_loop(handle, samples, areas);
-        if (err < 0)
-	  printf("Transfer failed: %s\n", snd_strerror(err));
-        free(areas);
-        free(samples);
-        snd_pcm_close(handle);
+        run_method(method);
         return 0;
 }
@@ -0,0 +1,301 @@
+/**
+ * Period size tuner: plays a sine with decreasing period sizes,
+ * counts the xruns at each one and saves the smallest configuration
+ * that ran clean, for the "tuned" profile of mypcm.h.
+ *
+ * Compile:
+ * gcc  tune_period.c -o tune_period -lasound -lm -lpthread
+ *
+ * Usage:
+ * $ ./tune_period [-D device] [-r rate] [-c channels] [-n periods]
+ *                 [-s seconds_per_step] [-l load_threads] [-o file]
+ *                 [rt flags]
+ *
+ * Examples:
+ * $ ./tune_period
+ * $ ./tune_period -l 3 -s 30 -o /etc/pcm_tuned.conf
+ *
+ * Period sizes are halved from 8192 frames down to 16, with a buffer
+ * of periods (default 2) periods, until a step sees an xrun.
+ * -l starts that many busy threads pinned to the other CPUs, while
+ * the stream runs on CPU 0, to find a size that survives a loaded box.
+ * Tune with the same real-time flags (rt.h) the tools will run with.
+ */
+
+#include "rt.h"
+#include "mypcm.h"
+#include "osc.h"
+#include "arena.h"
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#define MAX_PERIOD 8192
+#define MIN_PERIOD 16
+#define MAX_LOAD 64
+
+static _Atomic int loading = 0;
+static struct arena arena;		/* period buffers of the steps */
+
+
+/**
+ * Synthetic load: spin on floating point work until told to stop
+ * @param *arg unused
+ */
+static void *load_thread(void *arg)
+{
+    volatile double x = 1.0;
+
+    while (atomic_load_explicit(&loading, memory_order_relaxed))
+	x = x * 1.0000001 + 1e-9;
+    return NULL;
+}
+
+
+/**
+ * Pin the caller to CPU 0 and start busy threads on the other CPUs
+ * @param *threads thread ids to fill in
+ * @param count threads to start
+ */
+static void start_load(pthread_t *threads,
+		       int count)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    int i;
+
+    atomic_store(&loading, 1);
+    CPU_ZERO(&set);
+    CPU_SET(0, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+    for (i = 0; i < count; i++)
+    {
+	if (pthread_create(&threads[i], NULL, load_thread, NULL))
+	{
+	    printf("ERROR: Can't start load thread\n");
+	    exit(1);
+	}
+	if (cpus > 1)
+	{
+	    CPU_ZERO(&set);
+	    CPU_SET(1 + i % (cpus - 1), &set);
+	    pthread_setaffinity_np(threads[i], sizeof(set), &set);
+	}
+    }
+}
+
+
+static void stop_load(pthread_t *threads,
+		      int count)
+{
+    int i;
+
+    atomic_store(&loading, 0);
+    for (i = 0; i < count; i++)
+	pthread_join(threads[i], NULL);
+}
+
+
+/**
+ * Play a sine for a while with one period size and count the xruns
+ * @param *device device to play to
+ * @param *rate wanted stream rate, returns the native rate set
+ * @param channels channels count
+ * @param *period wanted period size, returns the one set
+ * @param *buffer returns the buffer size set
+ * @param periods periods per buffer
+ * @param seconds how long to play
+ * @return xruns seen, or -1 if the device refused the sizes
+ */
+static int run_step(char *device,
+		    unsigned int *rate,
+		    unsigned int channels,
+		    snd_pcm_uframes_t *period,
+		    snd_pcm_uframes_t *buffer,
+		    unsigned int periods,
+		    int seconds)
+{
+    snd_pcm_t *pcm_handle;
+    snd_pcm_hw_params_t *params;
+    snd_pcm_sw_params_t *swparams;
+    snd_pcm_channel_area_t areas[channels];
+    snd_pcm_uframes_t done, total;
+    snd_pcm_sframes_t n;
+    double phase = 0;
+    snd_pcm_format_t format;
+    unsigned int chn, width;
+    int dir = 0, xruns = 0;
+    size_t mark;
+    char *buf;
+
+    open_pcm(&pcm_handle, device, SND_PCM_STREAM_PLAYBACK, 0);
+    snd_pcm_hw_params_alloca(&params);
+    snd_pcm_hw_params_any(pcm_handle, params);
+    set_access(pcm_handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
+    format = set_native_format(pcm_handle, params, SND_PCM_FORMAT_S16_LE, NULL);
+    width = snd_pcm_format_physical_width(format);
+    set_channels(pcm_handle, params, channels);
+    *rate = set_native_rate(pcm_handle, params, *rate);
+    total = (snd_pcm_uframes_t) seconds * *rate;
+    *buffer = *period * periods;
+    if (snd_pcm_hw_params_set_buffer_size_near(pcm_handle, params, buffer) < 0 ||
+	snd_pcm_hw_params_set_period_size_near(pcm_handle, params,
+					       period, &dir) < 0 ||
+	snd_pcm_hw_params(pcm_handle, params) < 0)
+    {
+	snd_pcm_close(pcm_handle);
+	return -1;
+    }
+    snd_pcm_hw_params_get_period_size(params, period, &dir);
+    snd_pcm_hw_params_get_buffer_size(params, buffer);
+
+    snd_pcm_sw_params_alloca(&swparams);
+    snd_pcm_sw_params_current(pcm_handle, swparams);
+    snd_pcm_sw_params_set_start_threshold(pcm_handle, swparams,
+					  (*buffer / *period) * *period);
+    snd_pcm_sw_params_set_avail_min(pcm_handle, swparams, *period);
+    snd_pcm_sw_params(pcm_handle, swparams);
+
+    /* every step takes its buffer from the arena and gives it back */
+    mark = arena_mark(&arena);
+    buf = arena_alloc(&arena, *period * channels * width / 8, 0);
+    if (buf == NULL)
+    {
+	printf("ERROR: No enough memory\n");
+	exit(1);
+    }
+    for (chn = 0; chn < channels; chn++)
+    {
+	areas[chn].addr = buf;
+	areas[chn].first = chn * width;
+	areas[chn].step = channels * width;
+    }
+
+    for (done = 0; done < total; done += *period)
+    {
+	osc_generate(areas, 0, *period, channels, format,
+		     440, *rate, &phase);
+	n = snd_pcm_writei(pcm_handle, buf, *period);
+	if (n == -EPIPE || n == -ESTRPIPE)
+	{
+	    xruns++;
+	    snd_pcm_recover(pcm_handle, n, 1);
+	}
+	else if (n < 0)
+	{
+	    printf("ERROR: Can't write to PCM device. %s\n", snd_strerror(n));
+	    exit(1);
+	}
+    }
+    snd_pcm_drop(pcm_handle);
+    snd_pcm_close(pcm_handle);
+    arena_reset(&arena, mark);
+    return xruns;
+}
+
+
+int main(int argc, char *argv[])
+{
+    char *device = PCM_DEVICE;
+    char *out = PCM_TUNED_FILE;
+    unsigned int rate = 44100, channels = 2, periods = 2;
+    int seconds = 10, load = 0, xruns, c;
+    snd_pcm_uframes_t want, period, buffer;
+    snd_pcm_uframes_t best_period = 0, best_buffer = 0;
+    pthread_t threads[MAX_LOAD];
+    struct rt_config rt;
+    FILE *f;
+
+    rt_parse_args(&argc, argv, &rt);
+    while ((c = getopt(argc, argv, "D:r:c:n:s:l:o:")) != -1)
+    {
+	switch (c)
+	{
+	case 'D':
+	    device = optarg;
+	    break;
+	case 'r':
+	    rate = atoi(optarg);
+	    break;
+	case 'c':
+	    channels = atoi(optarg);
+	    channels = channels < 1 ? 1 : channels;
+	    break;
+	case 'n':
+	    periods = atoi(optarg);
+	    periods = periods < 2 ? 2 : periods;
+	    break;
+	case 's':
+	    seconds = atoi(optarg);
+	    seconds = seconds < 1 ? 1 : seconds;
+	    break;
+	case 'l':
+	    load = atoi(optarg);
+	    load = load > MAX_LOAD ? MAX_LOAD : load;
+	    break;
+	case 'o':
+	    out = optarg;
+	    break;
+	default:
+	    printf("Usage: %s [-D device] [-r rate] [-c channels] "
+		   "[-n periods] [-s seconds_per_step] [-l load_threads] "
+		   "[-o file]\n", argv[0]);
+	    rt_usage(stdout);
+	    exit(1);
+	}
+    }
+
+    /* twice the biggest period, in the widest format a device may take */
+    if (arena_init(&arena, 2 * MAX_PERIOD * channels * 4 + 65536, 0) < 0)
+    {
+	printf("ERROR: No enough memory\n");
+	exit(1);
+    }
+    if (load > 0)
+	start_load(threads, load);
+    rt_apply(&rt);
+    for (want = MAX_PERIOD; want >= MIN_PERIOD; want /= 2)
+    {
+	period = want;
+	xruns = run_step(device, &rate, channels, &period, &buffer,
+			 periods, seconds);
+	if (xruns < 0)
+	{
+	    printf("period %5lu: not supported by the device\n", want);
+	    continue;
+	}
+	printf("period %5lu buffer %6lu (%7.2f ms): %d xruns\n", period,
+	       buffer, buffer * 1000.0 / rate, xruns);
+	if (xruns > 0)
+	    break;
+	if (best_period == 0 || period < best_period)
+	{
+	    best_period = period;
+	    best_buffer = buffer;
+	}
+    }
+    if (load > 0)
+	stop_load(threads, load);
+    arena_destroy(&arena);
+
+    if (best_period == 0)
+    {
+	printf("ERROR: No period size ran without xruns\n");
+	exit(1);
+    }
+    f = fopen(out, "w");
+    if (f == NULL)
+    {
+	printf("ERROR: Can't write \"%s\". %s\n", out, strerror(errno));
+	exit(1);
+    }
+    fprintf(f, "# tune_period: %d s per step, %d load threads\n",
+	    seconds, load);
+    fprintf(f, "device=%s\nrate=%u\nchannels=%u\n", device, rate, channels);
+    fprintf(f, "period_size=%lu\nbuffer_size=%lu\n", best_period, best_buffer);
+    fclose(f);
+    printf("smallest stable: period %lu, buffer %lu (%.2f ms), saved to %s\n",
+	   best_period, best_buffer, best_buffer * 1000.0 / rate, out);
+    return 0;
+}
@@ -0,0 +1,312 @@
+#ifndef WAV_H
+#define WAV_H
+
+#include <alsa/asoundlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define WAVE_FORMAT_PCM 0x0001
+#define WAVE_FORMAT_IEEE_FLOAT 0x0003
+#define WAVE_FORMAT_EXTENSIBLE 0xFFFE
+#define WAV_DATA_UNKNOWN ((uint64_t) -1)	/* data chunk runs to end of stream */
+#define WAV_HEADER_SIZE 44			/* RIFF, fmt and data headers */
+
+/**
+ * Stream parameters and data chunk location of a RIFF/WAVE file
+ */
+struct wav_info
+{
+    snd_pcm_format_t format;
+    unsigned int channels;
+    unsigned int rate;
+    unsigned int block_align;	/* bytes per frame */
+    uint64_t data_offset;	/* byte offset of the first sample */
+    uint64_t data_size;		/* bytes of sample data */
+};
+
+
+static uint16_t wav_le16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+
+static uint32_t wav_le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+
+/**
+ * Read exactly len bytes, retrying short reads from pipes
+ * @param fd file descriptor
+ * @param *buf destination
+ * @param len bytes wanted
+ * @return bytes read, less than len only at end of file, or -errno
+ */
+ssize_t wav_read_full(int fd,
+		      void *buf,
+		      size_t len)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len)
+    {
+	n = read(fd, (char *) buf + done, len - done);
+	if (n < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    return -errno;
+	}
+	if (n == 0)
+	    break;
+	done += n;
+    }
+    return done;
+}
+
+
+/**
+ * Skip over len bytes of a stream that may not be seekable
+ * @param fd file descriptor
+ * @param len bytes to skip
+ * @return 0 on success, -EINVAL on early end of file or -errno
+ */
+static int wav_skip(int fd,
+		    uint64_t len)
+{
+    char scratch[4096];
+    ssize_t n;
+
+    if (lseek(fd, len, SEEK_CUR) >= 0)
+	return 0;
+    while (len > 0)
+    {
+	n = wav_read_full(fd, scratch,
+			  len < sizeof(scratch) ? len : sizeof(scratch));
+	if (n <= 0)
+	    return n < 0 ? n : -EINVAL;
+	len -= n;
+    }
+    return 0;
+}
+
+
+/**
+ * Map a WAVE format tag and sample layout to an ALSA sample format
+ * @param tag WAVE_FORMAT_PCM or WAVE_FORMAT_IEEE_FLOAT
+ * @param bits container bits per sample
+ * @return ALSA format, or SND_PCM_FORMAT_UNKNOWN
+ */
+static snd_pcm_format_t wav_format(unsigned int tag,
+				   unsigned int bits)
+{
+    if (tag == WAVE_FORMAT_IEEE_FLOAT)
+	return bits == 32 ? SND_PCM_FORMAT_FLOAT_LE :
+	    bits == 64 ? SND_PCM_FORMAT_FLOAT64_LE : SND_PCM_FORMAT_UNKNOWN;
+    if (tag != WAVE_FORMAT_PCM)
+	return SND_PCM_FORMAT_UNKNOWN;
+    switch (bits)
+    {
+    case 8:
+	return SND_PCM_FORMAT_U8;
+    case 16:
+	return SND_PCM_FORMAT_S16_LE;
+    case 24:
+	return SND_PCM_FORMAT_S24_3LE;
+    case 32:
+	/* 24 valid bits in a 32 bit container are MSB aligned, same as S32 */
+	return SND_PCM_FORMAT_S32_LE;
+    }
+    return SND_PCM_FORMAT_UNKNOWN;
+}
+
+
+/**
+ * Parse a RIFF/WAVE header from a stream, leaving the stream positioned
+ * at the first sample. Only reads forward, so pipes work too.
+ * Handles fmt (including WAVE_FORMAT_EXTENSIBLE) and data chunks and
+ * skips LIST and any other chunk.
+ * @param fd file descriptor at the start of the file
+ * @param *info stream parameters to fill in
+ * @return 0 on success, -EINVAL if the stream isn't a supported WAVE file
+ */
+int wav_read_header(int fd,
+		    struct wav_info *info)
+{
+    unsigned char buf[40];
+    uint64_t pos;
+    uint32_t size;
+    unsigned int tag = 0, bits = 0;
+    int have_fmt = 0, err;
+
+    if (wav_read_full(fd, buf, 12) != 12 ||
+	memcmp(buf, "RIFF", 4) || memcmp(buf + 8, "WAVE", 4))
+	return -EINVAL;
+    pos = 12;
+
+    while (1)
+    {
+	if (wav_read_full(fd, buf, 8) != 8)
+	    return -EINVAL;
+	pos += 8;
+	size = wav_le32(buf + 4);
+
+	if (!memcmp(buf, "data", 4))
+	{
+	    if (!have_fmt)
+		return -EINVAL;
+	    info->data_offset = pos;
+	    /* streaming writers leave the size at 0 or ~0 */
+	    info->data_size = (size == 0 || size == 0xFFFFFFFF) ?
+		WAV_DATA_UNKNOWN : size;
+	    return 0;
+	}
+
+	if (!memcmp(buf, "fmt ", 4))
+	{
+	    unsigned int len = size < sizeof(buf) ? size : sizeof(buf);
+	    if (size < 16 || wav_read_full(fd, buf, len) != len)
+		return -EINVAL;
+	    tag = wav_le16(buf);
+	    info->channels = wav_le16(buf + 2);
+	    info->rate = wav_le32(buf + 4);
+	    info->block_align = wav_le16(buf + 12);
+	    bits = wav_le16(buf + 14);
+	    if (tag == WAVE_FORMAT_EXTENSIBLE)
+	    {
+		if (len < 40)
+		    return -EINVAL;
+		/* first two bytes of the SubFormat GUID are the real tag */
+		tag = wav_le16(buf + 24);
+	    }
+	    info->format = wav_format(tag, bits);
+	    if (info->format == SND_PCM_FORMAT_UNKNOWN ||
+		info->channels == 0 || info->block_align == 0 ||
+		info->block_align != info->channels * (bits / 8))
+		return -EINVAL;
+	    have_fmt = 1;
+	    err = wav_skip(fd, size - len + (size & 1));
+	    pos += size + (size & 1);
+	}
+	else
+	{
+	    /* LIST, fact, cue and the rest carry nothing we play */
+	    err = wav_skip(fd, (uint64_t) size + (size & 1));
+	    pos += (uint64_t) size + (size & 1);
+	}
+	if (err < 0)
+	    return err;
+    }
+}
+
+
+/**
+ * Map an ALSA sample format to a WAVE format tag and sample size
+ * @param format ALSA format
+ * @param *tag returns WAVE_FORMAT_PCM or WAVE_FORMAT_IEEE_FLOAT
+ * @return bits per sample, or 0 if WAVE has no plain tag for the format
+ */
+static unsigned int wav_tag(snd_pcm_format_t format,
+			    unsigned int *tag)
+{
+    *tag = WAVE_FORMAT_PCM;
+    switch (format)
+    {
+    case SND_PCM_FORMAT_U8:
+	return 8;
+    case SND_PCM_FORMAT_S16_LE:
+	return 16;
+    case SND_PCM_FORMAT_S24_3LE:
+	return 24;
+    case SND_PCM_FORMAT_S32_LE:
+	return 32;
+    case SND_PCM_FORMAT_FLOAT_LE:
+	*tag = WAVE_FORMAT_IEEE_FLOAT;
+	return 32;
+    case SND_PCM_FORMAT_FLOAT64_LE:
+	*tag = WAVE_FORMAT_IEEE_FLOAT;
+	return 64;
+    default:
+	return 0;
+    }
+}
+
+
+static void wav_put16(unsigned char *p,
+		      uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+
+static void wav_put32(unsigned char *p,
+		      uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+
+/**
+ * Write a RIFF/WAVE header at the start of a file, without moving the
+ * file offset. Call it once before the data with data_size set to
+ * WAV_DATA_UNKNOWN and again at the end with the real size to fix up
+ * the chunk sizes. A data_offset past WAV_HEADER_SIZE is padded with a
+ * JUNK chunk, so the data can start on a block boundary for O_DIRECT.
+ * Sizes past 4 GiB are saturated, as readers of streamed files expect.
+ * @param fd file descriptor, seekable
+ * @param *info stream parameters; data_offset is WAV_HEADER_SIZE or
+ *              at least 8 bytes more
+ * @return 0 on success, -EINVAL for an unsupported format or offset, or -errno
+ */
+int wav_write_header(int fd,
+		     const struct wav_info *info)
+{
+    unsigned char buf[info->data_offset];
+    unsigned int tag, bits = wav_tag(info->format, &tag);
+    uint64_t riff;
+    uint32_t data, junk;
+    ssize_t n;
+
+    if (bits == 0 || info->data_offset < WAV_HEADER_SIZE ||
+	(info->data_offset > WAV_HEADER_SIZE &&
+	 info->data_offset < WAV_HEADER_SIZE + 8))
+	return -EINVAL;
+    riff = info->data_offset - 8 + info->data_size;
+    data = info->data_size >= 0xFFFFFFFF ? 0xFFFFFFFF : info->data_size;
+    memset(buf, 0, sizeof(buf));
+
+    memcpy(buf, "RIFF", 4);
+    wav_put32(buf + 4, info->data_size == WAV_DATA_UNKNOWN ||
+	      riff >= 0xFFFFFFFF ? 0xFFFFFFFF : riff);
+    memcpy(buf + 8, "WAVE", 4);
+    memcpy(buf + 12, "fmt ", 4);
+    wav_put32(buf + 16, 16);
+    wav_put16(buf + 20, tag);
+    wav_put16(buf + 22, info->channels);
+    wav_put32(buf + 24, info->rate);
+    wav_put32(buf + 28, info->rate * info->block_align);
+    wav_put16(buf + 32, info->block_align);
+    wav_put16(buf + 34, bits);
+    if (info->data_offset > WAV_HEADER_SIZE)
+    {
+	junk = info->data_offset - WAV_HEADER_SIZE - 8;
+	memcpy(buf + 36, "JUNK", 4);
+	wav_put32(buf + 40, junk);
+    }
+    memcpy(buf + info->data_offset - 8, "data", 4);
+    wav_put32(buf + info->data_offset - 4, data);
+
+    n = pwrite(fd, buf, sizeof(buf), 0);
+    if (n < 0)
+	return -errno;
+    return n == (ssize_t) sizeof(buf) ? 0 : -EIO;
+}
+
+#endif